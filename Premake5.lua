@@ -4,6 +4,7 @@ workspace "Basics of ray tracing"
    architecture "x64"
    systemversion "latest"
    toolset "v142"
+   cppdialect "C++17"
    optimize "Speed"
    buildoptions { "/openmp" }
    filter "configurations:Debug"
@@ -24,6 +25,7 @@ group "01. Ray generation"
       includedirs { "lib/linalg" }
       includedirs { "src/" }
       files {"src/ray_generation.h", "src/ray_generation.cpp" }
+      files {"src/tile_scheduler.h", "src/tile_scheduler.cpp" }
    
    project "Ray generation app"
       kind "ConsoleApp"
@@ -51,6 +53,7 @@ group "02. Moller-Trumbore algorithm"
       includedirs { "lib/linalg" }
       includedirs { "src/" }
       files {"src/ray_generation.h", "src/ray_generation.cpp" }
+      files {"src/tile_scheduler.h", "src/tile_scheduler.cpp" }
       files {"src/mt_algorithm.h", "src/mt_algorithm.cpp"}
    
    project "Moller-Trumbore algorithm app"
@@ -79,8 +82,11 @@ group "03. Lighting"
       includedirs { "lib/tinyobjloader" }
       includedirs { "src/" }
       files {"src/ray_generation.h", "src/ray_generation.cpp" }
+      files {"src/tile_scheduler.h", "src/tile_scheduler.cpp" }
       files {"src/mt_algorithm.h", "src/mt_algorithm.cpp"}
       files {"src/lighting.h", "src/lighting.cpp"}
+      files {"src/mapped_file.h", "src/mapped_file.cpp"}
+      files {"src/obj_loader.h", "src/obj_loader.cpp"}
    
    project "Lighting app"
       kind "ConsoleApp"
@@ -108,8 +114,11 @@ group "04. Shadow rays"
       includedirs { "lib/tinyobjloader" }
       includedirs { "src/" }
       files {"src/ray_generation.h", "src/ray_generation.cpp" }
+      files {"src/tile_scheduler.h", "src/tile_scheduler.cpp" }
       files {"src/mt_algorithm.h", "src/mt_algorithm.cpp"}
       files {"src/lighting.h", "src/lighting.cpp"}
+      files {"src/mapped_file.h", "src/mapped_file.cpp"}
+      files {"src/obj_loader.h", "src/obj_loader.cpp"}
       files {"src/shadow_rays.h", "src/shadow_rays.cpp"}
 
    project "ShadowRays app"
@@ -138,8 +147,11 @@ group "05. Reflection"
       includedirs { "lib/tinyobjloader" }
       includedirs { "src/" }
       files {"src/ray_generation.h", "src/ray_generation.cpp" }
+      files {"src/tile_scheduler.h", "src/tile_scheduler.cpp" }
       files {"src/mt_algorithm.h", "src/mt_algorithm.cpp"}
       files {"src/lighting.h", "src/lighting.cpp"}
+      files {"src/mapped_file.h", "src/mapped_file.cpp"}
+      files {"src/obj_loader.h", "src/obj_loader.cpp"}
       files {"src/shadow_rays.h", "src/shadow_rays.cpp"}
       files {"src/reflection.h", "src/reflection.cpp"}
    
@@ -169,8 +181,11 @@ group "06. Refraction"
       includedirs { "lib/tinyobjloader" }
       includedirs { "src/" }
       files {"src/ray_generation.h", "src/ray_generation.cpp" }
+      files {"src/tile_scheduler.h", "src/tile_scheduler.cpp" }
       files {"src/mt_algorithm.h", "src/mt_algorithm.cpp"}
       files {"src/lighting.h", "src/lighting.cpp"}
+      files {"src/mapped_file.h", "src/mapped_file.cpp"}
+      files {"src/obj_loader.h", "src/obj_loader.cpp"}
       files {"src/shadow_rays.h", "src/shadow_rays.cpp"}
       files {"src/reflection.h", "src/reflection.cpp"}
       files {"src/refraction.h", "src/refraction.cpp"}
@@ -201,8 +216,11 @@ group "07. Anti-aliasing"
       includedirs { "lib/tinyobjloader" }
       includedirs { "src/" }
       files {"src/ray_generation.h", "src/ray_generation.cpp" }
+      files {"src/tile_scheduler.h", "src/tile_scheduler.cpp" }
       files {"src/mt_algorithm.h", "src/mt_algorithm.cpp"}
       files {"src/lighting.h", "src/lighting.cpp"}
+      files {"src/mapped_file.h", "src/mapped_file.cpp"}
+      files {"src/obj_loader.h", "src/obj_loader.cpp"}
       files {"src/shadow_rays.h", "src/shadow_rays.cpp"}
       files {"src/reflection.h", "src/reflection.cpp"}
       files {"src/refraction.h", "src/refraction.cpp"}
@@ -234,8 +252,11 @@ group "08. AABB"
       includedirs { "lib/tinyobjloader" }
       includedirs { "src/" }
       files {"src/ray_generation.h", "src/ray_generation.cpp" }
+      files {"src/tile_scheduler.h", "src/tile_scheduler.cpp" }
       files {"src/mt_algorithm.h", "src/mt_algorithm.cpp"}
       files {"src/lighting.h", "src/lighting.cpp"}
+      files {"src/mapped_file.h", "src/mapped_file.cpp"}
+      files {"src/obj_loader.h", "src/obj_loader.cpp"}
       files {"src/shadow_rays.h", "src/shadow_rays.cpp"}
       files {"src/reflection.h", "src/reflection.cpp"}
       files {"src/refraction.h", "src/refraction.cpp"}
@@ -264,22 +285,33 @@ group "08. AABB"
 group "09. BVH"
    project "BVH lib"
       kind "StaticLib"
+      vectorextensions "AVX2"
       includedirs { "lib/stb" }
       includedirs { "lib/linalg" }
       includedirs { "lib/tinyobjloader" }
       includedirs { "src/" }
       files {"src/ray_generation.h", "src/ray_generation.cpp" }
+      files {"src/tile_scheduler.h", "src/tile_scheduler.cpp" }
       files {"src/mt_algorithm.h", "src/mt_algorithm.cpp"}
       files {"src/lighting.h", "src/lighting.cpp"}
+      files {"src/mapped_file.h", "src/mapped_file.cpp"}
+      files {"src/obj_loader.h", "src/obj_loader.cpp"}
       files {"src/shadow_rays.h", "src/shadow_rays.cpp"}
       files {"src/reflection.h", "src/reflection.cpp"}
       files {"src/refraction.h", "src/refraction.cpp"}
       files {"src/anti_aliasing.h", "src/anti_aliasing.cpp"}
       files {"src/aabb.h", "src/aabb.cpp"}
+      files {"src/simd.h"}
+      files {"src/triangle_block.h", "src/triangle_block.cpp"}
+      files {"src/triangle_intersectors.h", "src/triangle_intersectors.cpp"}
+      files {"src/ray_packet.h", "src/ray_packet.cpp"}
+      files {"src/indexed_geometry.h", "src/indexed_geometry.cpp"}
+      files {"src/scene_cache.h", "src/scene_cache.cpp"}
       files {"src/bvh.h", "src/bvh.cpp"}
       
    project "BVH app"
       kind "ConsoleApp"
+      vectorextensions "AVX2"
       includedirs { "lib/linalg" }
       includedirs { "src" }
       links "BVH lib"
@@ -287,6 +319,7 @@ group "09. BVH"
    
    project "BVH tests"
       kind "ConsoleApp"
+      vectorextensions "AVX2"
       includedirs { "lib/stb" }
       includedirs { "lib/linalg" }
       includedirs { "lib/catch2/single_include/catch2" }
@@ -296,27 +329,65 @@ group "09. BVH"
       debugargs { "--benchmark-samples", "25" }
       files {"tests/bvh_tests.cpp"}
 
+   project "BVH build tests"
+      kind "ConsoleApp"
+      vectorextensions "AVX2"
+      includedirs { "lib/stb" }
+      includedirs { "lib/linalg" }
+      includedirs { "lib/catch2/single_include/catch2" }
+      includedirs { "src" }
+      files { "tests/test_utils.h" }
+      links "BVH lib"
+      debugargs { "--benchmark-samples", "25" }
+      files {"tests/bvh_build_tests.cpp"}
+
 group "10. Denoising"
    project "Denoising lib"
       kind "StaticLib"
+      vectorextensions "AVX2"
       includedirs { "lib/stb" }
       includedirs { "lib/linalg" }
       includedirs { "lib/tinyobjloader" }
       includedirs { "src/" }
       files {"src/ray_generation.h", "src/ray_generation.cpp" }
+      files {"src/tile_scheduler.h", "src/tile_scheduler.cpp" }
       files {"src/mt_algorithm.h", "src/mt_algorithm.cpp"}
       files {"src/lighting.h", "src/lighting.cpp"}
+      files {"src/mapped_file.h", "src/mapped_file.cpp"}
+      files {"src/obj_loader.h", "src/obj_loader.cpp"}
       files {"src/shadow_rays.h", "src/shadow_rays.cpp"}
       files {"src/reflection.h", "src/reflection.cpp"}
       files {"src/refraction.h", "src/refraction.cpp"}
       files {"src/anti_aliasing.h", "src/anti_aliasing.cpp"}
       files {"src/aabb.h", "src/aabb.cpp"}
+      files {"src/simd.h"}
+      files {"src/triangle_block.h", "src/triangle_block.cpp"}
+      files {"src/triangle_intersectors.h", "src/triangle_intersectors.cpp"}
+      files {"src/ray_packet.h", "src/ray_packet.cpp"}
+      files {"src/indexed_geometry.h", "src/indexed_geometry.cpp"}
+      files {"src/scene_cache.h", "src/scene_cache.cpp"}
       files {"src/bvh.h", "src/bvh.cpp"}
+      files {"src/random.h"}
+      files {"src/sampler.h", "src/sampler.cpp"}
+      files {"src/atrous_filter.h", "src/atrous_filter.cpp"}
       files {"src/denoising.h", "src/denoising.cpp"}
       
    project "Denoising app"
       kind "ConsoleApp"
+      vectorextensions "AVX2"
       includedirs { "lib/linalg" }
       includedirs { "src" }
       links "Denoising lib"
-      files { "src/denoising_main.cpp" }
\ No newline at end of file
+      files { "src/denoising_main.cpp" }
+
+   project "Denoising tests"
+      kind "ConsoleApp"
+      vectorextensions "AVX2"
+      includedirs { "lib/stb" }
+      includedirs { "lib/linalg" }
+      includedirs { "lib/catch2/single_include/catch2" }
+      includedirs { "src" }
+      files { "tests/test_utils.h" }
+      links "Denoising lib"
+      debugargs { "--benchmark-samples", "25" }
+      files {"tests/denoising_tests.cpp"}
\ No newline at end of file
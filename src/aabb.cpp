@@ -1,7 +1,6 @@
 #include "aabb.h"
 
-//#define TINYOBJLOADER_IMPLEMENTATION
-#include "tiny_obj_loader.h"
+#include <limits>
 
 AABB::AABB(short width, short height) :AntiAliasing(width, height)
 {
@@ -13,17 +12,11 @@ AABB::~AABB()
 
 int AABB::LoadGeometry(std::string filename)
 {
-	tinyobj::attrib_t attrib;
-	std::vector<tinyobj::shape_t> shapes;
-	std::vector<tinyobj::material_t> materials;
-
+	ObjModel model;
 	std::string warn;
 	std::string err;
 
-	size_t delimeter = filename.find_last_of("/\\");
-	std::string directory = filename.substr(0, delimeter);
-
-	bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, filename.c_str(), directory.c_str());
+	bool ret = LoadObj(filename, model, warn, err);
 
 	if (!warn.empty()) {
 		std::cout << warn << std::endl;
@@ -37,60 +30,13 @@ int AABB::LoadGeometry(std::string filename)
 		exit(1);
 	}
 
-	// Loop over shapes
-	for (size_t s = 0; s < shapes.size(); s++) {
+	// Every group or object of the file is a mesh
+	for (unsigned int m = 0; m < model.MeshCount(); m++) {
 		Mesh mesh;
-
-		// Loop over faces(polygon)
-		size_t index_offset = 0;
-		for (size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++) {
-			int fv = shapes[s].mesh.num_face_vertices[f];
-
-			// Loop over vertices in the face.
-			std::vector<Vertex> vertexes;
-			for (size_t v = 0; v < fv; v++) {
-				// access to vertex
-				tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
-				if (idx.normal_index > 0)
-				{
-					vertexes.push_back(Vertex(float3{
-					attrib.vertices[3 * idx.vertex_index + 0],
-					attrib.vertices[3 * idx.vertex_index + 1],
-					attrib.vertices[3 * idx.vertex_index + 2] },
-					float3{
-						attrib.normals[3 * idx.normal_index + 0],
-						attrib.normals[3 * idx.normal_index + 1],
-						attrib.normals[3 * idx.normal_index + 2]
-						}));
-				}
-				else
-				{
-					vertexes.push_back(Vertex(float3{
-					attrib.vertices[3 * idx.vertex_index + 0],
-					attrib.vertices[3 * idx.vertex_index + 1],
-					attrib.vertices[3 * idx.vertex_index + 2]
-						}));
-				}
-			}
-			index_offset += fv;
-
-			MaterialTriangle triangle(vertexes[0], vertexes[1], vertexes[2]);
-
-			// per-face material
-			tinyobj::material_t material = materials[shapes[s].mesh.material_ids[f]];
-
-			triangle.SetEmisive(float3{ material.emission });
-			triangle.SetAmbient(float3{ material.ambient });
-			triangle.SetDiffuse(float3{ material.diffuse });
-			triangle.SetSpecular(float3{ material.specular }, material.shininess);
-			triangle.SetReflectiveness(material.illum == 5);
-			triangle.SetReflectivenessAndTransparency(material.illum == 7);
-			triangle.SetIor(material.ior);
-
-			mesh.AddTriangle(triangle);
-		}
-		meshes.push_back(mesh);
+		mesh.SetTriangles(model.triangles.begin() + model.mesh_offsets[m], model.triangles.begin() + model.mesh_offsets[m + 1]);
+		meshes.push_back(std::move(mesh));
 	}
+	load_report = model.report;
 
 	return 0;
 }
@@ -102,52 +48,75 @@ Payload AABB::TraceRay(const Ray& ray, const unsigned int max_raytrace_depth) co
 		return Miss(ray);
 	}
 
-	IntersectableData closestData(t_max);
-	MaterialTriangle closestTriangle;
+	HitRecord closest(t_max);
+	if (ClosestMeshHit(ray, closest))
+	{
+		return Hit(ray, closest, &meshes[closest.instance].Triangles()[closest.primitive], max_raytrace_depth);
+	}
 
-	for (auto& mesh : meshes) {
-		if (!mesh.AABBTest(ray)) {
+	return Miss(ray);
+}
+
+Payload AABB::TracePrimaryRay(const Ray& ray, PixelFeatures& features) const
+{
+	HitRecord closest(t_max);
+	if (!ClosestMeshHit(ray, closest))
+	{
+		return Miss(ray);
+	}
+	const MaterialTriangle& triangle = meshes[closest.instance].Triangles()[closest.primitive];
+	features.primitive = closest.primitive;
+	features.instance = closest.instance;
+	features.normal = triangle.GetNormal(closest.baricentric);
+	features.albedo = triangle.diffuse_color;
+	features.emission = triangle.emissive_color;
+	features.depth = closest.t;
+	return Hit(ray, closest, &triangle, raytracing_depth);
+}
+
+bool AABB::ClosestMeshHit(const Ray& ray, HitRecord& closest) const
+{
+	// Candidates only update the indices, with the mesh in place of the instance;
+	// the triangle is looked up once for the closest hit
+	float3 invRaydir = float3(1.0) / ray.direction;
+
+	for (unsigned int mesh = 0; mesh < meshes.size(); mesh++) {
+		if (!meshes[mesh].AABBTest(ray, invRaydir)) {
 			continue;
 		}
-		for (auto& object : mesh.Triangles())
+		const std::vector<MaterialTriangle>& triangles = meshes[mesh].Triangles();
+		for (unsigned int triangle = 0; triangle < triangles.size(); triangle++)
 		{
-			auto data = object.Intersect(ray);
-			if (data.t > t_min && data.t < closestData.t)
+			auto data = triangles[triangle].Intersect(ray);
+			if (data.t > t_min && data.t < closest.t)
 			{
-				closestData = data;
-				closestTriangle = object;
+				closest = HitRecord(data, triangle, mesh);
 			}
 		}
 	}
-
-	if (closestData.t < t_max)
-	{
-		return Hit(ray, closestData, &closestTriangle, max_raytrace_depth);
-	}
-
-	return Miss(ray);
+	return closest.t < t_max;
 }
 
-float AABB::TraceShadowRay(const Ray& ray, const float max_t) const
+bool AABB::Occluded(const Ray& ray, const float max_t) const
 {
-	IntersectableData closestData(max_t);
+	float3 invRaydir = float3(1.0) / ray.direction;
 	for (auto& mesh : meshes)
 	{
-		if (!mesh.AABBTest(ray))
+		if (!mesh.AABBTest(ray, invRaydir))
 		{
 			continue;
 		}
 		for (auto& object : mesh.Triangles())
 		{
 			auto data = object.Intersect(ray);
-			if (data.t > t_min && data.t < closestData.t)
+			if (data.t > t_min && data.t < max_t)
 			{
-				return data.t;
+				return true;
 			}
 		}
 	}
 
-	return max_t;
+	return false;
 }
 
 void Mesh::AddTriangle(const MaterialTriangle triangle)
@@ -166,9 +135,20 @@ void Mesh::AddTriangle(const MaterialTriangle triangle)
 	aabb_min = min(triangle.c.position, aabb_min);
 }
 
-bool Mesh::AABBTest(const Ray& ray) const
+void Mesh::SetTriangles(std::vector<MaterialTriangle>::const_iterator first, std::vector<MaterialTriangle>::const_iterator last)
+{
+	triangles.assign(first, last);
+	aabb_min = float3(std::numeric_limits<float>::max());
+	aabb_max = float3(-std::numeric_limits<float>::max());
+	for (const MaterialTriangle& triangle : triangles)
+	{
+		aabb_min = min(aabb_min, min(triangle.a.position, min(triangle.b.position, triangle.c.position)));
+		aabb_max = max(aabb_max, max(triangle.a.position, max(triangle.b.position, triangle.c.position)));
+	}
+}
+
+bool Mesh::AABBTest(const Ray& ray, const float3& invRaydir) const
 {
-	float3 invRaydir = float3(1.0) / ray.direction;
 	float3 t0 = (aabb_max - ray.position) * invRaydir;
 	float3 t1 = (aabb_min - ray.position) * invRaydir;
 	float3 tmin = min(t0, t1);
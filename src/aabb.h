@@ -1,6 +1,7 @@
 #pragma once
 
 #include "anti_aliasing.h"
+#include "obj_loader.h"
 
 class Mesh
 {
@@ -9,8 +10,10 @@ public:
 	virtual ~Mesh() { triangles.clear(); };
 
 	void AddTriangle(const MaterialTriangle triangle);
+	// Replaces the triangles with a range of loaded ones
+	void SetTriangles(std::vector<MaterialTriangle>::const_iterator first, std::vector<MaterialTriangle>::const_iterator last);
 	const std::vector<MaterialTriangle>& Triangles() const { return triangles; };
-	bool AABBTest(const Ray& ray) const;
+	bool AABBTest(const Ray& ray, const float3& inv_direction) const;
 
 	float3 aabb_min;
 	float3 aabb_max;
@@ -27,8 +30,16 @@ public:
 
 	virtual int LoadGeometry(std::string filename);
 	virtual Payload TraceRay(const Ray& ray, const unsigned int max_raytrace_depth) const;
-	virtual float TraceShadowRay(const Ray& ray, const float max_t) const;
+	virtual bool Occluded(const Ray& ray, const float max_t) const;
+
+	// Size, triangle count and parse throughput of the last loaded OBJ
+	const ObjLoadReport& GetLoadReport() const { return load_report; };
 
 protected:
+	virtual Payload TracePrimaryRay(const Ray& ray, PixelFeatures& features) const;
+	// Closest triangle over the meshes whose box the ray enters, with the mesh as the instance
+	bool ClosestMeshHit(const Ray& ray, HitRecord& closest) const;
+
 	std::vector<Mesh> meshes;
+	ObjLoadReport load_report;
 };
\ No newline at end of file
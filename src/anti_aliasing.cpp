@@ -1,5 +1,9 @@
 #include "anti_aliasing.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
 AntiAliasing::AntiAliasing(short width, short height) :Refraction(width, height)
 {
 }
@@ -10,23 +14,144 @@ AntiAliasing::~AntiAliasing()
 
 void AntiAliasing::DrawScene()
 {
+	if (edge_max_samples > 0)
+	{
+		DrawSceneEdgeAdaptive();
+		return;
+	}
 	camera.SetRenderTargetSize(width * 2, height * 2);
-	#pragma omp parallel for
-	for (short x = 0; x < width; x++)
+	scheduler.Run(width, height, [&](const Tile& tile)
+	{
+		for (short y = tile.y0; y < tile.y1; y++)
+		{
+			for (short x = tile.x0; x < tile.x1; x++)
+			{
+				Ray ray = camera.GetCameraRay(2*x, 2*y);
+				Payload payload = TraceRay(ray, raytracing_depth);
+				Ray ray1 = camera.GetCameraRay(2*x+1, 2*y);
+				Payload payload1 = TraceRay(ray1, raytracing_depth);
+				Ray ray2 = camera.GetCameraRay(2*x, 2*y+1);
+				Payload payload2 = TraceRay(ray2, raytracing_depth);
+				Ray ray3 = camera.GetCameraRay(2*x+1, 2*y+1);
+				Payload payload3 = TraceRay(ray3, raytracing_depth);
+				float3 color = payload.color + payload1.color + payload2.color + payload3.color;
+				SetPixel(x, y, color/4.0f);
+			}
+		}
+	});
+}
+
+void AntiAliasing::DrawSceneEdgeAdaptive()
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	const short grid = std::max<short>(static_cast<short>(std::sqrt(static_cast<float>(edge_max_samples))), 1);
+	pixel_features.assign(static_cast<size_t>(width) * height, PixelFeatures());
+
+	// One ray through the center of every pixel
+	camera.SetRenderTargetSize(width, height);
+	scheduler.Run(width, height, [&](const Tile& tile)
+	{
+		for (short y = tile.y0; y < tile.y1; y++)
+		{
+			for (short x = tile.x0; x < tile.x1; x++)
+			{
+				PixelFeatures& pixel = pixel_features[y * width + x];
+				pixel.color = TracePrimaryRay(camera.GetCameraRay(x, y), pixel).color;
+				SetPixel(x, y, pixel.color);
+			}
+		}
+	});
+
+	// A grid of rays where any of the four neighbours differs
+	std::vector<unsigned char> refined(pixel_features.size(), 0);
+	camera.SetRenderTargetSize(width * grid, height * grid);
+	scheduler.Run(width, height, [&](const Tile& tile)
 	{
-		#pragma omp parallel for
-		for (short y = 0; y < height; y++)
+		for (short y = tile.y0; y < tile.y1; y++)
 		{
-			Ray ray = camera.GetCameraRay(2*x, 2*y);
-			Payload payload = TraceRay(ray, raytracing_depth);
-			Ray ray1 = camera.GetCameraRay(2*x+1, 2*y);
-			Payload payload1 = TraceRay(ray1, raytracing_depth);
-			Ray ray2 = camera.GetCameraRay(2*x, 2*y+1);
-			Payload payload2 = TraceRay(ray2, raytracing_depth);
-			Ray ray3 = camera.GetCameraRay(2*x+1, 2*y+1);
-			Payload payload3 = TraceRay(ray3, raytracing_depth);
-			float3 color = payload.color + payload1.color + payload2.color + payload3.color;
-			SetPixel(x, y, color/4.0f);
+			for (short x = tile.x0; x < tile.x1; x++)
+			{
+				const PixelFeatures& pixel = pixel_features[y * width + x];
+				bool edge = (x > 0 && IsEdge(pixel, pixel_features[y * width + x - 1]))
+					|| (x + 1 < width && IsEdge(pixel, pixel_features[y * width + x + 1]))
+					|| (y > 0 && IsEdge(pixel, pixel_features[(y - 1) * width + x]))
+					|| (y + 1 < height && IsEdge(pixel, pixel_features[(y + 1) * width + x]));
+				if (!edge)
+				{
+					continue;
+				}
+				float3 color;
+				for (short j = 0; j < grid; j++)
+				{
+					for (short i = 0; i < grid; i++)
+					{
+						Ray ray = camera.GetCameraRay(grid * x + i, grid * y + j);
+						color += TraceRay(ray, raytracing_depth).color;
+					}
+				}
+				SetPixel(x, y, color / static_cast<float>(grid * grid));
+				refined[y * width + x] = 1;
+			}
 		}
+	});
+
+	edge_report = EdgeAdaptiveReport();
+	edge_report.pixel_count = static_cast<unsigned int>(pixel_features.size());
+	edge_report.refined_pixels = static_cast<unsigned int>(std::count(refined.begin(), refined.end(), 1));
+	edge_report.rays = edge_report.pixel_count + static_cast<unsigned long long>(edge_report.refined_pixels) * grid * grid;
+	edge_report.fixed_rays = 4ull * edge_report.pixel_count;
+	edge_report.ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+Payload AntiAliasing::TracePrimaryRay(const Ray& ray, PixelFeatures& features) const
+{
+	IntersectableData closest_data(t_max);
+	const MaterialTriangle* closest_triangle = nullptr;
+	for (auto& object : material_objects)
+	{
+		auto data = object.Intersect(ray);
+		if (data.t > t_min && data.t < closest_data.t)
+		{
+			closest_data = data;
+			closest_triangle = &object;
+		}
+	}
+	if (closest_triangle == nullptr)
+	{
+		return Miss(ray);
 	}
+	features.primitive = static_cast<unsigned int>(closest_triangle - material_objects.data());
+	features.normal = closest_triangle->GetNormal(closest_data.baricentric);
+	features.albedo = closest_triangle->diffuse_color;
+	features.emission = closest_triangle->emissive_color;
+	features.depth = closest_data.t;
+	return Hit(ray, closest_data, closest_triangle, raytracing_depth);
+}
+
+bool AntiAliasing::IsEdge(const PixelFeatures& a, const PixelFeatures& b) const
+{
+	float3 difference = abs(a.color - b.color);
+	if (std::max(difference.x, std::max(difference.y, difference.z)) > edge_color_difference)
+	{
+		return true;
+	}
+	if (a.primitive == b.primitive && a.instance == b.instance)
+	{
+		return false;
+	}
+	if (a.primitive == PixelFeatures::miss || b.primitive == PixelFeatures::miss)
+	{
+		return true;
+	}
+	// Neighbouring triangles of one flat wall are not an edge, a crease or a silhouette is
+	return dot(normalize(a.normal), normalize(b.normal)) < edge_normal_cos;
+}
+
+std::ostream& operator<<(std::ostream& stream, const EdgeAdaptiveReport& report)
+{
+	double refined = report.pixel_count > 0 ? 100.0 * report.refined_pixels / report.pixel_count : 0.0;
+	double rays = report.fixed_rays > 0 ? 100.0 * report.rays / report.fixed_rays : 0.0;
+	stream << "Edge-adaptive AA: " << report.refined_pixels << " of " << report.pixel_count << " pixels refined ("
+		<< refined << "%), " << report.rays << " rays, " << rays << "% of the fixed 2x2 grid, " << report.ms << " ms" << std::endl;
+	return stream;
 }
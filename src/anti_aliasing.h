@@ -2,10 +2,59 @@
 
 #include "refraction.h"
 
+// What the ray through the pixel center hit, compared between neighbours to find edges
+class PixelFeatures
+{
+public:
+	static const unsigned int miss = 0xFFFFFFFFu;
+	unsigned int primitive = miss;
+	// Mesh or BVH instance of the primitive, 0 for a flat triangle list
+	unsigned int instance = 0;
+	float3 normal;
+	float3 color;
+	// Filled for the denoiser's G-buffer
+	float3 albedo;
+	float3 emission;
+	float depth = 0.f;
+};
+
+class EdgeAdaptiveReport
+{
+public:
+	unsigned int pixel_count = 0;
+	unsigned int refined_pixels = 0;
+	unsigned long long rays = 0;
+	// Rays of the fixed 2x2 supersampling
+	unsigned long long fixed_rays = 0;
+	double ms = 0.0;
+};
+
+std::ostream& operator<<(std::ostream& stream, const EdgeAdaptiveReport& report);
+
 class AntiAliasing : public Refraction
 {
 public:
 	AntiAliasing(short width, short height);
 	virtual ~AntiAliasing();
 	virtual void DrawScene();
-};
\ No newline at end of file
+
+	// 0 traces a 2x2 grid in every pixel. Otherwise one ray per pixel first, then a
+	// grid of up to max_samples rays (rounded down to a square) only in pixels whose
+	// neighbours hit another surface, bend the normal or change the color.
+	void SetEdgeAdaptive(unsigned int max_samples) { edge_max_samples = max_samples; };
+	const EdgeAdaptiveReport& GetEdgeAdaptiveReport() const { return edge_report; };
+
+protected:
+	// Neighbours closer than these do not make an edge
+	const float edge_normal_cos = 0.9f;
+	const float edge_color_difference = 0.1f;
+
+	void DrawSceneEdgeAdaptive();
+	// Same as TraceRay for a camera ray, and records what it hit
+	virtual Payload TracePrimaryRay(const Ray& ray, PixelFeatures& features) const;
+	bool IsEdge(const PixelFeatures& a, const PixelFeatures& b) const;
+
+	unsigned int edge_max_samples = 0;
+	std::vector<PixelFeatures> pixel_features;
+	EdgeAdaptiveReport edge_report;
+};
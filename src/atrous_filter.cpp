@@ -0,0 +1,338 @@
+#include "atrous_filter.h"
+#include "simd.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+// B3-spline taps of the 5x5 kernel
+static const float kernel[5] = { 1.f / 16.f, 1.f / 4.f, 3.f / 8.f, 1.f / 4.f, 1.f / 16.f };
+
+static const float luminance_weights[3] = { 0.2126f, 0.7152f, 0.0722f };
+
+static float Luminance(const float3& color)
+{
+	return color.x * luminance_weights[0] + color.y * luminance_weights[1] + color.z * luminance_weights[2];
+}
+
+static __m128 Luminance(__m128 r, __m128 g, __m128 b)
+{
+	return _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(0.2126f)), _mm_mul_ps(g, _mm_set1_ps(0.7152f))),
+		_mm_mul_ps(b, _mm_set1_ps(0.0722f)));
+}
+
+static __m128 Abs(__m128 x)
+{
+	return _mm_andnot_ps(_mm_set1_ps(-0.f), x);
+}
+
+// Stores the first lanes of value, the pixels past them belong to the next tile
+static void StoreLanes(float* target, __m128 value, int lanes)
+{
+	if (lanes == 4)
+	{
+		_mm_storeu_ps(target, value);
+		return;
+	}
+	alignas(16) float values[4];
+	_mm_store_ps(values, value);
+	std::copy(values, values + lanes, target);
+}
+
+void AtrousFilter::Apply(short width, short height, const std::vector<float3>& color, const std::vector<float>& variance,
+	const std::vector<PixelFeatures>& features, std::vector<float3>& output, TileScheduler& scheduler)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	Prepare(width, height, color, variance, features, scheduler);
+
+	unsigned int source = 0;
+	for (unsigned int i = 0; i < iterations; i++)
+	{
+		FilterVariance(width, height, source, scheduler);
+		Pass(width, height, 1 << i, source, scheduler);
+		source = 1 - source;
+	}
+
+	output.resize(color.size());
+	scheduler.Run(width, height, [&](const Tile& tile)
+	{
+		for (short y = tile.y0; y < tile.y1; y++)
+		{
+			for (short x = tile.x0; x < tile.x1; x++)
+			{
+				size_t pixel = static_cast<size_t>(y) * width + x;
+				size_t i = Index(x, y);
+				const PixelFeatures& feature = features[pixel];
+				output[pixel] = feature.primitive == PixelFeatures::miss ? color[pixel] :
+					float3{ irradiance[source][0][i], irradiance[source][1][i], irradiance[source][2][i] } * albedo[pixel] + feature.emission;
+			}
+		}
+	});
+
+	report.iterations = iterations;
+	report.filtered_pixels = static_cast<unsigned int>(std::count_if(features.begin(), features.end(),
+		[](const PixelFeatures& feature) { return feature.primitive != PixelFeatures::miss; }));
+	report.ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+void AtrousFilter::Prepare(short width, short height, const std::vector<float3>& color, const std::vector<float>& variance,
+	const std::vector<PixelFeatures>& features, TileScheduler& scheduler)
+{
+	// Widest tap of the last pass plus the lanes past the end of a row, and at least
+	// the 3 pixels of the variance window
+	int reach = iterations > 0 ? 2 << (iterations - 1) : 0;
+	int new_pad = (std::max(reach, 3) + 3 + 3) & ~3;
+	int new_stride = new_pad + ((width + 3) & ~3) + new_pad;
+
+	// The padding stays zero, a zero normal gives it no weight. A new layout moves
+	// the padding, so the planes are cleared even when their size stays the same.
+	if (new_pad != pad || new_stride != stride || height != plane_height)
+	{
+		pad = new_pad;
+		stride = new_stride;
+		plane_height = height;
+		size_t size = static_cast<size_t>(stride) * height;
+		for (auto plane : { &irradiance[0][0], &irradiance[0][1], &irradiance[0][2], &irradiance[1][0], &irradiance[1][1], &irradiance[1][2],
+			&luminance[0], &luminance[1], &variance_plane[0], &variance_plane[1], &filtered_variance,
+			&normal[0], &normal[1], &normal[2], &depth, &depth_gradient })
+		{
+			plane->assign(size, 0.f);
+		}
+		row_sums.assign(size, float3{ 0.f, 0.f, 0.f });
+	}
+	albedo.resize(color.size());
+
+	scheduler.Run(width, height, [&](const Tile& tile)
+	{
+		for (short y = tile.y0; y < tile.y1; y++)
+		{
+			for (short x = tile.x0; x < tile.x1; x++)
+			{
+				size_t pixel = static_cast<size_t>(y) * width + x;
+				size_t i = Index(x, y);
+				const PixelFeatures& feature = features[pixel];
+				// Mirrors and black surfaces keep a small albedo, dividing and multiplying cancel out
+				albedo[pixel] = max(feature.albedo, float3{ 0.01f, 0.01f, 0.01f });
+				bool surface = feature.primitive != PixelFeatures::miss;
+				float inv_length = surface ? 1.f / std::sqrt(dot(feature.normal, feature.normal)) : 0.f;
+				float value_luminance = 0.f;
+				for (int c = 0; c < 3; c++)
+				{
+					float value = surface ? (color[pixel][c] - feature.emission[c]) / albedo[pixel][c] : 0.f;
+					irradiance[0][c][i] = value;
+					normal[c][i] = feature.normal[c] * inv_length;
+					value_luminance += value * luminance_weights[c];
+				}
+				float scale = Luminance(albedo[pixel]);
+				luminance[0][i] = value_luminance;
+				variance_plane[0][i] = surface ? variance[pixel] / (scale * scale) : 0.f;
+				depth[i] = surface ? feature.depth : 0.f;
+			}
+		}
+	});
+
+	// A few samples make a poor variance estimate, a dark pixel next to a firefly would
+	// reject it. Like SVGF for short histories, fall back on the spread of the 7x7
+	// neighbourhood, box filtered in two separable passes over the surface pixels.
+	scheduler.Run(width, height, [&](const Tile& tile)
+	{
+		for (short y = tile.y0; y < tile.y1; y++)
+		{
+			for (short x = tile.x0; x < tile.x1; x++)
+			{
+				// Background and padding have zero luminance and depth
+				float sum = 0.f;
+				float squares = 0.f;
+				float count = 0.f;
+				for (int dx = -3; dx <= 3; dx++)
+				{
+					size_t q = Index(x + dx, y);
+					float value = luminance[0][q];
+					sum += value;
+					squares += value * value;
+					count += depth[q] > 0.f ? 1.f : 0.f;
+				}
+				row_sums[Index(x, y)] = float3{ sum, squares, count };
+			}
+		}
+	});
+	scheduler.Run(width, height, [&](const Tile& tile)
+	{
+		for (short y = tile.y0; y < tile.y1; y++)
+		{
+			for (short x = tile.x0; x < tile.x1; x++)
+			{
+				size_t i = Index(x, y);
+				float3 sum{ 0.f, 0.f, 0.f };
+				for (int dy = std::max(y - 3, 0); dy <= std::min(y + 3, height - 1); dy++)
+				{
+					sum += row_sums[Index(x, dy)];
+				}
+				float mean = sum.x / std::max(sum.z, 1.f);
+				float spread = sum.y / std::max(sum.z, 1.f) - mean * mean;
+				variance_plane[0][i] = depth[i] > 0.f ? std::max(variance_plane[0][i], spread) : 0.f;
+			}
+		}
+	});
+
+	// Depth change per pixel, so that slanted floors are not cut into strips
+	scheduler.Run(width, height, [&](const Tile& tile)
+	{
+		for (short y = tile.y0; y < tile.y1; y++)
+		{
+			for (short x = tile.x0; x < tile.x1; x++)
+			{
+				size_t i = Index(x, y);
+				auto slope = [&](size_t a, size_t b, bool a_valid, bool b_valid)
+				{
+					a_valid = a_valid && depth[a] > 0.f;
+					b_valid = b_valid && depth[b] > 0.f;
+					if (a_valid && b_valid)
+					{
+						return std::abs(depth[b] - depth[a]) * 0.5f;
+					}
+					return a_valid ? std::abs(depth[i] - depth[a]) : (b_valid ? std::abs(depth[b] - depth[i]) : 0.f);
+				};
+				float dx = slope(i - 1, i + 1, x > 0, x + 1 < width);
+				float dy = slope(i - stride, i + stride, y > 0, y + 1 < height);
+				depth_gradient[i] = depth[i] > 0.f ? std::max(dx, dy) : 0.f;
+			}
+		}
+	});
+}
+
+void AtrousFilter::FilterVariance(short width, short height, unsigned int source, TileScheduler& scheduler)
+{
+	// 3x3 Gaussian over the surface pixels, a single pixel's variance is too noisy to steer by
+	const std::vector<float>& variance = variance_plane[source];
+	scheduler.Run(width, height, [&](const Tile& tile)
+	{
+		for (short y = tile.y0; y < tile.y1; y++)
+		{
+			for (short x = tile.x0; x < tile.x1; x++)
+			{
+				float sum = 0.f;
+				float weight = 0.f;
+				for (int dy = -1; dy <= 1; dy++)
+				{
+					if (y + dy < 0 || y + dy >= height)
+					{
+						continue;
+					}
+					for (int dx = -1; dx <= 1; dx++)
+					{
+						size_t q = Index(x + dx, y + dy);
+						if (x + dx < 0 || x + dx >= width || depth[q] == 0.f)
+						{
+							continue;
+						}
+						float w = (dx == 0 ? 0.5f : 0.25f) * (dy == 0 ? 0.5f : 0.25f);
+						sum += w * variance[q];
+						weight += w;
+					}
+				}
+				filtered_variance[Index(x, y)] = weight > 0.f ? sum / weight : 0.f;
+			}
+		}
+	});
+}
+
+void AtrousFilter::Pass(short width, short height, int step, unsigned int source, TileScheduler& scheduler)
+{
+	const unsigned int target = 1 - source;
+	const float* r = irradiance[source][0].data();
+	const float* g = irradiance[source][1].data();
+	const float* b = irradiance[source][2].data();
+	const float* l = luminance[source].data();
+	const float* v = variance_plane[source].data();
+	const float* nx = normal[0].data();
+	const float* ny = normal[1].data();
+	const float* nz = normal[2].data();
+	const float* z = depth.data();
+
+	scheduler.Run(width, height, [&](const Tile& tile)
+	{
+		for (short y = tile.y0; y < tile.y1; y++)
+		{
+			// Lanes past the end of the tile are computed from the padding or the next
+			// tile's pixels, but only the ones inside the tile are stored
+			for (short x = tile.x0; x < tile.x1; x += 4)
+			{
+				const int lanes = std::min(4, tile.x1 - x);
+				size_t p = Index(x, y);
+				const __m128 l_p = _mm_loadu_ps(l + p);
+				const __m128 nx_p = _mm_loadu_ps(nx + p);
+				const __m128 ny_p = _mm_loadu_ps(ny + p);
+				const __m128 nz_p = _mm_loadu_ps(nz + p);
+				const __m128 z_p = _mm_loadu_ps(z + p);
+				const __m128 inv_luminance_sigma = _mm_div_ps(_mm_set1_ps(1.f),
+					_mm_add_ps(_mm_mul_ps(_mm_set1_ps(sigma_luminance), _mm_sqrt_ps(_mm_loadu_ps(filtered_variance.data() + p))), _mm_set1_ps(1e-6f)));
+				// The depth tolerance grows with the distance of the tap, |dx| + |dy| in steps
+				const __m128 gradient_p = _mm_mul_ps(_mm_loadu_ps(depth_gradient.data() + p), _mm_set1_ps(sigma_depth * step));
+				__m128 inv_depth_scale[5];
+				for (int distance = 0; distance < 5; distance++)
+				{
+					inv_depth_scale[distance] = _mm_div_ps(_mm_set1_ps(1.f),
+						_mm_add_ps(_mm_mul_ps(gradient_p, _mm_set1_ps(static_cast<float>(distance))), _mm_set1_ps(1e-3f)));
+				}
+
+				__m128 sum_w = _mm_setzero_ps();
+				__m128 sum_r = _mm_setzero_ps();
+				__m128 sum_g = _mm_setzero_ps();
+				__m128 sum_b = _mm_setzero_ps();
+				__m128 sum_v = _mm_setzero_ps();
+				for (int dy = -2; dy <= 2; dy++)
+				{
+					if (y + dy * step < 0 || y + dy * step >= height)
+					{
+						continue;
+					}
+					for (int dx = -2; dx <= 2; dx++)
+					{
+						size_t q = Index(x + dx * step, y + dy * step);
+
+						// dot(n_p, n_q)^128, zero for the background and the padding.
+						// Below 0.8 the power is under 1e-12, it is cut before the squares turn denormal.
+						__m128 w_n = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx_p, _mm_loadu_ps(nx + q)), _mm_mul_ps(ny_p, _mm_loadu_ps(ny + q))),
+							_mm_mul_ps(nz_p, _mm_loadu_ps(nz + q)));
+						w_n = _mm_and_ps(w_n, _mm_cmpgt_ps(w_n, _mm_set1_ps(0.8f)));
+						for (int square = 0; square < 7; square++)
+						{
+							w_n = _mm_mul_ps(w_n, w_n);
+						}
+
+						__m128 e_z = _mm_mul_ps(Abs(_mm_sub_ps(z_p, _mm_loadu_ps(z + q))), inv_depth_scale[std::abs(dx) + std::abs(dy)]);
+						__m128 e_l = _mm_mul_ps(Abs(_mm_sub_ps(l_p, _mm_loadu_ps(l + q))), inv_luminance_sigma);
+						__m128 e = _mm_add_ps(e_z, e_l);
+						__m128 w = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(kernel[dx + 2] * kernel[dy + 2]), w_n),
+							_mm_and_ps(Exp(_mm_sub_ps(_mm_setzero_ps(), e)), _mm_cmplt_ps(e, _mm_set1_ps(30.f))));
+
+						sum_w = _mm_add_ps(sum_w, w);
+						sum_r = _mm_add_ps(sum_r, _mm_mul_ps(w, _mm_loadu_ps(r + q)));
+						sum_g = _mm_add_ps(sum_g, _mm_mul_ps(w, _mm_loadu_ps(g + q)));
+						sum_b = _mm_add_ps(sum_b, _mm_mul_ps(w, _mm_loadu_ps(b + q)));
+						sum_v = _mm_add_ps(sum_v, _mm_mul_ps(_mm_mul_ps(w, w), _mm_loadu_ps(v + q)));
+					}
+				}
+
+				// Background lanes have no weight at all and come out as zero
+				__m128 inv_w = _mm_div_ps(_mm_set1_ps(1.f), _mm_max_ps(sum_w, _mm_set1_ps(1e-20f)));
+				__m128 r_p = _mm_mul_ps(sum_r, inv_w);
+				__m128 g_p = _mm_mul_ps(sum_g, inv_w);
+				__m128 b_p = _mm_mul_ps(sum_b, inv_w);
+				StoreLanes(irradiance[target][0].data() + p, r_p, lanes);
+				StoreLanes(irradiance[target][1].data() + p, g_p, lanes);
+				StoreLanes(irradiance[target][2].data() + p, b_p, lanes);
+				StoreLanes(luminance[target].data() + p, Luminance(r_p, g_p, b_p), lanes);
+				StoreLanes(variance_plane[target].data() + p, _mm_mul_ps(sum_v, _mm_mul_ps(inv_w, inv_w)), lanes);
+			}
+		}
+	});
+}
+
+std::ostream& operator<<(std::ostream& stream, const AtrousReport& report)
+{
+	stream << "A-trous filter: " << report.iterations << " iterations over " << report.filtered_pixels
+		<< " pixels, " << report.ms << " ms" << std::endl;
+	return stream;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "anti_aliasing.h"
+#include "tile_scheduler.h"
+
+#include <vector>
+
+class AtrousReport
+{
+public:
+	unsigned int iterations = 0;
+	unsigned int filtered_pixels = 0;
+	double ms = 0.0;
+};
+
+std::ostream& operator<<(std::ostream& stream, const AtrousReport& report);
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010) with the variance-guided
+// luminance weight of SVGF (Schied et al. 2017). Only the reflected light is filtered:
+// the emission of the G-buffer is taken off and the rest divided by the albedo, both
+// are put back afterwards, so wall colors and lights do not bleed. Each iteration is a
+// 5x5 B3-spline kernel with holes of 2^i pixels, evaluated for four pixels of a row at
+// once with SSE on the scheduler's tiles.
+class AtrousFilter
+{
+public:
+	void SetIterations(unsigned int count) { iterations = count; };
+	unsigned int GetIterations() const { return iterations; };
+
+	// color is the mean radiance of each pixel and variance the variance of its mean
+	// luminance. Background pixels of the G-buffer are copied through.
+	void Apply(short width, short height, const std::vector<float3>& color, const std::vector<float>& variance,
+		const std::vector<PixelFeatures>& features, std::vector<float3>& output, TileScheduler& scheduler);
+	const AtrousReport& GetReport() const { return report; };
+
+	// Luminance differences are measured in standard deviations, depth differences in
+	// multiples of the local depth gradient. Normals weigh in as dot(n, n')^128.
+	const float sigma_luminance = 4.f;
+	const float sigma_depth = 1.f;
+
+protected:
+	void Prepare(short width, short height, const std::vector<float3>& color, const std::vector<float>& variance,
+		const std::vector<PixelFeatures>& features, TileScheduler& scheduler);
+	void FilterVariance(short width, short height, unsigned int source, TileScheduler& scheduler);
+	void Pass(short width, short height, int step, unsigned int source, TileScheduler& scheduler);
+	size_t Index(int x, int y) const { return static_cast<size_t>(y) * stride + pad + x; };
+
+	unsigned int iterations = 5;
+	// Planes of stride x plane_height floats, with pad columns left and right so
+	// that the four lanes of a tap never need a bounds check. They are kept between
+	// frames of the same layout, the padding only ever holds zeros.
+	int pad = 0;
+	int stride = 0;
+	int plane_height = 0;
+	std::vector<float> irradiance[2][3];
+	std::vector<float> luminance[2];
+	std::vector<float> variance_plane[2];
+	std::vector<float> filtered_variance;
+	std::vector<float> normal[3];
+	std::vector<float> depth;
+	std::vector<float> depth_gradient;
+	std::vector<float3> albedo;
+	// Luminance, its square and the surface pixel count along 7 pixels of a row
+	std::vector<float3> row_sums;
+	AtrousReport report;
+};
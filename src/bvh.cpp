@@ -1,129 +1,3471 @@
 #include "bvh.h"
 
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <unordered_map>
+
+
+// Spreads the lower 10 bits of v so that there are two zero bits between each
+static unsigned int ExpandBits(unsigned int v)
+{
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+unsigned int MortonCode(const float3& position)
+{
+	float3 cell = clamp(position * 1024.f, float3(0.f), float3(1023.f));
+	return (ExpandBits(static_cast<unsigned int>(cell.x)) << 2)
+		| (ExpandBits(static_cast<unsigned int>(cell.y)) << 1)
+		| ExpandBits(static_cast<unsigned int>(cell.z));
+}
+
+static float3 TransformPoint(const float4x4& transform, const float3& point)
+{
+	float4 result = mul(transform, float4(point, 1.f));
+	return float3(result.x, result.y, result.z);
+}
+
+static float3 TransformVector(const float4x4& transform, const float3& vector)
+{
+	float4 result = mul(transform, float4(vector, 0.f));
+	return float3(result.x, result.y, result.z);
+}
+
+static float BoundsArea(const float3& aabb_min, const float3& aabb_max)
+{
+	float3 extent = max(aabb_max - aabb_min, float3(0.f));
+	return 2.f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+}
+
+// Fits a sphere to a mesh whose corners all lie on it and whose triangle centers stay
+// close to it, as in a tessellated sphere. A box has its corners on a sphere but not its faces.
+static bool FitSphere(std::vector<MaterialTriangle>::const_iterator first, std::vector<MaterialTriangle>::const_iterator last, float3& center, float& radius)
+{
+	const float corner_tolerance = 0.01f;
+	const float center_tolerance = 0.02f;
+	if (first == last)
+	{
+		return false;
+	}
+	float3 aabb_min = float3(std::numeric_limits<float>::max());
+	float3 aabb_max = float3(-std::numeric_limits<float>::max());
+	for (auto triangle = first; triangle != last; ++triangle)
+	{
+		aabb_min = min(aabb_min, min(triangle->a.position, min(triangle->b.position, triangle->c.position)));
+		aabb_max = max(aabb_max, max(triangle->a.position, max(triangle->b.position, triangle->c.position)));
+	}
+	center = (aabb_min + aabb_max) * 0.5f;
+	radius = 0.f;
+	for (auto triangle = first; triangle != last; ++triangle)
+	{
+		radius += length(triangle->a.position - center) + length(triangle->b.position - center) + length(triangle->c.position - center);
+	}
+	radius /= 3.f * (last - first);
+	if (!(radius > 0.f))
+	{
+		return false;
+	}
+
+	for (auto triangle = first; triangle != last; ++triangle)
+	{
+		for (const Vertex* corner : { &triangle->a, &triangle->b, &triangle->c })
+		{
+			if (std::abs(length(corner->position - center) - radius) > corner_tolerance * radius)
+			{
+				return false;
+			}
+		}
+		float3 triangle_center = (triangle->a.position + triangle->b.position + triangle->c.position) / 3.f;
+		if (length(triangle_center - center) < (1.f - center_tolerance) * radius)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+void RadixSort(std::vector<unsigned int>& keys, std::vector<unsigned int>& values)
+{
+	// 8 bits per pass
+	const size_t size = keys.size();
+	std::vector<unsigned int> sorted_keys(size);
+	std::vector<unsigned int> sorted_values(size);
+	for (int shift = 0; shift < 32; shift += 8)
+	{
+		size_t offsets[257] = {};
+		for (size_t i = 0; i < size; i++)
+		{
+			offsets[((keys[i] >> shift) & 0xFF) + 1]++;
+		}
+		for (int bucket = 0; bucket < 256; bucket++)
+		{
+			offsets[bucket + 1] += offsets[bucket];
+		}
+		for (size_t i = 0; i < size; i++)
+		{
+			size_t position = offsets[(keys[i] >> shift) & 0xFF]++;
+			sorted_keys[position] = keys[i];
+			sorted_values[position] = values[i];
+		}
+		keys.swap(sorted_keys);
+		values.swap(sorted_values);
+	}
+}
 
 BVH::BVH(short width, short height) :AABB(width, height)
 {
 }
 
-BVH::~BVH()
+BVH::~BVH()
+{
+}
+
+int BVH::LoadGeometry(std::string filename)
+{
+	ObjModel model;
+	std::string warn;
+	std::string err;
+
+	bool ret = LoadObj(filename, model, warn, err);
+
+	if (!warn.empty()) {
+		std::cout << warn << std::endl;
+	}
+
+	if (!err.empty()) {
+		std::cerr << err << std::endl;
+	}
+
+	if (!ret) {
+		exit(1);
+	}
+
+	unsigned int first_mesh = GetMeshCount();
+	unsigned int mesh_count = 0;
+	for (unsigned int m = 0; m < model.MeshCount(); m++)
+	{
+		auto first = model.triangles.begin() + model.mesh_offsets[m];
+		auto last = model.triangles.begin() + model.mesh_offsets[m + 1];
+		float3 center;
+		float radius;
+		if (analytic_spheres && FitSphere(first, last, center, radius))
+		{
+			geometry.AddSphere(center, radius, Material(*first));
+			continue;
+		}
+		mesh_first_triangle.push_back(geometry.TriangleCount());
+		geometry.AddTriangles(first, last);
+		mesh_count++;
+	}
+	models.push_back({ first_mesh, mesh_count });
+	load_report = model.report;
+	return 0;
+}
+
+unsigned int BVH::GetMeshTriangleCount(unsigned int mesh) const
+{
+	unsigned int last = mesh + 1 < mesh_first_triangle.size() ? mesh_first_triangle[mesh + 1] : geometry.TriangleCount();
+	return last - mesh_first_triangle[mesh];
+}
+
+std::vector<float3> BVH::GetMeshPositions(unsigned int mesh) const
+{
+	std::vector<float3> positions;
+	for (unsigned int i = 0; i < GetMeshTriangleCount(mesh); i++)
+	{
+		for (int corner = 0; corner < 3; corner++)
+		{
+			positions.push_back(geometry.Position(mesh_first_triangle[mesh] + i, corner));
+		}
+	}
+	return positions;
+}
+
+unsigned int BVH::AddInstance(unsigned int model, const float4x4& transform)
+{
+	BVHInstance instance;
+	instance.blas = model;
+	instance.transform = transform;
+	instance.inverse_transform = inverse(transform);
+	// The inverse transpose of the upper 3x3 part
+	instance.normal_transform = float3x3(
+		float3(instance.inverse_transform.x.x, instance.inverse_transform.y.x, instance.inverse_transform.z.x),
+		float3(instance.inverse_transform.x.y, instance.inverse_transform.y.y, instance.inverse_transform.z.y),
+		float3(instance.inverse_transform.x.z, instance.inverse_transform.y.z, instance.inverse_transform.z.z));
+	const float4x4 identity = linalg::identity;
+	for (int column = 0; column < 4; column++)
+	{
+		for (int row = 0; row < 4; row++)
+		{
+			instance.identity &= transform[column][row] == identity[column][row];
+		}
+	}
+	instances.push_back(instance);
+	return static_cast<unsigned int>(instances.size() - 1);
+}
+
+void BVH::BuildBVH()
+{
+	auto start = std::chrono::high_resolution_clock::now();
+
+	// Every model gets a BLAS over its own range of triangles, models are loaded one after another
+	const unsigned int triangle_count = geometry.TriangleCount();
+	blases.clear();
+	for (auto& model : models)
+	{
+		BLAS blas;
+		blas.first_mesh = model.first;
+		blas.mesh_count = model.second;
+		blas.first_primitive = model.second > 0 ? mesh_first_triangle[model.first] : triangle_count;
+		for (unsigned int mesh = model.first; mesh < model.first + model.second; mesh++)
+		{
+			blas.primitive_count += GetMeshTriangleCount(mesh);
+		}
+		blases.push_back(blas);
+	}
+	if (geometry.SphereCount() > 0)
+	{
+		BLAS blas;
+		blas.primitive_type = PrimitiveType::Sphere;
+		blas.first_mesh = GetMeshCount();
+		blas.primitive_count = geometry.SphereCount();
+		blases.push_back(blas);
+	}
+
+	std::vector<float3> triangle_min(triangle_count);
+	std::vector<float3> triangle_max(triangle_count);
+	std::vector<float3> centroids(triangle_count);
+	triangle_indices.resize(triangle_count);
+	sphere_indices.clear();
+	ComputeTriangleBounds(0, triangle_count, triangle_min, triangle_max, centroids);
+
+	// A binary tree with non-empty leaves has at most 2n - 1 nodes, so the builders
+	// take nodes from a preallocated array and can run on several threads
+	size_t reference_limit = triangle_count;
+	if (build_mode == BVHBuildMode::SBVH)
+	{
+		reference_limit += static_cast<size_t>(triangle_count * spatial_split_budget);
+	}
+	build_nodes.assign(std::max<size_t>(2 * (reference_limit + geometry.SphereCount()), 1), BVHBuildNode());
+	build_node_count = 0;
+	spatial_split_count = 0;
+	std::vector<unsigned int> build_roots(blases.size());
+	if (build_mode == BVHBuildMode::SBVH)
+	{
+		// The leaves list their triangles anew, with the duplicates of split triangles
+		std::vector<unsigned int> references;
+		references.reserve(reference_limit);
+		for (unsigned int b = 0; b < blases.size(); b++)
+		{
+			if (blases[b].primitive_count > 0 && blases[b].primitive_type == PrimitiveType::Triangle)
+			{
+				build_roots[b] = SubdivideSpatialBLAS(blases[b], triangle_min, triangle_max, references);
+			}
+		}
+		triangle_indices.swap(references);
+	}
+	else
+	{
+		std::vector<unsigned int> codes(triangle_count);
+		std::vector<std::pair<unsigned int, unsigned int>> subtrees;
+		for (unsigned int b = 0; b < blases.size(); b++)
+		{
+			if (blases[b].primitive_count > 0 && blases[b].primitive_type == PrimitiveType::Triangle)
+			{
+				build_roots[b] = SubdivideBLAS(blases[b], triangle_min, triangle_max, centroids, codes, subtrees);
+			}
+		}
+		SubdivideDeferred(subtrees, triangle_min, triangle_max, centroids, codes);
+	}
+	for (unsigned int b = 0; b < blases.size(); b++)
+	{
+		if (blases[b].primitive_count > 0 && blases[b].primitive_type == PrimitiveType::Sphere)
+		{
+			build_roots[b] = SubdivideSpheres(blases[b]);
+		}
+	}
+	build_nodes.resize(build_node_count);
+
+	nodes.clear();
+	nodes.reserve(build_nodes.size());
+	for (unsigned int b = 0; b < blases.size(); b++)
+	{
+		if (blases[b].primitive_count > 0)
+		{
+			blases[b].root = Flatten(build_roots[b], nodes);
+			blases[b].node_count = static_cast<unsigned int>(nodes.size()) - blases[b].root;
+		}
+	}
+
+	FinishBuild();
+	for (BLAS& blas : blases)
+	{
+		blas.built_sah_cost = blas.sah_cost;
+	}
+	build_report.build_time_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+void BVH::ComputeTriangleBounds(unsigned int first, unsigned int count, std::vector<float3>& triangle_min, std::vector<float3>& triangle_max, std::vector<float3>& centroids)
+{
+#pragma omp parallel for
+	for (int i = static_cast<int>(first); i < static_cast<int>(first + count); i++)
+	{
+		const float3& a = geometry.Position(i, 0);
+		const float3& b = geometry.Position(i, 1);
+		const float3& c = geometry.Position(i, 2);
+		triangle_min[i] = min(a, min(b, c));
+		triangle_max[i] = max(a, max(b, c));
+		centroids[i] = (triangle_min[i] + triangle_max[i]) * 0.5f;
+		triangle_indices[i] = i;
+	}
+}
+
+unsigned int BVH::SubdivideBLAS(const BLAS& blas, const std::vector<float3>& triangle_min, const std::vector<float3>& triangle_max, const std::vector<float3>& centroids, std::vector<unsigned int>& codes, std::vector<std::pair<unsigned int, unsigned int>>& deferred)
+{
+	unsigned int root = build_node_count.fetch_add(1);
+	build_nodes[root].left_first = blas.first_primitive;
+	build_nodes[root].count = blas.primitive_count;
+	UpdateNodeBounds(build_nodes[root], triangle_indices, triangle_min, triangle_max);
+
+	if (build_mode == BVHBuildMode::LBVH)
+	{
+		SortByMortonCode(blas.first_primitive, blas.primitive_count, centroids, codes);
+	}
+
+	// The top of the tree is split a level at a time. Nodes large enough for parallel
+	// binning are split one after another by all threads, the other nodes of the level
+	// side by side with a thread each. Subtrees small enough to be built by one thread
+	// are left in deferred for the parallel phase.
+	std::vector<std::pair<unsigned int, unsigned int>> level;
+	(blas.primitive_count <= parallel_subtree_size ? deferred : level).push_back({ root, 0 });
+	auto split = [&](unsigned int node_index, unsigned int depth)
+	{
+		return build_mode == BVHBuildMode::LBVH
+			? SplitNodeMorton(node_index, depth, triangle_indices, triangle_min, triangle_max, codes)
+			: SplitNode(node_index, depth, triangle_indices, triangle_min, triangle_max, centroids);
+	};
+	while (!level.empty())
+	{
+		std::vector<unsigned char> large(level.size());
+		std::vector<unsigned char> was_split(level.size(), 0);
+		for (size_t i = 0; i < level.size(); i++)
+		{
+			large[i] = build_nodes[level[i].first].count >= parallel_binning_size;
+			if (large[i])
+			{
+				was_split[i] = split(level[i].first, level[i].second);
+			}
+		}
+#pragma omp parallel for schedule(dynamic)
+		for (int i = 0; i < static_cast<int>(level.size()); i++)
+		{
+			if (!large[i])
+			{
+				was_split[i] = split(level[i].first, level[i].second);
+			}
+		}
+
+		std::vector<std::pair<unsigned int, unsigned int>> next;
+		for (size_t i = 0; i < level.size(); i++)
+		{
+			if (!was_split[i])
+			{
+				continue;
+			}
+			unsigned int left_index = build_nodes[level[i].first].left_first;
+			for (unsigned int child = left_index; child < left_index + 2; child++)
+			{
+				(build_nodes[child].count <= parallel_subtree_size ? deferred : next).push_back({ child, level[i].second + 1 });
+			}
+		}
+		level.swap(next);
+	}
+	return root;
+}
+
+unsigned int BVH::SubdivideSpheres(const BLAS& blas)
+{
+	std::vector<float3> sphere_min(geometry.SphereCount());
+	std::vector<float3> sphere_max(geometry.SphereCount());
+	std::vector<float3> centroids(geometry.SphereCount());
+	sphere_indices.resize(geometry.SphereCount());
+	for (unsigned int i = 0; i < geometry.SphereCount(); i++)
+	{
+		const IndexedSphere& sphere = geometry.spheres[i];
+		sphere_min[i] = sphere.center - float3(sphere.radius);
+		sphere_max[i] = sphere.center + float3(sphere.radius);
+		centroids[i] = sphere.center;
+		sphere_indices[i] = i;
+	}
+
+	unsigned int root = build_node_count.fetch_add(1);
+	build_nodes[root].left_first = blas.first_primitive;
+	build_nodes[root].count = blas.primitive_count;
+	UpdateNodeBounds(build_nodes[root], sphere_indices, sphere_min, sphere_max);
+	Subdivide(root, 0, sphere_indices, sphere_min, sphere_max, centroids);
+	return root;
+}
+
+void BVH::SubdivideDeferred(const std::vector<std::pair<unsigned int, unsigned int>>& deferred, const std::vector<float3>& triangle_min, const std::vector<float3>& triangle_max, const std::vector<float3>& centroids, const std::vector<unsigned int>& codes)
+{
+#pragma omp parallel for schedule(dynamic)
+	for (int i = 0; i < static_cast<int>(deferred.size()); i++)
+	{
+		if (build_mode == BVHBuildMode::LBVH)
+		{
+			SubdivideMorton(deferred[i].first, deferred[i].second, triangle_indices, triangle_min, triangle_max, codes);
+		}
+		else
+		{
+			Subdivide(deferred[i].first, deferred[i].second, triangle_indices, triangle_min, triangle_max, centroids);
+		}
+	}
+}
+
+void BVH::FinishBuild()
+{
+	blocks4.clear();
+	blocks8.clear();
+	blocks16.clear();
+	leaf_blocks.assign(triangle_indices.size(), 0);
+	switch (BlockWidth())
+	{
+	case 4:
+		PackTriangleBlocks(blocks4);
+		break;
+	case 8:
+		PackTriangleBlocks(blocks8);
+		break;
+	case 16:
+		PackTriangleBlocks(blocks16);
+		break;
+	}
+	PrecomputeTriangles();
+
+	nodes4.clear();
+	nodes8.clear();
+	quantized_nodes4.clear();
+	quantized_nodes8.clear();
+	quantized_leaves.clear();
+	for (auto& blas : blases)
+	{
+		if (blas.primitive_count == 0)
+		{
+			continue;
+		}
+		if (branching_factor == 4)
+		{
+			blas.root4 = quantized_nodes ? CollapseQuantized(quantized_nodes4, blas.root) : CollapseWide(nodes4, blas.root);
+		}
+		if (branching_factor == 8)
+		{
+			blas.root8 = quantized_nodes ? CollapseQuantized(quantized_nodes8, blas.root) : CollapseWide(nodes8, blas.root);
+		}
+	}
+
+	BuildTLAS();
+	build_nodes.clear();
+	build_nodes.shrink_to_fit();
+
+	FillBuildReport();
+	build_report.build_mode = build_mode;
+}
+
+void BVH::UpdateMesh(unsigned int mesh, const std::vector<float3>& positions)
+{
+	if (mesh >= GetMeshCount())
+	{
+		return;
+	}
+	std::vector<float3> mesh_positions(positions.begin(), positions.begin() + std::min<size_t>(positions.size(), 3 * GetMeshTriangleCount(mesh)));
+	geometry.SetPositions(mesh_first_triangle[mesh], mesh_positions);
+	for (BLAS& blas : blases)
+	{
+		if (mesh >= blas.first_mesh && mesh < blas.first_mesh + blas.mesh_count)
+		{
+			blas.dirty = true;
+		}
+	}
+}
+
+void BVH::UpdateBVH()
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	update_report = BVHUpdateReport();
+
+	std::vector<unsigned int> degraded;
+	unsigned int built_blas_count = 0;
+	for (unsigned int b = 0; b < blases.size(); b++)
+	{
+		BLAS& blas = blases[b];
+		if (blas.primitive_count > 0)
+		{
+			built_blas_count++;
+		}
+		if (!blas.dirty || blas.primitive_count == 0)
+		{
+			continue;
+		}
+		RefitBLAS(blas);
+		blas.sah_cost = BLASCost(blas);
+		float growth = blas.built_sah_cost > 0.f ? blas.sah_cost / blas.built_sah_cost : 1.f;
+		update_report.max_sah_growth = std::max(update_report.max_sah_growth, growth);
+		update_report.refit_blas_count++;
+		if (growth > rebuild_threshold)
+		{
+			degraded.push_back(b);
+		}
+	}
+
+	auto rebuild_start = std::chrono::high_resolution_clock::now();
+	update_report.rebuilt_blas_count = static_cast<unsigned int>(degraded.size());
+	// Spatial splits change the number of leaf entries, which a BLAS cannot do in place
+	if (!degraded.empty() && (degraded.size() == built_blas_count || build_mode == BVHBuildMode::SBVH))
+	{
+		BuildBVH();
+		update_report.full_rebuild = true;
+		update_report.rebuild_time_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - rebuild_start).count();
+	}
+	else
+	{
+		// In BLAS order, so that the blocks and wide nodes of the later ones are found
+		// where splicing in the earlier ones moved them
+		for (unsigned int b = 0; b < blases.size(); b++)
+		{
+			BLAS& blas = blases[b];
+			if (!blas.dirty || blas.primitive_count == 0)
+			{
+				continue;
+			}
+			const unsigned int first_block = BlockWidth() > 0 && blas.primitive_type == PrimitiveType::Triangle ? FirstBlock(blas) : 0;
+			if (std::find(degraded.begin(), degraded.end(), b) != degraded.end())
+			{
+				auto blas_start = std::chrono::high_resolution_clock::now();
+				RebuildBLAS(b);
+				blas.sah_cost = BLASCost(blas);
+				blas.built_sah_cost = blas.sah_cost;
+				update_report.rebuild_time_ms += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - blas_start).count();
+			}
+			RepackBLAS(b, first_block);
+		}
+		if (update_report.refit_blas_count > 0)
+		{
+			BuildTLAS();
+			build_nodes.clear();
+			build_nodes.shrink_to_fit();
+		}
+	}
+	for (BLAS& blas : blases)
+	{
+		blas.dirty = false;
+	}
+	update_report.update_time_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+void BVH::RefitBLAS(const BLAS& blas)
+{
+	// Leaves first, then every interior node after its children, which the
+	// depth-first layout places at higher indices
+	const int first = static_cast<int>(blas.root);
+	const int last = static_cast<int>(blas.root + blas.node_count);
+#pragma omp parallel for
+	for (int i = first; i < last; i++)
+	{
+		BVHNode& node = nodes[i];
+		if (!node.IsLeaf())
+		{
+			continue;
+		}
+		node.aabb_min = float3(std::numeric_limits<float>::max());
+		node.aabb_max = float3(-std::numeric_limits<float>::max());
+		for (unsigned int j = node.offset; j < node.offset + node.count; j++)
+		{
+			for (int corner = 0; corner < 3; corner++)
+			{
+				node.aabb_min = min(node.aabb_min, geometry.Position(triangle_indices[j], corner));
+				node.aabb_max = max(node.aabb_max, geometry.Position(triangle_indices[j], corner));
+			}
+		}
+	}
+	for (int i = last - 1; i >= first; i--)
+	{
+		BVHNode& node = nodes[i];
+		if (!node.IsLeaf())
+		{
+			node.aabb_min = min(nodes[i + 1].aabb_min, nodes[node.offset].aabb_min);
+			node.aabb_max = max(nodes[i + 1].aabb_max, nodes[node.offset].aabb_max);
+		}
+	}
+}
+
+void BVH::RebuildBLAS(unsigned int blas_index)
+{
+	BLAS& blas = blases[blas_index];
+	std::vector<float3> triangle_min(geometry.TriangleCount());
+	std::vector<float3> triangle_max(geometry.TriangleCount());
+	std::vector<float3> centroids(geometry.TriangleCount());
+	std::vector<unsigned int> codes(geometry.TriangleCount());
+	ComputeTriangleBounds(blas.first_primitive, blas.primitive_count, triangle_min, triangle_max, centroids);
+
+	build_nodes.assign(2 * blas.primitive_count, BVHBuildNode());
+	build_node_count = 0;
+	std::vector<std::pair<unsigned int, unsigned int>> subtrees;
+	unsigned int build_root = SubdivideBLAS(blas, triangle_min, triangle_max, centroids, codes, subtrees);
+	SubdivideDeferred(subtrees, triangle_min, triangle_max, centroids, codes);
+	build_nodes.resize(build_node_count);
+	std::vector<BVHNode> blas_nodes;
+	blas_nodes.reserve(build_nodes.size());
+	Flatten(build_root, blas_nodes);
+
+	// Splice the new nodes in place of the old ones and move everything behind them
+	const unsigned int old_end = blas.root + blas.node_count;
+	const int shift = static_cast<int>(blas_nodes.size()) - static_cast<int>(blas.node_count);
+	for (BVHNode& node : blas_nodes)
+	{
+		if (!node.IsLeaf())
+		{
+			node.offset += blas.root;
+		}
+	}
+	for (unsigned int i = old_end; i < nodes.size(); i++)
+	{
+		if (!nodes[i].IsLeaf())
+		{
+			nodes[i].offset += shift;
+		}
+	}
+	nodes.erase(nodes.begin() + blas.root, nodes.begin() + old_end);
+	nodes.insert(nodes.begin() + blas.root, blas_nodes.begin(), blas_nodes.end());
+	for (BLAS& other : blases)
+	{
+		if (other.primitive_count > 0 && other.root >= old_end)
+		{
+			other.root += shift;
+		}
+	}
+	blas.node_count = static_cast<unsigned int>(blas_nodes.size());
+}
+
+float BVH::BLASCost(const BLAS& blas) const
+{
+	float root_area = nodes[blas.root].SurfaceArea();
+	float sah_cost = 0.f;
+	for (unsigned int i = blas.root; i < blas.root + blas.node_count; i++)
+	{
+		const BVHNode& node = nodes[i];
+		float relative_area = root_area > 0.f ? node.SurfaceArea() / root_area : 1.f;
+		sah_cost += relative_area * (node.IsLeaf() ? node.count * intersection_cost : traversal_cost);
+	}
+	return sah_cost;
+}
+
+float BVH::BLASOverlap(const BLAS& blas) const
+{
+	float root_area = nodes[blas.root].SurfaceArea();
+	float overlap = 0.f;
+	for (unsigned int i = blas.root; i < blas.root + blas.node_count; i++)
+	{
+		const BVHNode& node = nodes[i];
+		if (!node.IsLeaf() && root_area > 0.f)
+		{
+			const BVHNode& left = nodes[i + 1];
+			const BVHNode& right = nodes[node.offset];
+			float3 overlap_min = max(left.aabb_min, right.aabb_min);
+			float3 overlap_max = min(left.aabb_max, right.aabb_max);
+			if (overlap_min.x <= overlap_max.x && overlap_min.y <= overlap_max.y && overlap_min.z <= overlap_max.z)
+			{
+				overlap += BoundsArea(overlap_min, overlap_max) / root_area;
+			}
+		}
+	}
+	return overlap;
+}
+
+void BVH::BuildTLAS()
+{
+	tlas_instances.clear();
+	if (instances.empty())
+	{
+		for (unsigned int b = 0; b < blases.size(); b++)
+		{
+			BVHInstance instance;
+			instance.blas = b;
+			instance.transform = float4x4(linalg::identity);
+			instance.inverse_transform = float4x4(linalg::identity);
+			instance.normal_transform = float3x3(float3(1, 0, 0), float3(0, 1, 0), float3(0, 0, 1));
+			tlas_instances.push_back(instance);
+		}
+	}
+	for (const BVHInstance& instance : instances)
+	{
+		if (instance.blas < blases.size())
+		{
+			tlas_instances.push_back(instance);
+		}
+	}
+	// Empty models cannot be hit
+	tlas_instances.erase(std::remove_if(tlas_instances.begin(), tlas_instances.end(),
+		[&](const BVHInstance& instance) { return blases[instance.blas].primitive_count == 0; }), tlas_instances.end());
+
+	// World bounds of every instance from the corners of its BLAS root
+	std::vector<float3> instance_min(tlas_instances.size());
+	std::vector<float3> instance_max(tlas_instances.size());
+	std::vector<float3> instance_centroids(tlas_instances.size());
+	instance_indices.resize(tlas_instances.size());
+	for (unsigned int i = 0; i < tlas_instances.size(); i++)
+	{
+		BVHInstance& instance = tlas_instances[i];
+		const BVHNode& root = nodes[blases[instance.blas].root];
+		instance.aabb_min = float3(std::numeric_limits<float>::max());
+		instance.aabb_max = float3(-std::numeric_limits<float>::max());
+		for (int corner = 0; corner < 8; corner++)
+		{
+			float3 position{
+				corner & 1 ? root.aabb_max.x : root.aabb_min.x,
+				corner & 2 ? root.aabb_max.y : root.aabb_min.y,
+				corner & 4 ? root.aabb_max.z : root.aabb_min.z };
+			float3 world = instance.identity ? position : TransformPoint(instance.transform, position);
+			instance.aabb_min = min(instance.aabb_min, world);
+			instance.aabb_max = max(instance.aabb_max, world);
+		}
+		instance_min[i] = instance.aabb_min;
+		instance_max[i] = instance.aabb_max;
+		instance_centroids[i] = (instance.aabb_min + instance.aabb_max) * 0.5f;
+		instance_indices[i] = i;
+	}
+
+	tlas_nodes.clear();
+	if (tlas_instances.empty())
+	{
+		return;
+	}
+	build_nodes.assign(2 * tlas_instances.size(), BVHBuildNode());
+	build_node_count = 1;
+	build_nodes[0].left_first = 0;
+	build_nodes[0].count = static_cast<unsigned int>(tlas_instances.size());
+	UpdateNodeBounds(build_nodes[0], instance_indices, instance_min, instance_max);
+	Subdivide(0, 0, instance_indices, instance_min, instance_max, instance_centroids);
+	Flatten(0, tlas_nodes);
+}
+
+void BVH::UpdateNodeBounds(BVHBuildNode& node, const std::vector<unsigned int>& indices, const std::vector<float3>& triangle_min, const std::vector<float3>& triangle_max) const
+{
+	node.aabb_min = float3(std::numeric_limits<float>::max());
+	node.aabb_max = float3(-std::numeric_limits<float>::max());
+	const int first = static_cast<int>(node.left_first);
+	const int last = static_cast<int>(node.left_first + node.count);
+#pragma omp parallel if(node.count >= parallel_binning_size)
+	{
+		float3 local_min = float3(std::numeric_limits<float>::max());
+		float3 local_max = float3(-std::numeric_limits<float>::max());
+#pragma omp for nowait
+		for (int i = first; i < last; i++)
+		{
+			local_min = min(local_min, triangle_min[indices[i]]);
+			local_max = max(local_max, triangle_max[indices[i]]);
+		}
+#pragma omp critical
+		{
+			node.aabb_min = min(node.aabb_min, local_min);
+			node.aabb_max = max(node.aabb_max, local_max);
+		}
+	}
+}
+
+class BVHBin
+{
+public:
+	float3 aabb_min = float3(std::numeric_limits<float>::max());
+	float3 aabb_max = float3(-std::numeric_limits<float>::max());
+	unsigned int count = 0;
+
+	void Grow(const float3& other_min, const float3& other_max)
+	{
+		aabb_min = min(aabb_min, other_min);
+		aabb_max = max(aabb_max, other_max);
+	}
+	float SurfaceArea() const
+	{
+		if (count == 0)
+		{
+			return 0.f;
+		}
+		float3 extent = aabb_max - aabb_min;
+		return 2.f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+	}
+};
+
+void BVH::Subdivide(unsigned int node_index, unsigned int depth, std::vector<unsigned int>& indices, const std::vector<float3>& triangle_min, const std::vector<float3>& triangle_max, const std::vector<float3>& centroids)
+{
+	if (SplitNode(node_index, depth, indices, triangle_min, triangle_max, centroids))
+	{
+		unsigned int left_index = build_nodes[node_index].left_first;
+		Subdivide(left_index, depth + 1, indices, triangle_min, triangle_max, centroids);
+		Subdivide(left_index + 1, depth + 1, indices, triangle_min, triangle_max, centroids);
+	}
+}
+
+bool BVH::SplitNode(unsigned int node_index, unsigned int depth, std::vector<unsigned int>& indices, const std::vector<float3>& triangle_min, const std::vector<float3>& triangle_max, const std::vector<float3>& centroids)
+{
+	BVHBuildNode& node = build_nodes[node_index];
+	if (node.count <= leaf_size || (depth + 1 >= max_build_depth && node.count <= leaf_size_limit))
+	{
+		return false;
+	}
+
+	// Past the depth cap the range is only split because it is too large for one leaf
+	const bool halve = depth + 1 >= max_build_depth;
+	const int first = static_cast<int>(node.left_first);
+	const int last = static_cast<int>(node.left_first + node.count);
+	const bool parallel = node.count >= parallel_binning_size;
+
+	float3 centroid_min = float3(std::numeric_limits<float>::max());
+	float3 centroid_max = float3(-std::numeric_limits<float>::max());
+#pragma omp parallel if(parallel)
+	{
+		float3 local_min = float3(std::numeric_limits<float>::max());
+		float3 local_max = float3(-std::numeric_limits<float>::max());
+#pragma omp for nowait
+		for (int i = first; i < last; i++)
+		{
+			local_min = min(local_min, centroids[indices[i]]);
+			local_max = max(local_max, centroids[indices[i]]);
+		}
+#pragma omp critical
+		{
+			centroid_min = min(centroid_min, local_min);
+			centroid_max = max(centroid_max, local_max);
+		}
+	}
+
+	// All three axes are binned in one pass; bins only take minimums, maximums and
+	// counts, so merging per-thread bins gives the same result as the serial pass
+	float3 scale;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float extent = centroid_max[axis] - centroid_min[axis];
+		scale[axis] = extent > 0.f ? bin_count / extent : 0.f;
+	}
+	BVHBin bins[3][bin_count];
+#pragma omp parallel if(parallel)
+	{
+		BVHBin local_bins[3][bin_count];
+#pragma omp for nowait
+		for (int i = first; i < last; i++)
+		{
+			unsigned int triangle = indices[i];
+			for (int axis = 0; axis < 3; axis++)
+			{
+				unsigned int bin = std::min(bin_count - 1, static_cast<unsigned int>((centroids[triangle][axis] - centroid_min[axis]) * scale[axis]));
+				local_bins[axis][bin].count++;
+				local_bins[axis][bin].Grow(triangle_min[triangle], triangle_max[triangle]);
+			}
+		}
+#pragma omp critical
+		{
+			for (int axis = 0; axis < 3; axis++)
+			{
+				for (unsigned int bin = 0; bin < bin_count; bin++)
+				{
+					if (local_bins[axis][bin].count > 0)
+					{
+						bins[axis][bin].count += local_bins[axis][bin].count;
+						bins[axis][bin].Grow(local_bins[axis][bin].aabb_min, local_bins[axis][bin].aabb_max);
+					}
+				}
+			}
+		}
+	}
+
+	// Binned SAH: sweep bin_count - 1 candidate planes along every axis
+	int best_axis = -1;
+	unsigned int best_split = 0;
+	float best_cost = std::numeric_limits<float>::max();
+	for (int axis = 0; axis < 3 && !halve; axis++)
+	{
+		if (scale[axis] <= 0.f)
+		{
+			continue;
+		}
+
+		float left_area[bin_count - 1];
+		unsigned int left_count[bin_count - 1];
+		BVHBin left;
+		for (unsigned int i = 0; i < bin_count - 1; i++)
+		{
+			left.count += bins[axis][i].count;
+			if (bins[axis][i].count > 0)
+			{
+				left.Grow(bins[axis][i].aabb_min, bins[axis][i].aabb_max);
+			}
+			left_area[i] = left.SurfaceArea();
+			left_count[i] = left.count;
+		}
+
+		BVHBin right;
+		for (unsigned int i = bin_count - 1; i > 0; i--)
+		{
+			right.count += bins[axis][i].count;
+			if (bins[axis][i].count > 0)
+			{
+				right.Grow(bins[axis][i].aabb_min, bins[axis][i].aabb_max);
+			}
+			float cost = left_area[i - 1] * left_count[i - 1] + right.SurfaceArea() * right.count;
+			if (left_count[i - 1] > 0 && right.count > 0 && cost < best_cost)
+			{
+				best_cost = cost;
+				best_axis = axis;
+				best_split = i;
+			}
+		}
+	}
+
+	unsigned int* middle = nullptr;
+	if (best_axis >= 0)
+	{
+		middle = std::partition(indices.data() + first, indices.data() + last,
+			[&](unsigned int triangle)
+			{
+				unsigned int bin = std::min(bin_count - 1, static_cast<unsigned int>((centroids[triangle][best_axis] - centroid_min[best_axis]) * scale[best_axis]));
+				return bin < best_split;
+			});
+	}
+	else
+	{
+		// No plane separates the centroids, or the node is past the depth cap: split the range in half
+		middle = indices.data() + first + node.count / 2;
+	}
+
+	unsigned int left_count = static_cast<unsigned int>(middle - (indices.data() + first));
+	unsigned int left_index = AllocateNodePair();
+	BVHBuildNode& left = build_nodes[left_index];
+	BVHBuildNode& right = build_nodes[left_index + 1];
+	left.left_first = first;
+	left.count = left_count;
+	right.left_first = first + left_count;
+	right.count = node.count - left_count;
+	node.left_first = left_index;
+	node.count = 0;
+	node.axis = std::max(best_axis, 0);
+
+	if (best_axis >= 0)
+	{
+		// The child bounds are the union of the bins on either side of the split
+		BVHBin left_bounds;
+		BVHBin right_bounds;
+		for (unsigned int i = 0; i < bin_count; i++)
+		{
+			BVHBin& side = i < best_split ? left_bounds : right_bounds;
+			if (bins[best_axis][i].count > 0)
+			{
+				side.Grow(bins[best_axis][i].aabb_min, bins[best_axis][i].aabb_max);
+			}
+		}
+		left.aabb_min = left_bounds.aabb_min;
+		left.aabb_max = left_bounds.aabb_max;
+		right.aabb_min = right_bounds.aabb_min;
+		right.aabb_max = right_bounds.aabb_max;
+	}
+	else
+	{
+		UpdateNodeBounds(left, indices, triangle_min, triangle_max);
+		UpdateNodeBounds(right, indices, triangle_min, triangle_max);
+	}
+	return true;
+}
+
+void BVH::SortByMortonCode(unsigned int first, unsigned int count, const std::vector<float3>& centroids, std::vector<unsigned int>& codes)
+{
+	const int begin = static_cast<int>(first);
+	const int end = static_cast<int>(first + count);
+	float3 centroid_min = float3(std::numeric_limits<float>::max());
+	float3 centroid_max = float3(-std::numeric_limits<float>::max());
+#pragma omp parallel
+	{
+		float3 local_min = float3(std::numeric_limits<float>::max());
+		float3 local_max = float3(-std::numeric_limits<float>::max());
+#pragma omp for nowait
+		for (int i = begin; i < end; i++)
+		{
+			local_min = min(local_min, centroids[triangle_indices[i]]);
+			local_max = max(local_max, centroids[triangle_indices[i]]);
+		}
+#pragma omp critical
+		{
+			centroid_min = min(centroid_min, local_min);
+			centroid_max = max(centroid_max, local_max);
+		}
+	}
+
+	float3 extent = max(centroid_max - centroid_min, float3(std::numeric_limits<float>::min()));
+	std::vector<unsigned int> range_codes(count);
+	std::vector<unsigned int> range_indices(triangle_indices.begin() + first, triangle_indices.begin() + first + count);
+#pragma omp parallel for
+	for (int i = 0; i < static_cast<int>(count); i++)
+	{
+		range_codes[i] = MortonCode((centroids[range_indices[i]] - centroid_min) / extent);
+	}
+	RadixSort(range_codes, range_indices);
+	std::copy(range_codes.begin(), range_codes.end(), codes.begin() + first);
+	std::copy(range_indices.begin(), range_indices.end(), triangle_indices.begin() + first);
+}
+
+void BVH::SubdivideMorton(unsigned int node_index, unsigned int depth, std::vector<unsigned int>& indices, const std::vector<float3>& triangle_min, const std::vector<float3>& triangle_max, const std::vector<unsigned int>& codes)
+{
+	if (SplitNodeMorton(node_index, depth, indices, triangle_min, triangle_max, codes))
+	{
+		unsigned int left_index = build_nodes[node_index].left_first;
+		SubdivideMorton(left_index, depth + 1, indices, triangle_min, triangle_max, codes);
+		SubdivideMorton(left_index + 1, depth + 1, indices, triangle_min, triangle_max, codes);
+	}
+}
+
+bool BVH::SplitNodeMorton(unsigned int node_index, unsigned int depth, std::vector<unsigned int>& indices, const std::vector<float3>& triangle_min, const std::vector<float3>& triangle_max, const std::vector<unsigned int>& codes)
+{
+	BVHBuildNode& node = build_nodes[node_index];
+	if (node.count <= leaf_size || (depth + 1 >= max_build_depth && node.count <= leaf_size_limit))
+	{
+		return false;
+	}
+
+	// Triangles are sorted by code, so the ones with the highest differing bit
+	// cleared come first; equal codes and ranges past the depth cap are split in half
+	const unsigned int first = node.left_first;
+	const unsigned int last = node.left_first + node.count;
+	unsigned int split = first + node.count / 2;
+	unsigned int axis = 0;
+	unsigned int difference = codes[first] ^ codes[last - 1];
+	if (difference != 0 && depth + 1 < max_build_depth)
+	{
+		int bit = HighestBit(difference);
+		unsigned int boundary = (codes[first] >> bit | 1u) << bit;
+		split = static_cast<unsigned int>(std::lower_bound(codes.begin() + first, codes.begin() + last, boundary) - codes.begin());
+		// Bits 3k + 2, 3k + 1 and 3k hold x, y and z
+		axis = 2 - bit % 3;
+	}
+
+	unsigned int left_index = AllocateNodePair();
+	BVHBuildNode& left = build_nodes[left_index];
+	BVHBuildNode& right = build_nodes[left_index + 1];
+	left.left_first = first;
+	left.count = split - first;
+	right.left_first = split;
+	right.count = last - split;
+	node.left_first = left_index;
+	node.count = 0;
+	node.axis = axis;
+
+	UpdateNodeBounds(left, indices, triangle_min, triangle_max);
+	UpdateNodeBounds(right, indices, triangle_min, triangle_max);
+	return true;
+}
+
+unsigned int BVH::SubdivideSpatialBLAS(const BLAS& blas, const std::vector<float3>& triangle_min, const std::vector<float3>& triangle_max, std::vector<unsigned int>& output)
+{
+	unsigned int root = build_node_count.fetch_add(1);
+	std::vector<BVHReference> references(blas.primitive_count);
+	for (unsigned int i = 0; i < blas.primitive_count; i++)
+	{
+		unsigned int triangle = blas.first_primitive + i;
+		references[i].triangle = triangle;
+		references[i].aabb_min = triangle_min[triangle];
+		references[i].aabb_max = triangle_max[triangle];
+	}
+	build_nodes[root].left_first = blas.first_primitive;
+	build_nodes[root].count = blas.primitive_count;
+	UpdateNodeBounds(build_nodes[root], triangle_indices, triangle_min, triangle_max);
+
+	unsigned int budget = static_cast<unsigned int>(blas.primitive_count * spatial_split_budget);
+	SubdivideSpatial(root, 0, references, build_nodes[root].SurfaceArea(), output, budget);
+	return root;
+}
+
+void BVH::SubdivideSpatial(unsigned int node_index, unsigned int depth, std::vector<BVHReference>& references, float root_area, std::vector<unsigned int>& output, unsigned int& budget)
+{
+	BVHBuildNode& node = build_nodes[node_index];
+	const unsigned int count = static_cast<unsigned int>(references.size());
+	if (count <= leaf_size || (depth + 1 >= max_build_depth && count <= leaf_size_limit))
+	{
+		node.left_first = static_cast<unsigned int>(output.size());
+		node.count = count;
+		for (const BVHReference& reference : references)
+		{
+			output.push_back(reference.triangle);
+		}
+		return;
+	}
+
+	// Past the depth cap the references are only split because they are too many for one leaf
+	const bool halve = depth + 1 >= max_build_depth;
+
+	// Object split: the binned SAH of Subdivide over the reference centroids
+	float3 centroid_min = float3(std::numeric_limits<float>::max());
+	float3 centroid_max = float3(-std::numeric_limits<float>::max());
+	for (const BVHReference& reference : references)
+	{
+		float3 centroid = (reference.aabb_min + reference.aabb_max) * 0.5f;
+		centroid_min = min(centroid_min, centroid);
+		centroid_max = max(centroid_max, centroid);
+	}
+	float3 scale;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float extent = centroid_max[axis] - centroid_min[axis];
+		scale[axis] = extent > 0.f ? bin_count / extent : 0.f;
+	}
+	auto object_bin = [&](const BVHReference& reference, int axis)
+	{
+		float centroid = (reference.aabb_min[axis] + reference.aabb_max[axis]) * 0.5f;
+		return std::min(bin_count - 1, static_cast<unsigned int>((centroid - centroid_min[axis]) * scale[axis]));
+	};
+
+	BVHBin bins[3][bin_count];
+	for (const BVHReference& reference : references)
+	{
+		for (int axis = 0; axis < 3; axis++)
+		{
+			BVHBin& bin = bins[axis][object_bin(reference, axis)];
+			bin.count++;
+			bin.Grow(reference.aabb_min, reference.aabb_max);
+		}
+	}
+
+	int object_axis = -1;
+	unsigned int object_split = 0;
+	float object_cost = std::numeric_limits<float>::max();
+	BVHBin object_left;
+	BVHBin object_right;
+	for (int axis = 0; axis < 3 && !halve; axis++)
+	{
+		if (scale[axis] <= 0.f)
+		{
+			continue;
+		}
+		BVHBin left[bin_count];
+		for (unsigned int i = 0; i < bin_count - 1; i++)
+		{
+			left[i] = i > 0 ? left[i - 1] : BVHBin();
+			left[i].count += bins[axis][i].count;
+			if (bins[axis][i].count > 0)
+			{
+				left[i].Grow(bins[axis][i].aabb_min, bins[axis][i].aabb_max);
+			}
+		}
+		BVHBin right;
+		for (unsigned int i = bin_count - 1; i > 0; i--)
+		{
+			right.count += bins[axis][i].count;
+			if (bins[axis][i].count > 0)
+			{
+				right.Grow(bins[axis][i].aabb_min, bins[axis][i].aabb_max);
+			}
+			float cost = left[i - 1].SurfaceArea() * left[i - 1].count + right.SurfaceArea() * right.count;
+			if (left[i - 1].count > 0 && right.count > 0 && cost < object_cost)
+			{
+				object_cost = cost;
+				object_axis = axis;
+				object_split = i;
+				object_left = left[i - 1];
+				object_right = right;
+			}
+		}
+	}
+
+	// Spatial split: only worth trying where the object split children overlap noticeably
+	int spatial_axis = -1;
+	float spatial_position = 0.f;
+	float spatial_cost = std::numeric_limits<float>::max();
+	BVHBin spatial_left;
+	BVHBin spatial_right;
+	float3 overlap_min = max(object_left.aabb_min, object_right.aabb_min);
+	float3 overlap_max = min(object_left.aabb_max, object_right.aabb_max);
+	bool overlapping = object_axis < 0 || (overlap_min.x < overlap_max.x && overlap_min.y < overlap_max.y && overlap_min.z < overlap_max.z
+		&& BoundsArea(overlap_min, overlap_max) > spatial_split_alpha * root_area);
+	if (budget > 0 && overlapping && !halve)
+	{
+		for (int axis = 0; axis < 3; axis++)
+		{
+			float origin = node.aabb_min[axis];
+			float extent = node.aabb_max[axis] - node.aabb_min[axis];
+			if (extent <= 0.f)
+			{
+				continue;
+			}
+			float bin_width = extent / bin_count;
+			auto spatial_bin = [&](float position)
+			{
+				return std::min(bin_count - 1, static_cast<unsigned int>(std::max(0.f, (position - origin) / bin_width)));
+			};
+
+			// Every reference is chopped into the bins it spans; count enters and exits per bin
+			BVHBin spatial_bins[bin_count];
+			unsigned int exits[bin_count] = {};
+			for (const BVHReference& reference : references)
+			{
+				unsigned int first_bin = spatial_bin(reference.aabb_min[axis]);
+				unsigned int last_bin = spatial_bin(reference.aabb_max[axis]);
+				spatial_bins[first_bin].count++;
+				exits[last_bin]++;
+				BVHReference rest = reference;
+				for (unsigned int bin = first_bin; bin < last_bin; bin++)
+				{
+					BVHReference left_part;
+					BVHReference right_part;
+					SplitReference(rest, axis, origin + bin_width * (bin + 1), left_part, right_part);
+					spatial_bins[bin].Grow(left_part.aabb_min, left_part.aabb_max);
+					rest = right_part;
+				}
+				spatial_bins[last_bin].Grow(rest.aabb_min, rest.aabb_max);
+			}
+
+			BVHBin left[bin_count];
+			for (unsigned int i = 0; i < bin_count - 1; i++)
+			{
+				left[i] = i > 0 ? left[i - 1] : BVHBin();
+				left[i].count += spatial_bins[i].count;
+				left[i].Grow(spatial_bins[i].aabb_min, spatial_bins[i].aabb_max);
+			}
+			BVHBin right;
+			for (unsigned int i = bin_count - 1; i > 0; i--)
+			{
+				right.count += exits[i];
+				right.Grow(spatial_bins[i].aabb_min, spatial_bins[i].aabb_max);
+				float cost = left[i - 1].SurfaceArea() * left[i - 1].count + right.SurfaceArea() * right.count;
+				if (left[i - 1].count > 0 && right.count > 0 && cost < spatial_cost)
+				{
+					spatial_cost = cost;
+					spatial_axis = axis;
+					spatial_position = origin + bin_width * i;
+					spatial_left = left[i - 1];
+					spatial_right = right;
+				}
+			}
+		}
+	}
+
+	std::vector<BVHReference> left_references;
+	std::vector<BVHReference> right_references;
+	int split_axis = std::max(object_axis, 0);
+	if (spatial_axis >= 0 && spatial_cost < object_cost)
+	{
+		split_axis = spatial_axis;
+		float left_area = spatial_left.SurfaceArea();
+		float right_area = spatial_right.SurfaceArea();
+		for (const BVHReference& reference : references)
+		{
+			if (reference.aabb_max[spatial_axis] <= spatial_position)
+			{
+				left_references.push_back(reference);
+			}
+			else if (reference.aabb_min[spatial_axis] >= spatial_position)
+			{
+				right_references.push_back(reference);
+			}
+			else
+			{
+				// Keep the whole triangle on one side when that is cheaper than duplicating it
+				float split = left_area * spatial_left.count + right_area * spatial_right.count;
+				float3 left_min = min(spatial_left.aabb_min, reference.aabb_min);
+				float3 left_max = max(spatial_left.aabb_max, reference.aabb_max);
+				float3 right_min = min(spatial_right.aabb_min, reference.aabb_min);
+				float3 right_max = max(spatial_right.aabb_max, reference.aabb_max);
+				float to_left = BoundsArea(left_min, left_max) * spatial_left.count + right_area * (spatial_right.count - 1);
+				float to_right = left_area * (spatial_left.count - 1) + BoundsArea(right_min, right_max) * spatial_right.count;
+				if (budget == 0 || std::min(to_left, to_right) < split)
+				{
+					(to_left <= to_right ? left_references : right_references).push_back(reference);
+				}
+				else
+				{
+					BVHReference left_part;
+					BVHReference right_part;
+					SplitReference(reference, spatial_axis, spatial_position, left_part, right_part);
+					if (left_part.IsEmpty() || right_part.IsEmpty())
+					{
+						(left_part.IsEmpty() ? right_references : left_references).push_back(reference);
+						continue;
+					}
+					left_references.push_back(left_part);
+					right_references.push_back(right_part);
+					budget--;
+				}
+			}
+		}
+		if (left_references.empty() || right_references.empty())
+		{
+			left_references.clear();
+			right_references.clear();
+		}
+		else
+		{
+			spatial_split_count++;
+		}
+	}
+	if (left_references.empty() && right_references.empty())
+	{
+		for (const BVHReference& reference : references)
+		{
+			bool left = object_axis >= 0 ? object_bin(reference, object_axis) < object_split : left_references.size() < count / 2;
+			(left ? left_references : right_references).push_back(reference);
+		}
+	}
+	references.clear();
+	references.shrink_to_fit();
+
+	unsigned int left_index = AllocateNodePair();
+	BVHBuildNode& left = build_nodes[left_index];
+	BVHBuildNode& right = build_nodes[left_index + 1];
+	node.left_first = left_index;
+	node.count = 0;
+	node.axis = split_axis;
+	left.aabb_min = right.aabb_min = float3(std::numeric_limits<float>::max());
+	left.aabb_max = right.aabb_max = float3(-std::numeric_limits<float>::max());
+	for (const BVHReference& reference : left_references)
+	{
+		left.aabb_min = min(left.aabb_min, reference.aabb_min);
+		left.aabb_max = max(left.aabb_max, reference.aabb_max);
+	}
+	for (const BVHReference& reference : right_references)
+	{
+		right.aabb_min = min(right.aabb_min, reference.aabb_min);
+		right.aabb_max = max(right.aabb_max, reference.aabb_max);
+	}
+	SubdivideSpatial(left_index, depth + 1, left_references, root_area, output, budget);
+	SubdivideSpatial(left_index + 1, depth + 1, right_references, root_area, output, budget);
+}
+
+void BVH::SplitReference(const BVHReference& reference, int axis, float position, BVHReference& left, BVHReference& right) const
+{
+	// Clip the triangle against the plane: vertices go to their side, edge crossings to both
+	const float3 vertices[3] = { geometry.Position(reference.triangle, 0), geometry.Position(reference.triangle, 1), geometry.Position(reference.triangle, 2) };
+	left.triangle = right.triangle = reference.triangle;
+	left.aabb_min = right.aabb_min = float3(std::numeric_limits<float>::max());
+	left.aabb_max = right.aabb_max = float3(-std::numeric_limits<float>::max());
+	for (int i = 0; i < 3; i++)
+	{
+		const float3& v0 = vertices[i];
+		const float3& v1 = vertices[(i + 1) % 3];
+		if (v0[axis] <= position)
+		{
+			left.aabb_min = min(left.aabb_min, v0);
+			left.aabb_max = max(left.aabb_max, v0);
+		}
+		if (v0[axis] >= position)
+		{
+			right.aabb_min = min(right.aabb_min, v0);
+			right.aabb_max = max(right.aabb_max, v0);
+		}
+		if ((v0[axis] < position && v1[axis] > position) || (v0[axis] > position && v1[axis] < position))
+		{
+			float3 crossing = lerp(v0, v1, (position - v0[axis]) / (v1[axis] - v0[axis]));
+			crossing[axis] = position;
+			left.aabb_min = min(left.aabb_min, crossing);
+			left.aabb_max = max(left.aabb_max, crossing);
+			right.aabb_min = min(right.aabb_min, crossing);
+			right.aabb_max = max(right.aabb_max, crossing);
+		}
+	}
+	// The parts cannot be larger than the reference, which may already be clipped
+	left.aabb_max[axis] = std::min(left.aabb_max[axis], position);
+	right.aabb_min[axis] = std::max(right.aabb_min[axis], position);
+	left.aabb_min = max(left.aabb_min, reference.aabb_min);
+	left.aabb_max = min(left.aabb_max, reference.aabb_max);
+	right.aabb_min = max(right.aabb_min, reference.aabb_min);
+	right.aabb_max = min(right.aabb_max, reference.aabb_max);
+}
+
+unsigned int BVH::Flatten(unsigned int build_node_index, std::vector<BVHNode>& target)
+{
+	const BVHBuildNode& build_node = build_nodes[build_node_index];
+	unsigned int node_index = static_cast<unsigned int>(target.size());
+	target.push_back(BVHNode());
+	target[node_index].aabb_min = build_node.aabb_min;
+	target[node_index].aabb_max = build_node.aabb_max;
+	target[node_index].axis = static_cast<unsigned short>(build_node.axis);
+
+	if (build_node.IsLeaf())
+	{
+		target[node_index].offset = build_node.left_first;
+		target[node_index].count = static_cast<unsigned short>(build_node.count);
+	}
+	else
+	{
+		Flatten(build_node.left_first, target);
+		target[node_index].offset = Flatten(build_node.left_first + 1, target);
+	}
+	return node_index;
+}
+
+template<int N>
+unsigned int BVH::WideChildren(unsigned int node_index, unsigned int (&children)[N]) const
+{
+	// Pull up grandchildren in place of the largest interior child until the node is full
+	unsigned int child_count = 0;
+	if (nodes[node_index].IsLeaf())
+	{
+		children[child_count++] = node_index;
+	}
+	else
+	{
+		children[child_count++] = node_index + 1;
+		children[child_count++] = nodes[node_index].offset;
+	}
+	while (child_count < N)
+	{
+		int largest = -1;
+		float largest_area = -1.f;
+		for (unsigned int i = 0; i < child_count; i++)
+		{
+			const BVHNode& child = nodes[children[i]];
+			if (!child.IsLeaf() && child.SurfaceArea() > largest_area)
+			{
+				largest = i;
+				largest_area = child.SurfaceArea();
+			}
+		}
+		if (largest < 0)
+		{
+			break;
+		}
+		unsigned int opened = children[largest];
+		children[largest] = opened + 1;
+		children[child_count++] = nodes[opened].offset;
+	}
+	return child_count;
+}
+
+template<int N>
+unsigned int BVH::CollapseWide(std::vector<WideBVHNode<N>>& wide_nodes, unsigned int node_index) const
+{
+	unsigned int children[N];
+	unsigned int child_count = WideChildren(node_index, children);
+
+	unsigned int wide_index = static_cast<unsigned int>(wide_nodes.size());
+	wide_nodes.push_back(WideBVHNode<N>());
+	for (unsigned int i = 0; i < child_count; i++)
+	{
+		const BVHNode& child = nodes[children[i]];
+		for (int axis = 0; axis < 3; axis++)
+		{
+			wide_nodes[wide_index].bounds[2 * axis][i] = child.aabb_min[axis];
+			wide_nodes[wide_index].bounds[2 * axis + 1][i] = child.aabb_max[axis];
+		}
+		if (child.IsLeaf())
+		{
+			wide_nodes[wide_index].child[i] = child.offset;
+			wide_nodes[wide_index].count[i] = child.count;
+		}
+		else
+		{
+			// The recursion may reallocate wide_nodes, so index it again afterwards
+			unsigned int child_index = CollapseWide(wide_nodes, children[i]);
+			wide_nodes[wide_index].child[i] = child_index;
+		}
+	}
+	return wide_index;
+}
+
+template<int N>
+unsigned int BVH::CollapseQuantized(std::vector<QuantizedBVHNode<N>>& wide_nodes, unsigned int node_index)
+{
+	unsigned int quantized_index = static_cast<unsigned int>(wide_nodes.size());
+	wide_nodes.push_back(QuantizedBVHNode<N>());
+	FillQuantized(wide_nodes, node_index, quantized_index);
+	return quantized_index;
+}
+
+template<int N>
+void BVH::FillQuantized(std::vector<QuantizedBVHNode<N>>& wide_nodes, unsigned int node_index, unsigned int quantized_index)
+{
+	unsigned int children[N];
+	unsigned int child_count = WideChildren(node_index, children);
+	const BVHNode& parent = nodes[node_index];
+
+	QuantizedBVHNode<N> node;
+	float scale[3];
+	for (int axis = 0; axis < 3; axis++)
+	{
+		// Smallest power of two step whose 255 steps still reach the far side of the box
+		float origin = parent.aabb_min[axis];
+		int exponent = 0;
+		std::frexp((parent.aabb_max[axis] - origin) / 255.f, &exponent);
+		exponent = std::min(std::max(exponent, -126), 127);
+		while (exponent < 127 && origin + 255.f * std::ldexp(1.f, exponent) < parent.aabb_max[axis])
+		{
+			exponent++;
+		}
+		node.origin[axis] = origin;
+		node.exponent[axis] = static_cast<signed char>(exponent);
+		scale[axis] = std::ldexp(1.f, exponent);
+	}
+
+	unsigned int interior_count = 0;
+	node.leaf_base = static_cast<unsigned int>(quantized_leaves.size());
+	for (unsigned int i = 0; i < child_count; i++)
+	{
+		const BVHNode& child = nodes[children[i]];
+		for (int axis = 0; axis < 3; axis++)
+		{
+			// Rounded outwards, then checked with the float math traversal uses
+			float origin = node.origin[axis];
+			int low = std::min(std::max(static_cast<int>(std::floor((child.aabb_min[axis] - origin) / scale[axis])), 0), 255);
+			while (low > 0 && origin + low * scale[axis] > child.aabb_min[axis])
+			{
+				low--;
+			}
+			int high = std::min(std::max(static_cast<int>(std::ceil((child.aabb_max[axis] - origin) / scale[axis])), 0), 255);
+			while (high < 255 && origin + high * scale[axis] < child.aabb_max[axis])
+			{
+				high++;
+			}
+			node.bounds[2 * axis][i] = static_cast<unsigned char>(low);
+			node.bounds[2 * axis + 1][i] = static_cast<unsigned char>(high);
+		}
+		if (child.IsLeaf())
+		{
+			node.leaf_mask |= 1 << i;
+			quantized_leaves.push_back({ child.offset, child.count });
+		}
+		else
+		{
+			interior_count++;
+		}
+	}
+
+	// Interior children are allocated together so one base index finds all of them
+	node.child_base = static_cast<unsigned int>(wide_nodes.size());
+	wide_nodes.resize(wide_nodes.size() + interior_count);
+	wide_nodes[quantized_index] = node;
+	unsigned int interior = 0;
+	for (unsigned int i = 0; i < child_count; i++)
+	{
+		if (!nodes[children[i]].IsLeaf())
+		{
+			FillQuantized(wide_nodes, children[i], node.child_base + interior++);
+		}
+	}
+}
+
+template<int N>
+void BVH::PackTriangleBlocks(std::vector<TriangleBlock<N>>& blocks)
+{
+	for (const BLAS& blas : blases)
+	{
+		if (blas.primitive_type == PrimitiveType::Triangle)
+		{
+			PackBLASBlocks(blas, blocks, 0);
+		}
+	}
+}
+
+template<int N>
+void BVH::PackBLASBlocks(const BLAS& blas, std::vector<TriangleBlock<N>>& blocks, unsigned int base)
+{
+	for (unsigned int n = blas.root; n < blas.root + blas.node_count; n++)
+	{
+		const BVHNode& node = nodes[n];
+		if (!node.IsLeaf())
+		{
+			continue;
+		}
+		leaf_blocks[node.offset] = base + static_cast<unsigned int>(blocks.size());
+		for (unsigned int i = 0; i < node.count; i++)
+		{
+			if (i % N == 0)
+			{
+				blocks.push_back(TriangleBlock<N>());
+			}
+			unsigned int triangle = triangle_indices[node.offset + i];
+			blocks.back().Set(i % N, geometry.Position(triangle, 0), geometry.Position(triangle, 1), geometry.Position(triangle, 2), triangle);
+		}
+	}
+}
+
+unsigned int BVH::FirstBlock(const BLAS& blas) const
+{
+	unsigned int first = std::numeric_limits<unsigned int>::max();
+	for (unsigned int n = blas.root; n < blas.root + blas.node_count; n++)
+	{
+		if (nodes[n].IsLeaf())
+		{
+			first = std::min(first, leaf_blocks[nodes[n].offset]);
+		}
+	}
+	return first;
+}
+
+template<int N>
+void BVH::RepackBlocks(std::vector<TriangleBlock<N>>& blocks, unsigned int blas_index, unsigned int first)
+{
+	// The blocks of a BLAS follow the ones of the BLASes before it
+	const BLAS& blas = blases[blas_index];
+	unsigned int end = static_cast<unsigned int>(blocks.size());
+	for (unsigned int b = blas_index + 1; b < blases.size(); b++)
+	{
+		if (blases[b].primitive_count > 0 && blases[b].primitive_type == PrimitiveType::Triangle)
+		{
+			end = FirstBlock(blases[b]);
+			break;
+		}
+	}
+
+	std::vector<TriangleBlock<N>> packed;
+	PackBLASBlocks(blas, packed, first);
+	const int shift = static_cast<int>(packed.size()) - static_cast<int>(end - first);
+	if (shift != 0)
+	{
+		for (unsigned int b = blas_index + 1; b < blases.size(); b++)
+		{
+			if (blases[b].primitive_type != PrimitiveType::Triangle)
+			{
+				continue;
+			}
+			for (unsigned int n = blases[b].root; n < blases[b].root + blases[b].node_count; n++)
+			{
+				if (nodes[n].IsLeaf())
+				{
+					leaf_blocks[nodes[n].offset] += shift;
+				}
+			}
+		}
+	}
+	blocks.erase(blocks.begin() + first, blocks.begin() + end);
+	blocks.insert(blocks.begin() + first, packed.begin(), packed.end());
+}
+
+// Empty slots of a wide node keep the inverted bounds of its constructor
+template<int N>
+static bool SlotUsed(const WideBVHNode<N>& node, int i)
+{
+	for (int axis = 0; axis < 3; axis++)
+	{
+		if (node.bounds[2 * axis][i] != std::numeric_limits<float>::infinity() || node.bounds[2 * axis + 1][i] != -std::numeric_limits<float>::infinity())
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+template<int N>
+static bool SlotUsed(const QuantizedBVHNode<N>& node, int i)
+{
+	for (int axis = 0; axis < 3; axis++)
+	{
+		if (node.bounds[2 * axis][i] != 255 || node.bounds[2 * axis + 1][i] != 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// First entry in BVH::quantized_leaves of the subtree a node of a BLAS roots
+template<int N>
+static unsigned int LeafBase(const WideBVHNode<N>&)
+{
+	return 0;
+}
+
+template<int N>
+static unsigned int LeafBase(const QuantizedBVHNode<N>& node)
+{
+	return node.leaf_base;
+}
+
+// Moves the child indices of a wide node along with the nodes and leaves they point to
+template<int N>
+static void Relocate(WideBVHNode<N>& node, unsigned int node_shift, unsigned int)
+{
+	for (int i = 0; i < N; i++)
+	{
+		if (node.count[i] == 0 && SlotUsed(node, i))
+		{
+			node.child[i] += node_shift;
+		}
+	}
+}
+
+template<int N>
+static void Relocate(QuantizedBVHNode<N>& node, unsigned int node_shift, unsigned int leaf_shift)
+{
+	node.child_base += node_shift;
+	node.leaf_base += leaf_shift;
+}
+
+template<typename WideNode>
+void BVH::RecollapseBLAS(std::vector<WideNode>& wide_nodes, unsigned int blas_index)
+{
+	// The wide nodes and quantized leaves of a BLAS follow the ones of the BLASes before it
+	unsigned int BLAS::* root = WideNode::width == 4 ? &BLAS::root4 : &BLAS::root8;
+	const unsigned int first = blases[blas_index].*root;
+	const unsigned int first_leaf = LeafBase(wide_nodes[first]);
+	unsigned int end = static_cast<unsigned int>(wide_nodes.size());
+	unsigned int leaf_end = static_cast<unsigned int>(quantized_leaves.size());
+	for (unsigned int b = blas_index + 1; b < blases.size(); b++)
+	{
+		if (blases[b].primitive_count > 0)
+		{
+			end = blases[b].*root;
+			leaf_end = LeafBase(wide_nodes[end]);
+			break;
+		}
+	}
+
+	std::vector<WideNode> collapsed;
+	std::vector<QuantizedLeaf> leaves;
+	leaves.swap(quantized_leaves);
+	Collapse(collapsed, blases[blas_index].root);
+	leaves.swap(quantized_leaves);
+	for (WideNode& node : collapsed)
+	{
+		Relocate(node, first, first_leaf);
+	}
+
+	const int node_shift = static_cast<int>(collapsed.size()) - static_cast<int>(end - first);
+	const int leaf_shift = static_cast<int>(leaves.size()) - static_cast<int>(leaf_end - first_leaf);
+	if (node_shift != 0 || leaf_shift != 0)
+	{
+		for (unsigned int i = end; i < wide_nodes.size(); i++)
+		{
+			Relocate(wide_nodes[i], node_shift, leaf_shift);
+		}
+		for (unsigned int b = blas_index + 1; b < blases.size(); b++)
+		{
+			if (blases[b].primitive_count > 0)
+			{
+				blases[b].*root += node_shift;
+			}
+		}
+	}
+	wide_nodes.erase(wide_nodes.begin() + first, wide_nodes.begin() + end);
+	wide_nodes.insert(wide_nodes.begin() + first, collapsed.begin(), collapsed.end());
+	quantized_leaves.erase(quantized_leaves.begin() + first_leaf, quantized_leaves.begin() + leaf_end);
+	quantized_leaves.insert(quantized_leaves.begin() + first_leaf, leaves.begin(), leaves.end());
+}
+
+void BVH::RepackBLAS(unsigned int blas_index, unsigned int first_block)
+{
+	const BLAS& blas = blases[blas_index];
+	if (blas.primitive_type == PrimitiveType::Triangle)
+	{
+		switch (BlockWidth())
+		{
+		case 4:
+			RepackBlocks(blocks4, blas_index, first_block);
+			break;
+		case 8:
+			RepackBlocks(blocks8, blas_index, first_block);
+			break;
+		case 16:
+			RepackBlocks(blocks16, blas_index, first_block);
+			break;
+		}
+		if (!affine_triangles.empty())
+		{
+			for (unsigned int n = blas.root; n < blas.root + blas.node_count; n++)
+			{
+				const BVHNode& node = nodes[n];
+				for (unsigned int i = node.offset; node.IsLeaf() && i < node.offset + node.count; i++)
+				{
+					unsigned int triangle = triangle_indices[i];
+					affine_triangles[i] = AffineTriangle(geometry.Position(triangle, 0), geometry.Position(triangle, 1), geometry.Position(triangle, 2));
+				}
+			}
+		}
+	}
+	if (branching_factor == 4)
+	{
+		quantized_nodes ? RecollapseBLAS(quantized_nodes4, blas_index) : RecollapseBLAS(nodes4, blas_index);
+	}
+	if (branching_factor == 8)
+	{
+		quantized_nodes ? RecollapseBLAS(quantized_nodes8, blas_index) : RecollapseBLAS(nodes8, blas_index);
+	}
+}
+
+void BVH::PrecomputeTriangles()
+{
+	affine_triangles.clear();
+	if (triangle_intersector != TriangleIntersector::Affine)
+	{
+		return;
+	}
+	affine_triangles.resize(triangle_indices.size());
+#pragma omp parallel for
+	for (int i = 0; i < static_cast<int>(triangle_indices.size()); i++)
+	{
+		unsigned int triangle = triangle_indices[i];
+		affine_triangles[i] = AffineTriangle(geometry.Position(triangle, 0), geometry.Position(triangle, 1), geometry.Position(triangle, 2));
+	}
+}
+
+void BVH::FillBuildReport()
+{
+	build_report = BVHBuildReport();
+	build_report.triangle_count = geometry.TriangleCount();
+	build_report.sphere_count = geometry.SphereCount();
+	build_report.node_count = static_cast<unsigned int>(nodes.size());
+	build_report.min_leaf_size = std::numeric_limits<unsigned int>::max();
+
+	const float primitive_count = static_cast<float>(geometry.TriangleCount() + geometry.SphereCount());
+	if (nodes.empty() || primitive_count == 0)
+	{
+		build_report.min_leaf_size = 0;
+		return;
+	}
+
+	// The SAH cost of every BLAS is weighted by its share of the primitives
+	for (BLAS& blas : blases)
+	{
+		if (blas.primitive_count == 0)
+		{
+			continue;
+		}
+		std::vector<std::pair<unsigned int, unsigned int>> stack{ { blas.root, 0 } };
+		while (!stack.empty())
+		{
+			unsigned int node_index = stack.back().first;
+			unsigned int depth = stack.back().second;
+			stack.pop_back();
+			const BVHNode& node = nodes[node_index];
+			build_report.max_depth = std::max(build_report.max_depth, depth);
+			if (node.IsLeaf())
+			{
+				unsigned int count = node.count;
+				build_report.leaf_count++;
+				build_report.min_leaf_size = std::min(build_report.min_leaf_size, count);
+				build_report.max_leaf_size = std::max(build_report.max_leaf_size, count);
+			}
+			else
+			{
+				stack.push_back({ node_index + 1, depth + 1 });
+				stack.push_back({ node.offset, depth + 1 });
+			}
+		}
+		blas.sah_cost = BLASCost(blas);
+		build_report.sah_cost += blas.sah_cost * (blas.primitive_count / primitive_count);
+		build_report.overlap += BLASOverlap(blas) * (blas.primitive_count / primitive_count);
+	}
+	build_report.reference_count = static_cast<unsigned int>(triangle_indices.size());
+	build_report.spatial_split_count = spatial_split_count;
+	build_report.average_leaf_size = (triangle_indices.size() + sphere_indices.size()) / static_cast<float>(build_report.leaf_count);
+	build_report.branching_factor = branching_factor;
+	build_report.quantized = quantized_nodes;
+	switch (branching_factor)
+	{
+	case 4:
+		build_report.wide_node_count = static_cast<unsigned int>(quantized_nodes ? quantized_nodes4.size() : nodes4.size());
+		build_report.node_bytes = quantized_nodes ? quantized_nodes4.size() * sizeof(QuantizedBVHNode<4>) : nodes4.size() * sizeof(WideBVHNode<4>);
+		break;
+	case 8:
+		build_report.wide_node_count = static_cast<unsigned int>(quantized_nodes ? quantized_nodes8.size() : nodes8.size());
+		build_report.node_bytes = quantized_nodes ? quantized_nodes8.size() * sizeof(QuantizedBVHNode<8>) : nodes8.size() * sizeof(WideBVHNode<8>);
+		break;
+	default:
+		build_report.node_bytes = nodes.size() * sizeof(BVHNode);
+		break;
+	}
+	build_report.node_bytes += quantized_leaves.size() * sizeof(QuantizedLeaf);
+	build_report.blas_count = static_cast<unsigned int>(blases.size());
+	build_report.instance_count = static_cast<unsigned int>(tlas_instances.size());
+}
+
+bool BVH::SaveSceneCache(const std::string& cache_file, const std::string& source_file) const
+{
+	if (nodes.empty())
+	{
+		return false;
+	}
+	SceneCacheHeader header;
+	header.source_hash = HashObjFile(source_file);
+	header.build_mode = static_cast<unsigned int>(build_mode);
+	header.leaf_size = leaf_size;
+	header.branching_factor = branching_factor;
+	header.triangle_block_width = BlockWidth();
+	header.quantized_nodes = quantized_nodes ? 1 : 0;
+	header.analytic_spheres = analytic_spheres ? 1 : 0;
+	header.spatial_split_budget = spatial_split_budget;
+	header.spatial_split_count = spatial_split_count;
+
+	std::vector<unsigned int> model_ranges;
+	for (auto& model : models)
+	{
+		model_ranges.push_back(model.first);
+		model_ranges.push_back(model.second);
+	}
+
+	std::vector<char> buffer(sizeof(SceneCacheHeader));
+	WriteSceneCacheSection(buffer, header, SceneCacheSection::Vertices, geometry.vertices);
+	WriteSceneCacheSection(buffer, header, SceneCacheSection::Triangles, geometry.triangles);
+	WriteSceneCacheSection(buffer, header, SceneCacheSection::Materials, geometry.materials);
+	WriteSceneCacheSection(buffer, header, SceneCacheSection::Spheres, geometry.spheres);
+	WriteSceneCacheSection(buffer, header, SceneCacheSection::Models, model_ranges);
+	WriteSceneCacheSection(buffer, header, SceneCacheSection::BLASes, blases);
+	WriteSceneCacheSection(buffer, header, SceneCacheSection::MeshFirstTriangle, mesh_first_triangle);
+	WriteSceneCacheSection(buffer, header, SceneCacheSection::Nodes, nodes);
+	WriteSceneCacheSection(buffer, header, SceneCacheSection::TriangleIndices, triangle_indices);
+	WriteSceneCacheSection(buffer, header, SceneCacheSection::SphereIndices, sphere_indices);
+	WriteSceneCacheSection(buffer, header, SceneCacheSection::Nodes4, nodes4);
+	WriteSceneCacheSection(buffer, header, SceneCacheSection::Nodes8, nodes8);
+	WriteSceneCacheSection(buffer, header, SceneCacheSection::Blocks4, blocks4);
+	WriteSceneCacheSection(buffer, header, SceneCacheSection::Blocks8, blocks8);
+	WriteSceneCacheSection(buffer, header, SceneCacheSection::Blocks16, blocks16);
+	WriteSceneCacheSection(buffer, header, SceneCacheSection::LeafBlocks, leaf_blocks);
+	WriteSceneCacheSection(buffer, header, SceneCacheSection::QuantizedNodes4, quantized_nodes4);
+	WriteSceneCacheSection(buffer, header, SceneCacheSection::QuantizedNodes8, quantized_nodes8);
+	WriteSceneCacheSection(buffer, header, SceneCacheSection::QuantizedLeaves, quantized_leaves);
+	std::memcpy(buffer.data(), &header, sizeof(SceneCacheHeader));
+
+	std::ofstream file(cache_file, std::ios::binary | std::ios::trunc);
+	file.write(buffer.data(), buffer.size());
+	return file.good();
+}
+
+class WideStackEntry
+{
+public:
+	unsigned int child;
+	unsigned int count;
+	float t;
+};
+
+template<int N>
+static WideStackEntry ChildEntry(const WideBVHNode<N>& node, int i, float t, const std::vector<QuantizedLeaf>&)
+{
+	return { node.child[i], node.count[i], t };
+}
+
+template<int N>
+static WideStackEntry ChildEntry(const QuantizedBVHNode<N>& node, int i, float t, const std::vector<QuantizedLeaf>& leaves)
+{
+	// Children of each kind are stored in slot order, so the rank of the slot is the offset
+	unsigned int before = (1u << i) - 1;
+	if (node.leaf_mask & (1u << i))
+	{
+		const QuantizedLeaf& leaf = leaves[node.leaf_base + BitCount(node.leaf_mask & before)];
+		return { leaf.offset, leaf.count, t };
+	}
+	return { node.child_base + BitCount(~node.leaf_mask & before), 0, t };
+}
+
+// Whether ChildEntry can look up every leaf slot of the node
+template<int N>
+static bool ValidLeafRank(const WideBVHNode<N>&, const std::vector<QuantizedLeaf>&)
+{
+	return true;
+}
+
+template<int N>
+static bool ValidLeafRank(const QuantizedBVHNode<N>& node, const std::vector<QuantizedLeaf>& leaves)
+{
+	return static_cast<unsigned long long>(node.leaf_base) + BitCount(node.leaf_mask & ((1u << N) - 1)) <= leaves.size();
+}
+
+// Walks a wide tree of a damaged cache the way traversal would. Every interior child
+// must lie after its parent, so the walk ends, and every leaf must pass valid_leaf.
+template<typename WideNode, typename LeafCheck>
+static bool ValidWideTree(const std::vector<WideNode>& wide_nodes, const std::vector<QuantizedLeaf>& leaves, unsigned int root, const LeafCheck& valid_leaf)
+{
+	if (root >= wide_nodes.size())
+	{
+		return false;
+	}
+	std::vector<unsigned int> stack = { root };
+	std::vector<bool> visited(wide_nodes.size(), false);
+	while (!stack.empty())
+	{
+		unsigned int n = stack.back();
+		stack.pop_back();
+		if (visited[n])
+		{
+			continue;
+		}
+		visited[n] = true;
+		const WideNode& node = wide_nodes[n];
+		if (!ValidLeafRank(node, leaves))
+		{
+			return false;
+		}
+		for (int i = 0; i < WideNode::width; i++)
+		{
+			if (!SlotUsed(node, i))
+			{
+				continue;
+			}
+			WideStackEntry entry = ChildEntry(node, i, 0.f, leaves);
+			if (entry.count > 0)
+			{
+				if (!valid_leaf(entry.child, entry.count))
+				{
+					return false;
+				}
+			}
+			else if (entry.child <= n || entry.child >= wide_nodes.size())
+			{
+				return false;
+			}
+			else
+			{
+				stack.push_back(entry.child);
+			}
+		}
+	}
+	return true;
+}
+
+bool BVH::LoadSceneCache(const std::string& cache_file, const std::string& source_file)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+
+	MappedFile file(cache_file);
+	if (!file.IsOpen() || file.Size() < sizeof(SceneCacheHeader))
+	{
+		return false;
+	}
+	SceneCacheHeader header;
+	std::memcpy(&header, file.Data(), sizeof(SceneCacheHeader));
+	if (!header.IsValid(file.Size()) || header.source_hash != HashObjFile(source_file)
+		|| header.build_mode != static_cast<unsigned int>(build_mode) || header.leaf_size != leaf_size
+		|| header.branching_factor != branching_factor || header.triangle_block_width != BlockWidth()
+		|| header.quantized_nodes != (quantized_nodes ? 1u : 0u) || header.analytic_spheres != (analytic_spheres ? 1u : 0u)
+		|| (build_mode == BVHBuildMode::SBVH && header.spatial_split_budget != spatial_split_budget))
+	{
+		return false;
+	}
+
+	// Everything is read aside first, so a damaged cache leaves the scene untouched
+	IndexedGeometry cached_geometry;
+	std::vector<unsigned int> model_ranges;
+	std::vector<BLAS> cached_blases;
+	std::vector<unsigned int> cached_mesh_first_triangle;
+	bool read = ReadSceneCacheSection(file, header, SceneCacheSection::Vertices, cached_geometry.vertices)
+		&& ReadSceneCacheSection(file, header, SceneCacheSection::Triangles, cached_geometry.triangles)
+		&& ReadSceneCacheSection(file, header, SceneCacheSection::Materials, cached_geometry.materials)
+		&& ReadSceneCacheSection(file, header, SceneCacheSection::Spheres, cached_geometry.spheres)
+		&& ReadSceneCacheSection(file, header, SceneCacheSection::Models, model_ranges)
+		&& ReadSceneCacheSection(file, header, SceneCacheSection::BLASes, cached_blases)
+		&& ReadSceneCacheSection(file, header, SceneCacheSection::MeshFirstTriangle, cached_mesh_first_triangle);
+	if (!read || model_ranges.size() % 2 != 0)
+	{
+		return false;
+	}
+	for (const IndexedTriangle& triangle : cached_geometry.triangles)
+	{
+		if (triangle.vertex[0] >= cached_geometry.vertices.size() || triangle.vertex[1] >= cached_geometry.vertices.size()
+			|| triangle.vertex[2] >= cached_geometry.vertices.size() || triangle.material >= cached_geometry.materials.size())
+		{
+			return false;
+		}
+	}
+	for (const IndexedSphere& sphere : cached_geometry.spheres)
+	{
+		if (sphere.material >= cached_geometry.materials.size())
+		{
+			return false;
+		}
+	}
+	// Meshes start in order and models cover whole meshes
+	for (size_t mesh = 0; mesh < cached_mesh_first_triangle.size(); mesh++)
+	{
+		if (cached_mesh_first_triangle[mesh] > cached_geometry.triangles.size()
+			|| (mesh > 0 && cached_mesh_first_triangle[mesh] < cached_mesh_first_triangle[mesh - 1]))
+		{
+			return false;
+		}
+	}
+	for (size_t i = 0; i < model_ranges.size(); i += 2)
+	{
+		if (static_cast<unsigned long long>(model_ranges[i]) + model_ranges[i + 1] > cached_mesh_first_triangle.size())
+		{
+			return false;
+		}
+	}
+
+	std::vector<BVHNode> cached_nodes;
+	std::vector<unsigned int> cached_triangle_indices;
+	std::vector<unsigned int> cached_sphere_indices;
+	std::vector<WideBVHNode<4>> cached_nodes4;
+	std::vector<WideBVHNode<8>> cached_nodes8;
+	std::vector<TriangleBlock<4>> cached_blocks4;
+	std::vector<TriangleBlock<8>> cached_blocks8;
+	std::vector<TriangleBlock<16>> cached_blocks16;
+	std::vector<unsigned int> cached_leaf_blocks;
+	std::vector<QuantizedBVHNode<4>> cached_quantized_nodes4;
+	std::vector<QuantizedBVHNode<8>> cached_quantized_nodes8;
+	std::vector<QuantizedLeaf> cached_quantized_leaves;
+	read = ReadSceneCacheSection(file, header, SceneCacheSection::Nodes, cached_nodes)
+		&& ReadSceneCacheSection(file, header, SceneCacheSection::TriangleIndices, cached_triangle_indices)
+		&& ReadSceneCacheSection(file, header, SceneCacheSection::SphereIndices, cached_sphere_indices)
+		&& ReadSceneCacheSection(file, header, SceneCacheSection::Nodes4, cached_nodes4)
+		&& ReadSceneCacheSection(file, header, SceneCacheSection::Nodes8, cached_nodes8)
+		&& ReadSceneCacheSection(file, header, SceneCacheSection::Blocks4, cached_blocks4)
+		&& ReadSceneCacheSection(file, header, SceneCacheSection::Blocks8, cached_blocks8)
+		&& ReadSceneCacheSection(file, header, SceneCacheSection::Blocks16, cached_blocks16)
+		&& ReadSceneCacheSection(file, header, SceneCacheSection::LeafBlocks, cached_leaf_blocks)
+		&& ReadSceneCacheSection(file, header, SceneCacheSection::QuantizedNodes4, cached_quantized_nodes4)
+		&& ReadSceneCacheSection(file, header, SceneCacheSection::QuantizedNodes8, cached_quantized_nodes8)
+		&& ReadSceneCacheSection(file, header, SceneCacheSection::QuantizedLeaves, cached_quantized_leaves);
+	if (!read || cached_nodes.empty())
+	{
+		return false;
+	}
+
+	// Every index is checked against the array it points into before anything is
+	// swapped in. Sums are taken in 64 bits, so a damaged range cannot wrap around.
+	for (unsigned int triangle : cached_triangle_indices)
+	{
+		if (triangle >= cached_geometry.triangles.size())
+		{
+			return false;
+		}
+	}
+	for (unsigned int sphere : cached_sphere_indices)
+	{
+		if (sphere >= cached_geometry.spheres.size())
+		{
+			return false;
+		}
+	}
+	size_t block_count = 0;
+	bool blocks_valid = true;
+	auto check_blocks = [&](const auto& blocks)
+	{
+		block_count = blocks.size();
+		for (const auto& block : blocks)
+		{
+			for (unsigned int id : block.id)
+			{
+				blocks_valid = blocks_valid && id < cached_geometry.triangles.size();
+			}
+		}
+	};
+	switch (BlockWidth())
+	{
+	case 4:
+		check_blocks(cached_blocks4);
+		break;
+	case 8:
+		check_blocks(cached_blocks8);
+		break;
+	case 16:
+		check_blocks(cached_blocks16);
+		break;
+	}
+	if (!blocks_valid || (BlockWidth() != 0 && cached_leaf_blocks.size() != cached_triangle_indices.size()))
+	{
+		return false;
+	}
+	auto valid_leaf = [&](PrimitiveType type, unsigned long long first, unsigned long long count)
+	{
+		if (type == PrimitiveType::Sphere)
+		{
+			return first + count <= cached_sphere_indices.size();
+		}
+		if (first + count > cached_triangle_indices.size())
+		{
+			return false;
+		}
+		return BlockWidth() == 0
+			|| static_cast<unsigned long long>(cached_leaf_blocks[first]) + (count + BlockWidth() - 1) / BlockWidth() <= block_count;
+	};
+
+	for (const BLAS& blas : cached_blases)
+	{
+		size_t primitive_limit = blas.primitive_type == PrimitiveType::Sphere ? cached_geometry.spheres.size() : cached_geometry.triangles.size();
+		unsigned long long node_end = static_cast<unsigned long long>(blas.root) + blas.node_count;
+		if (static_cast<unsigned long long>(blas.first_primitive) + blas.primitive_count > primitive_limit
+			|| static_cast<unsigned long long>(blas.first_mesh) + blas.mesh_count > cached_mesh_first_triangle.size()
+			|| node_end > cached_nodes.size())
+		{
+			return false;
+		}
+		if (blas.primitive_count == 0)
+		{
+			continue;
+		}
+		if (blas.node_count == 0)
+		{
+			return false;
+		}
+		// Binary nodes are depth-first, so both children of an interior node follow it inside the BLAS
+		for (unsigned int n = blas.root; n < node_end; n++)
+		{
+			const BVHNode& node = cached_nodes[n];
+			if (node.IsLeaf() ? !valid_leaf(blas.primitive_type, node.offset, node.count)
+				: (n + 1 >= node_end || node.offset <= n + 1 || node.offset >= node_end))
+			{
+				return false;
+			}
+		}
+		auto valid_wide_leaf = [&](unsigned int first, unsigned int count) { return valid_leaf(blas.primitive_type, first, count); };
+		bool wide_valid = true;
+		if (branching_factor == 4)
+		{
+			wide_valid = quantized_nodes ? ValidWideTree(cached_quantized_nodes4, cached_quantized_leaves, blas.root4, valid_wide_leaf)
+				: ValidWideTree(cached_nodes4, cached_quantized_leaves, blas.root4, valid_wide_leaf);
+		}
+		if (branching_factor == 8)
+		{
+			wide_valid = quantized_nodes ? ValidWideTree(cached_quantized_nodes8, cached_quantized_leaves, blas.root8, valid_wide_leaf)
+				: ValidWideTree(cached_nodes8, cached_quantized_leaves, blas.root8, valid_wide_leaf);
+		}
+		if (!wide_valid)
+		{
+			return false;
+		}
+	}
+
+	geometry = std::move(cached_geometry);
+	models.clear();
+	for (size_t i = 0; i < model_ranges.size(); i += 2)
+	{
+		models.push_back({ model_ranges[i], model_ranges[i + 1] });
+	}
+	blases.swap(cached_blases);
+	mesh_first_triangle.swap(cached_mesh_first_triangle);
+	nodes.swap(cached_nodes);
+	triangle_indices.swap(cached_triangle_indices);
+	sphere_indices.swap(cached_sphere_indices);
+	nodes4.swap(cached_nodes4);
+	nodes8.swap(cached_nodes8);
+	blocks4.swap(cached_blocks4);
+	blocks8.swap(cached_blocks8);
+	blocks16.swap(cached_blocks16);
+	leaf_blocks.swap(cached_leaf_blocks);
+	quantized_nodes4.swap(cached_quantized_nodes4);
+	quantized_nodes8.swap(cached_quantized_nodes8);
+	quantized_leaves.swap(cached_quantized_leaves);
+	spatial_split_count = header.spatial_split_count;
+	for (BLAS& blas : blases)
+	{
+		blas.dirty = false;
+	}
+
+	PrecomputeTriangles();
+	BuildTLAS();
+	FillBuildReport();
+	build_report.build_mode = build_mode;
+	build_report.cached = true;
+	build_report.build_time_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	return true;
+}
+
+void BVH::DrawScene()
+{
+	// Packets trace the BLAS directly, which needs a scene without the TLAS. The
+	// edge-adaptive passes trace single rays.
+	if (packet_size == 0 || edge_max_samples > 0 || !PacketTraceable())
+	{
+		AntiAliasing::DrawScene();
+		return;
+	}
+
+	// Same 2x2 supersampling as AntiAliasing::DrawScene, but each packet covers
+	// packet_size x packet_size samples, i.e. a tile of packet_size / 2 pixels
+	camera.SetRenderTargetSize(width * 2, height * 2);
+	const short packet_tile = static_cast<short>(packet_size / 2);
+
+	scheduler.Run(width, height, [&](const Tile& tile)
+	{
+		std::vector<Ray> rays;
+		std::vector<HitRecord> closest;
+		for (short y0 = tile.y0; y0 < tile.y1; y0 += packet_tile)
+		{
+			for (short x0 = tile.x0; x0 < tile.x1; x0 += packet_tile)
+			{
+				GetTileRays(rays, x0 * 2, y0 * 2, width * 2, height * 2);
+				closest.assign(rays.size(), HitRecord(t_max));
+				unsigned long long hits = ClosestHitPacket(rays, closest.data());
+
+				auto shade = [&](short x, short y)
+				{
+					unsigned int lane = (y - y0 * 2) * packet_size + (x - x0 * 2);
+					if (hits & (1ull << lane))
+					{
+						MaterialTriangle triangle = geometry.GetTriangle(closest[lane].primitive);
+						return Hit(rays[lane], closest[lane], &triangle, raytracing_depth);
+					}
+					return Miss(rays[lane]);
+				};
+
+				// Packets hanging over the edge of the tile only shade the pixels inside it
+				for (short y = y0; y < std::min<short>(y0 + packet_tile, tile.y1); y++)
+				{
+					for (short x = x0; x < std::min<short>(x0 + packet_tile, tile.x1); x++)
+					{
+						Payload payload = shade(2 * x, 2 * y);
+						Payload payload1 = shade(2 * x + 1, 2 * y);
+						Payload payload2 = shade(2 * x, 2 * y + 1);
+						Payload payload3 = shade(2 * x + 1, 2 * y + 1);
+						float3 color = payload.color + payload1.color + payload2.color + payload3.color;
+						SetPixel(x, y, color / 4.0f);
+					}
+				}
+			}
+		}
+	});
+}
+
+void BVH::GetTileRays(std::vector<Ray>& rays, short x0, short y0, short target_width, short target_height) const
+{
+	// Lanes are numbered row by row over the full tile, samples outside the target
+	// repeat the last valid column or row and are never shaded
+	rays.clear();
+	rays.reserve(packet_size * packet_size);
+	for (short y = y0; y < y0 + static_cast<short>(packet_size); y++)
+	{
+		for (short x = x0; x < x0 + static_cast<short>(packet_size); x++)
+		{
+			rays.push_back(camera.GetCameraRay(std::min<short>(x, target_width - 1), std::min<short>(y, target_height - 1)));
+		}
+	}
+}
+
+Payload BVH::TraceRay(const Ray& ray, const unsigned int max_raytrace_depth) const
+{
+	if (max_raytrace_depth <= 0)
+	{
+		return Miss(ray);
+	}
+	HitRecord closest(t_max);
+	if (ClosestHit(ray, closest))
+	{
+		MaterialTriangle surface = HitSurface(closest, ray.position + ray.direction * closest.t);
+		return Hit(ray, closest, &surface, max_raytrace_depth);
+	}
+
+	return Miss(ray);
+}
+
+Payload BVH::TracePrimaryRay(const Ray& ray, PixelFeatures& features) const
+{
+	HitRecord closest(t_max);
+	if (!ClosestHit(ray, closest))
+	{
+		return Miss(ray);
+	}
+	MaterialTriangle surface = HitSurface(closest, ray.position + ray.direction * closest.t);
+	features.primitive = closest.primitive;
+	features.instance = closest.instance;
+	features.normal = surface.GetNormal(closest.baricentric);
+	features.albedo = surface.diffuse_color;
+	features.emission = surface.emissive_color;
+	features.depth = closest.t;
+	return Hit(ray, closest, &surface, raytracing_depth);
+}
+
+bool BVH::Occluded(const Ray& ray, const float max_t) const
+{
+	if (tlas_nodes.empty())
+	{
+		return false;
+	}
+	if (SingleIdentityInstance())
+	{
+		return OccludedBLAS(blases[tlas_instances[0].blas], ray, max_t);
+	}
+
+	float3 inv_direction = float3(1.0) / ray.direction;
+	unsigned int stack[max_depth];
+	unsigned int stack_size = 0;
+	unsigned int node_index = 0;
+
+	while (true)
+	{
+		const BVHNode& node = tlas_nodes[node_index];
+		if (node.AABBTest(ray, inv_direction, max_t))
+		{
+			if (!node.IsLeaf())
+			{
+				stack[stack_size++] = node.offset;
+				node_index = node_index + 1;
+				continue;
+			}
+
+			for (unsigned int i = node.offset; i < node.offset + node.count; i++)
+			{
+				const BVHInstance& instance = tlas_instances[instance_indices[i]];
+				const BLAS& blas = blases[instance.blas];
+				if (instance.identity ? OccludedBLAS(blas, ray, max_t) : OccludedBLAS(blas, ObjectSpaceRay(instance, ray), max_t))
+				{
+					return true;
+				}
+			}
+		}
+
+		if (stack_size == 0)
+		{
+			break;
+		}
+		node_index = stack[--stack_size];
+	}
+	return false;
+}
+
+BVHTraversalStats BVH::MeasurePrimaryRays()
+{
+	camera.SetRenderTargetSize(width, height);
+	BVHTraversalStats stats;
+	stats.rays = static_cast<unsigned long long>(width) * height;
+
+	if (packet_size > 0 && PacketTraceable())
+	{
+		const int tiles_x = (width + packet_size - 1) / packet_size;
+		const int tiles_y = (height + packet_size - 1) / packet_size;
+		unsigned long long steps = 0;
+		// The first pass times the packets, the second one counts packet node visits
+		for (int pass = 0; pass < 2; pass++)
+		{
+			auto start = std::chrono::high_resolution_clock::now();
+#pragma omp parallel for schedule(dynamic) reduction(+:steps)
+			for (int tile_index = 0; tile_index < tiles_x * tiles_y; tile_index++)
+			{
+				std::vector<Ray> rays;
+				GetTileRays(rays, static_cast<short>((tile_index % tiles_x) * packet_size), static_cast<short>((tile_index / tiles_x) * packet_size), width, height);
+				std::vector<HitRecord> closest(rays.size(), HitRecord(t_max));
+				unsigned int packet_steps = 0;
+				ClosestHitPacket(rays, closest.data(), pass == 1 ? &packet_steps : nullptr);
+				steps += packet_steps;
+			}
+			if (pass == 0)
+			{
+				stats.seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+			}
+		}
+		stats.steps = steps;
+		return stats;
+	}
+
+	auto start = std::chrono::high_resolution_clock::now();
+#pragma omp parallel for schedule(dynamic)
+	for (int y = 0; y < height; y++)
+	{
+		for (short x = 0; x < width; x++)
+		{
+			HitRecord closest(t_max);
+			ClosestHit(camera.GetCameraRay(x, y), closest);
+		}
+	}
+	stats.seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+	// The step counting pass is kept apart so that it does not skew the timing
+	unsigned long long steps = 0;
+#pragma omp parallel for schedule(dynamic) reduction(+:steps)
+	for (int y = 0; y < height; y++)
+	{
+		for (short x = 0; x < width; x++)
+		{
+			HitRecord closest(t_max);
+			unsigned int ray_steps = 0;
+			ClosestHit(camera.GetCameraRay(x, y), closest, &ray_steps);
+			steps += ray_steps;
+		}
+	}
+	stats.steps = steps;
+	return stats;
+}
+
+BVHTraversalStats BVH::MeasureShadowRays(const float3& light_position)
+{
+	camera.SetRenderTargetSize(width, height);
+	std::vector<float3> hit_points;
+	hit_points.reserve(static_cast<size_t>(width) * height);
+	for (short y = 0; y < height; y++)
+	{
+		for (short x = 0; x < width; x++)
+		{
+			Ray ray = camera.GetCameraRay(x, y);
+			HitRecord closest(t_max);
+			if (ClosestHit(ray, closest))
+			{
+				hit_points.push_back(ray.position + ray.direction * closest.t);
+			}
+		}
+	}
+
+	BVHTraversalStats stats;
+	stats.rays = hit_points.size();
+	unsigned long long occluded = 0;
+
+	auto start = std::chrono::high_resolution_clock::now();
+#pragma omp parallel for schedule(dynamic) reduction(+:occluded)
+	for (int i = 0; i < static_cast<int>(hit_points.size()); i++)
+	{
+		Ray to_light(hit_points[i], light_position - hit_points[i]);
+		if (Occluded(to_light, length(light_position - hit_points[i]) - t_min))
+		{
+			occluded++;
+		}
+	}
+	stats.seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+	stats.occluded = occluded;
+	return stats;
+}
+
+BVHTraversalStats BVH::MeasureEdgeLeaks(const float3& origin, unsigned int samples_per_edge)
+{
+	BVHTraversalStats stats;
+	// The edges are taken from the geometry as loaded
+	if (!SingleIdentityInstance())
+	{
+		return stats;
+	}
+
+	// Triangles on both sides of every edge, keyed by its two vertex indices
+	std::unordered_map<unsigned long long, std::vector<unsigned int>> edge_triangles;
+	for (unsigned int triangle = 0; triangle < geometry.TriangleCount(); triangle++)
+	{
+		const IndexedTriangle& indices = geometry.triangles[triangle];
+		for (int corner = 0; corner < 3; corner++)
+		{
+			unsigned long long v0 = indices.vertex[corner];
+			unsigned long long v1 = indices.vertex[(corner + 1) % 3];
+			edge_triangles[(std::min(v0, v1) << 32) | std::max(v0, v1)].push_back(triangle);
+		}
+	}
+
+	std::vector<Ray> rays;
+	std::vector<float> edge_distances;
+	for (auto& edge : edge_triangles)
+	{
+		if (edge.second.size() != 2)
+		{
+			continue;
+		}
+		const float3& a = geometry.vertices[edge.first >> 32].position;
+		const float3& b = geometry.vertices[edge.first & 0xFFFFFFFFull].position;
+		float3 to_origin = normalize(origin - a);
+		float facing[2];
+		for (int side = 0; side < 2; side++)
+		{
+			unsigned int triangle = edge.second[side];
+			float3 normal = cross(geometry.Position(triangle, 1) - geometry.Position(triangle, 0), geometry.Position(triangle, 2) - geometry.Position(triangle, 0));
+			facing[side] = length(normal) > 0.f ? dot(normalize(normal), to_origin) : 0.f;
+		}
+		// Grazing and silhouette edges may be missed legitimately
+		if (!(facing[0] > 0.01f && facing[1] > 0.01f) && !(facing[0] < -0.01f && facing[1] < -0.01f))
+		{
+			continue;
+		}
+		for (unsigned int sample = 0; sample < samples_per_edge; sample++)
+		{
+			float3 target = a + (b - a) * ((sample + 0.5f) / samples_per_edge);
+			rays.push_back(Ray(origin, target - origin));
+			edge_distances.push_back(length(target - origin));
+		}
+	}
+
+	stats.rays = rays.size();
+	unsigned long long leaked = 0;
+	auto start = std::chrono::high_resolution_clock::now();
+#pragma omp parallel for schedule(dynamic) reduction(+:leaked)
+	for (int i = 0; i < static_cast<int>(rays.size()); i++)
+	{
+		HitRecord closest(t_max);
+		if (!ClosestHit(rays[i], closest) || closest.t > edge_distances[i] * 1.001f)
+		{
+			leaked++;
+		}
+	}
+	stats.seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+	stats.leaked = leaked;
+	return stats;
+}
+
+bool BVH::ClosestHit(const Ray& ray, HitRecord& closest, unsigned int* steps) const
+{
+	if (tlas_nodes.empty())
+	{
+		return false;
+	}
+	if (SingleIdentityInstance())
+	{
+		closest.instance = 0;
+		return ClosestHitBLAS(blases[tlas_instances[0].blas], ray, closest, steps);
+	}
+
+	float3 inv_direction = float3(1.0) / ray.direction;
+	bool negative_direction[3] = { inv_direction.x < 0, inv_direction.y < 0, inv_direction.z < 0 };
+
+	unsigned int stack[max_depth];
+	unsigned int stack_size = 0;
+	unsigned int node_index = 0;
+	bool hit = false;
+
+	while (true)
+	{
+		const BVHNode& node = tlas_nodes[node_index];
+		if (steps)
+		{
+			(*steps)++;
+		}
+		if (node.AABBTest(ray, inv_direction, closest.t))
+		{
+			if (!node.IsLeaf())
+			{
+				if (negative_direction[node.axis])
+				{
+					stack[stack_size++] = node_index + 1;
+					node_index = node.offset;
+				}
+				else
+				{
+					stack[stack_size++] = node.offset;
+					node_index = node_index + 1;
+				}
+				continue;
+			}
+
+			for (unsigned int i = node.offset; i < node.offset + node.count; i++)
+			{
+				const BVHInstance& instance = tlas_instances[instance_indices[i]];
+				const BLAS& blas = blases[instance.blas];
+				bool instance_hit = instance.identity
+					? ClosestHitBLAS(blas, ray, closest, steps)
+					: ClosestHitBLAS(blas, ObjectSpaceRay(instance, ray), closest, steps);
+				if (instance_hit)
+				{
+					closest.instance = instance_indices[i];
+					hit = true;
+				}
+			}
+		}
+
+		if (stack_size == 0)
+		{
+			break;
+		}
+		node_index = stack[--stack_size];
+	}
+	return hit;
+}
+
+bool BVH::ClosestHitBLAS(const BLAS& blas, const Ray& ray, HitRecord& closest, unsigned int* steps) const
+{
+	switch (blas.primitive_type)
+	{
+	case PrimitiveType::Sphere:
+		return ClosestHitTyped<PrimitiveType::Sphere>(blas, ray, closest, steps);
+	default:
+		return ClosestHitTyped<PrimitiveType::Triangle>(blas, ray, closest, steps);
+	}
+}
+
+bool BVH::OccludedBLAS(const BLAS& blas, const Ray& ray, const float max_t) const
+{
+	switch (blas.primitive_type)
+	{
+	case PrimitiveType::Sphere:
+		return OccludedTyped<PrimitiveType::Sphere>(blas, ray, max_t);
+	default:
+		return OccludedTyped<PrimitiveType::Triangle>(blas, ray, max_t);
+	}
+}
+
+template<PrimitiveType type>
+bool BVH::ClosestHitTyped(const BLAS& blas, const Ray& ray, HitRecord& closest, unsigned int* steps) const
+{
+	switch (branching_factor)
+	{
+	case 4:
+		return quantized_nodes ? ClosestHitWide<type>(quantized_nodes4, ray, closest, steps, blas.root4) : ClosestHitWide<type>(nodes4, ray, closest, steps, blas.root4);
+	case 8:
+		return quantized_nodes ? ClosestHitWide<type>(quantized_nodes8, ray, closest, steps, blas.root8) : ClosestHitWide<type>(nodes8, ray, closest, steps, blas.root8);
+	default:
+		return ClosestHitBinary<type>(ray, closest, steps, blas.root);
+	}
+}
+
+template<PrimitiveType type>
+bool BVH::OccludedTyped(const BLAS& blas, const Ray& ray, const float max_t) const
+{
+	switch (branching_factor)
+	{
+	case 4:
+		return quantized_nodes ? OccludedWide<type>(quantized_nodes4, ray, max_t, blas.root4) : OccludedWide<type>(nodes4, ray, max_t, blas.root4);
+	case 8:
+		return quantized_nodes ? OccludedWide<type>(quantized_nodes8, ray, max_t, blas.root8) : OccludedWide<type>(nodes8, ray, max_t, blas.root8);
+	default:
+		return OccludedBinary<type>(ray, max_t, blas.root);
+	}
+}
+
+Ray BVH::ObjectSpaceRay(const BVHInstance& instance, const Ray& ray) const
 {
+	// The direction is left unnormalized so that t stays the world space distance
+	Ray object_ray(TransformPoint(instance.inverse_transform, ray.position), ray.direction);
+	object_ray.direction = TransformVector(instance.inverse_transform, ray.direction);
+	return object_ray;
 }
 
-bool cmp(const Mesh& a, const Mesh& b)
+MaterialTriangle BVH::WorldTriangle(unsigned int instance, unsigned int triangle) const
 {
-	return a.aabb_max.y < b.aabb_max.y;
+	const BVHInstance& placement = tlas_instances[instance];
+	MaterialTriangle source = geometry.GetTriangle(triangle);
+	if (placement.identity)
+	{
+		return source;
+	}
+
+	Vertex vertices[3] = { source.a, source.b, source.c };
+	for (Vertex& vertex : vertices)
+	{
+		vertex.position = TransformPoint(placement.transform, vertex.position);
+		if (length(vertex.normal) > 0.f)
+		{
+			vertex.normal = normalize(mul(placement.normal_transform, vertex.normal));
+		}
+	}
+	MaterialTriangle world(vertices[0], vertices[1], vertices[2]);
+	world.emissive_color = source.emissive_color;
+	world.ambient_color = source.ambient_color;
+	world.diffuse_color = source.diffuse_color;
+	world.specular_color = source.specular_color;
+	world.specular_exponent = source.specular_exponent;
+	world.ior = source.ior;
+	world.reflectiveness = source.reflectiveness;
+	world.reflectiveness_and_transparency = source.reflectiveness_and_transparency;
+	return world;
 }
 
-void BVH::BuildBVH()
+MaterialTriangle BVH::HitSurface(const HitRecord& hit, const float3& point) const
 {
-	std::sort(meshes.begin(), meshes.end(), cmp);
-	auto middle = meshes.begin();
-	std::advance(middle, 2);
-	std::vector<Mesh> leftHalf(meshes.begin(), middle);
-	std::vector<Mesh> rightHalf(middle, meshes.end());
-
-	TLAS left;
-	for (auto& mesh : leftHalf)
+	const BVHInstance& placement = tlas_instances[hit.instance];
+	if (blases[placement.blas].primitive_type == PrimitiveType::Triangle)
 	{
-		left.AddMesh(mesh);
+		return WorldTriangle(hit.instance, hit.primitive);
 	}
-	tlases.push_back(left);
 
-	TLAS right;
-	for (auto& mesh : rightHalf)
+	// The sphere normal is found in object space and carried out like a vertex normal
+	if (placement.identity)
 	{
-		right.AddMesh(mesh);
+		return geometry.GetSphereSurface(hit.primitive, point);
 	}
-	tlases.push_back(right);
+	MaterialTriangle surface = geometry.GetSphereSurface(hit.primitive, TransformPoint(placement.inverse_transform, point));
+	surface.a = surface.b = surface.c = Vertex(point);
+	surface.geo_normal = normalize(mul(placement.normal_transform, surface.geo_normal));
+	return surface;
 }
 
-Payload BVH::TraceRay(const Ray& ray, const unsigned int max_raytrace_depth) const
+unsigned long long BVH::ClosestHitPacket(const std::vector<Ray>& rays, HitRecord* closest, unsigned int* steps) const
 {
-	if (max_raytrace_depth <= 0)
+	RayPacket packet(rays);
+	unsigned long long hits = 0;
+	if (!PacketTraceable())
 	{
-		return Miss(ray);
+		return hits;
+	}
+	const unsigned int root = blases[tlas_instances[0].blas].root;
+
+	if (!packet.IsCoherent())
+	{
+		// Rays going to different sides would disagree on the near child
+		for (unsigned int lane = 0; lane < rays.size(); lane++)
+		{
+			if (ClosestHitBinary(rays[lane], closest[lane], steps, root))
+			{
+				hits |= 1ull << lane;
+			}
+		}
+		return hits;
+	}
+
+	alignas(16) float max_t[RayPacket::max_size];
+	float packet_max_t = 0.f;
+	for (unsigned int lane = 0; lane < RayPacket::max_size; lane++)
+	{
+		max_t[lane] = lane < rays.size() ? closest[lane].t : 0.f;
+		packet_max_t = std::max(packet_max_t, max_t[lane]);
 	}
-	IntersectableData closestData(t_max);
-	MaterialTriangle closestTriangle;
 
-	for (auto& tlas : tlases)
+	struct PacketStackEntry
+	{
+		unsigned int node;
+		unsigned long long mask;
+	};
+	PacketStackEntry stack[max_depth];
+	unsigned int stack_size = 0;
+	unsigned int node_index = root;
+	unsigned long long mask = packet.AllLanes();
+
+	while (true)
 	{
-		if (!tlas.AABBTest(ray))
+		const BVHNode& node = nodes[node_index];
+		if (steps)
+		{
+			(*steps)++;
+		}
+		// The frustum test rejects the node for the whole packet before any per-ray work
+		if (packet.FrustumTest(node.aabb_min, node.aabb_max, packet_max_t))
+		{
+			mask = packet.AABBTest(node.aabb_min, node.aabb_max, mask, max_t);
+		}
+		else
+		{
+			mask = 0;
+		}
+
+		if (mask && BitCount64(mask) < static_cast<int>(packet_min_lanes))
+		{
+			// The packet has diverged: finish this subtree with single rays
+			while (mask)
+			{
+				int lane = LowestBit64(mask);
+				mask &= mask - 1;
+				if (ClosestHitBinary(rays[lane], closest[lane], steps, node_index))
+				{
+					hits |= 1ull << lane;
+					max_t[lane] = closest[lane].t;
+				}
+			}
+		}
+		else if (mask && !node.IsLeaf())
 		{
+			// All rays share the direction signs, so they agree on the near child
+			if (packet.NegativeDirection(node.axis))
+			{
+				stack[stack_size++] = { node_index + 1, mask };
+				node_index = node.offset;
+			}
+			else
+			{
+				stack[stack_size++] = { node.offset, mask };
+				node_index = node_index + 1;
+			}
 			continue;
 		}
-		for (auto& mesh : tlas.GetMeshes())
+		else if (mask)
 		{
-			if (!mesh.AABBTest(ray))
+			unsigned long long leaf_hits = 0;
+			while (mask)
 			{
-				continue;
+				int lane = LowestBit64(mask);
+				mask &= mask - 1;
+				if (IntersectLeaf(rays[lane], node.offset, node.count, closest[lane]))
+				{
+					leaf_hits |= 1ull << lane;
+					max_t[lane] = closest[lane].t;
+				}
 			}
-			for (auto& object : mesh.Triangles())
+			if (leaf_hits)
 			{
-				IntersectableData data = object.Intersect(ray);
-				if (data.t > t_min && data.t < closestData.t)
+				hits |= leaf_hits;
+				packet_max_t = 0.f;
+				for (unsigned int lane = 0; lane < rays.size(); lane++)
 				{
-					closestData = data;
-					closestTriangle = object;
+					packet_max_t = std::max(packet_max_t, max_t[lane]);
 				}
 			}
 		}
+
+		if (stack_size == 0)
+		{
+			break;
+		}
+		--stack_size;
+		node_index = stack[stack_size].node;
+		mask = stack[stack_size].mask;
 	}
+	return hits;
+}
 
-	if (closestData.t < t_max)
+template<PrimitiveType type>
+bool BVH::IntersectPrimitives(const Ray& ray, unsigned int first, unsigned int count, HitRecord& closest) const
+{
+	switch (type)
 	{
-		return Hit(ray, closestData, &closestTriangle, max_raytrace_depth);
+	case PrimitiveType::Sphere:
+		return IntersectSphereLeaf(ray, first, count, closest);
+	default:
+		return IntersectLeaf(ray, first, count, closest);
 	}
+}
 
-	return Miss(ray);
+template<PrimitiveType type>
+bool BVH::OccludedPrimitives(const Ray& ray, unsigned int first, unsigned int count, const float max_t) const
+{
+	switch (type)
+	{
+	case PrimitiveType::Sphere:
+		return OccludedSphereLeaf(ray, first, count, max_t);
+	default:
+		return OccludedLeaf(ray, first, count, max_t);
+	}
 }
 
-float BVH::TraceShadowRay(const Ray& ray, const float max_t) const
+bool BVH::IntersectSphereLeaf(const Ray& ray, unsigned int first, unsigned int count, HitRecord& closest) const
 {
-	IntersectableData closestData(max_t);
-	for (auto& tlas : tlases)
+	bool hit = false;
+	for (unsigned int i = first; i < first + count; i++)
 	{
-		if (!tlas.AABBTest(ray))
+		IntersectableData data = geometry.IntersectSphere(sphere_indices[i], ray, t_min);
+		if (data.t > t_min && data.t < closest.t)
 		{
-			continue;
+			closest = HitRecord(data, sphere_indices[i], closest.instance);
+			hit = true;
+		}
+	}
+	return hit;
+}
+
+bool BVH::OccludedSphereLeaf(const Ray& ray, unsigned int first, unsigned int count, const float max_t) const
+{
+	for (unsigned int i = first; i < first + count; i++)
+	{
+		IntersectableData data = geometry.IntersectSphere(sphere_indices[i], ray, t_min);
+		if (data.t > t_min && data.t < max_t)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+bool BVH::IntersectLeaf(const Ray& ray, unsigned int first, unsigned int count, HitRecord& closest) const
+{
+	switch (BlockWidth())
+	{
+	case 4:
+		return IntersectLeafBlocks(blocks4, ray, first, count, closest);
+	case 8:
+		return IntersectLeafBlocks(blocks8, ray, first, count, closest);
+	case 16:
+		return IntersectLeafBlocks(blocks16, ray, first, count, closest);
+	}
+
+	bool hit = false;
+	auto record = [&](unsigned int i, const IntersectableData& data)
+	{
+		if (data.t > t_min && data.t < closest.t)
+		{
+			closest = HitRecord(data, triangle_indices[i], closest.instance);
+			hit = true;
+		}
+	};
+	switch (triangle_intersector)
+	{
+	case TriangleIntersector::Affine:
+		for (unsigned int i = first; i < first + count; i++)
+		{
+			record(i, affine_triangles[i].Intersect(ray));
+		}
+		break;
+	case TriangleIntersector::Watertight:
+	{
+		WatertightRay watertight_ray(ray);
+		for (unsigned int i = first; i < first + count; i++)
+		{
+			unsigned int triangle = triangle_indices[i];
+			record(i, watertight_ray.Intersect(geometry.Position(triangle, 0), geometry.Position(triangle, 1), geometry.Position(triangle, 2)));
+		}
+		break;
+	}
+	default:
+		for (unsigned int i = first; i < first + count; i++)
+		{
+			record(i, geometry.Intersect(triangle_indices[i], ray));
 		}
-		for (auto& mesh : tlas.GetMeshes())
+		break;
+	}
+	return hit;
+}
+
+bool BVH::OccludedLeaf(const Ray& ray, unsigned int first, unsigned int count, const float max_t) const
+{
+	switch (BlockWidth())
+	{
+	case 4:
+		return OccludedLeafBlocks(blocks4, ray, first, count, max_t);
+	case 8:
+		return OccludedLeafBlocks(blocks8, ray, first, count, max_t);
+	case 16:
+		return OccludedLeafBlocks(blocks16, ray, first, count, max_t);
+	}
+
+	switch (triangle_intersector)
+	{
+	case TriangleIntersector::Affine:
+		for (unsigned int i = first; i < first + count; i++)
 		{
-			if (!mesh.AABBTest(ray))
+			IntersectableData data = affine_triangles[i].Intersect(ray);
+			if (data.t > t_min && data.t < max_t)
 			{
-				continue;
+				return true;
+			}
+		}
+		return false;
+	case TriangleIntersector::Watertight:
+	{
+		WatertightRay watertight_ray(ray);
+		for (unsigned int i = first; i < first + count; i++)
+		{
+			unsigned int triangle = triangle_indices[i];
+			IntersectableData data = watertight_ray.Intersect(geometry.Position(triangle, 0), geometry.Position(triangle, 1), geometry.Position(triangle, 2));
+			if (data.t > t_min && data.t < max_t)
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+	default:
+		for (unsigned int i = first; i < first + count; i++)
+		{
+			IntersectableData data = geometry.Intersect(triangle_indices[i], ray);
+			if (data.t > t_min && data.t < max_t)
+			{
+				return true;
 			}
-			for (auto& object : mesh.Triangles())
+		}
+		return false;
+	}
+}
+
+template<int N>
+bool BVH::IntersectLeafBlocks(const std::vector<TriangleBlock<N>>& blocks, const Ray& ray, unsigned int first, unsigned int count, HitRecord& closest) const
+{
+	BlockRay block_ray(ray);
+	bool hit = false;
+	unsigned int block = leaf_blocks[first];
+	for (unsigned int i = 0; i < count; i += N, block++)
+	{
+		int lane = IntersectTriangleBlock(blocks[block], block_ray, t_min, closest.t, closest);
+		if (lane >= 0)
+		{
+			closest.primitive = blocks[block].id[lane];
+			hit = true;
+		}
+	}
+	return hit;
+}
+
+template<int N>
+bool BVH::OccludedLeafBlocks(const std::vector<TriangleBlock<N>>& blocks, const Ray& ray, unsigned int first, unsigned int count, const float max_t) const
+{
+	BlockRay block_ray(ray);
+	unsigned int block = leaf_blocks[first];
+	for (unsigned int i = 0; i < count; i += N, block++)
+	{
+		if (OccludedTriangleBlock(blocks[block], block_ray, t_min, max_t))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+template<PrimitiveType type>
+bool BVH::ClosestHitBinary(const Ray& ray, HitRecord& closest, unsigned int* steps, unsigned int root) const
+{
+	if (nodes.empty())
+	{
+		return false;
+	}
+
+	float3 inv_direction = float3(1.0) / ray.direction;
+	bool negative_direction[3] = { inv_direction.x < 0, inv_direction.y < 0, inv_direction.z < 0 };
+
+	unsigned int stack[max_depth];
+	unsigned int stack_size = 0;
+	unsigned int node_index = root;
+	bool hit = false;
+
+	while (true)
+	{
+		const BVHNode& node = nodes[node_index];
+		if (steps)
+		{
+			(*steps)++;
+		}
+		// Nodes on the stack are pruned against the closest hit found so far
+		if (node.AABBTest(ray, inv_direction, closest.t))
+		{
+			if (!node.IsLeaf())
 			{
-				IntersectableData data = object.Intersect(ray);
-				if (data.t > t_min && data.t < closestData.t)
+				// Visit the child on the near side of the split plane first
+				if (negative_direction[node.axis])
+				{
+					stack[stack_size++] = node_index + 1;
+					node_index = node.offset;
+				}
+				else
 				{
-					return data.t;
+					stack[stack_size++] = node.offset;
+					node_index = node_index + 1;
 				}
+				continue;
+			}
+
+			hit |= IntersectPrimitives<type>(ray, node.offset, node.count, closest);
+		}
+
+		if (stack_size == 0)
+		{
+			break;
+		}
+		node_index = stack[--stack_size];
+	}
+	return hit;
+}
+
+template<PrimitiveType type>
+bool BVH::OccludedBinary(const Ray& ray, const float max_t, unsigned int root) const
+{
+	if (nodes.empty())
+	{
+		return false;
+	}
+
+	float3 inv_direction = float3(1.0) / ray.direction;
+
+	unsigned int stack[max_depth];
+	unsigned int stack_size = 0;
+	unsigned int node_index = root;
+
+	while (true)
+	{
+		const BVHNode& node = nodes[node_index];
+		if (node.AABBTest(ray, inv_direction, max_t))
+		{
+			// Any hit terminates the query, so children are visited in memory order
+			if (!node.IsLeaf())
+			{
+				stack[stack_size++] = node.offset;
+				node_index = node_index + 1;
+				continue;
+			}
+
+			if (OccludedPrimitives<type>(ray, node.offset, node.count, max_t))
+			{
+				return true;
+			}
+		}
+
+		if (stack_size == 0)
+		{
+			break;
+		}
+		node_index = stack[--stack_size];
+	}
+	return false;
+}
+
+// Ray data splatted for the SIMD slab test. The near and far planes of every
+// axis are picked by the direction sign once per ray instead of per box.
+class WideRay
+{
+public:
+	WideRay(const Ray& ray)
+	{
+		for (int axis = 0; axis < 3; axis++)
+		{
+			float inv_direction = 1.f / ray.direction[axis];
+			origin[axis] = _mm_set1_ps(ray.position[axis]);
+			inv[axis] = _mm_set1_ps(inv_direction);
+#if SIMD_AVX2
+			origin8[axis] = _mm256_set1_ps(ray.position[axis]);
+			inv8[axis] = _mm256_set1_ps(inv_direction);
+#endif
+			near_plane[axis] = 2 * axis + (inv_direction < 0 ? 1 : 0);
+			far_plane[axis] = 2 * axis + (inv_direction < 0 ? 0 : 1);
+		}
+	}
+
+	__m128 origin[3];
+	__m128 inv[3];
+#if SIMD_AVX2
+	__m256 origin8[3];
+	__m256 inv8[3];
+#endif
+	int near_plane[3];
+	int far_plane[3];
+};
+
+// Slab test of one ray against all children of a wide node. Returns the mask of
+// the children hit within [0, max_t] and writes their entry distances to t_enter.
+template<int N>
+static unsigned int IntersectChildrenSSE(const WideBVHNode<N>& node, const WideRay& ray, const float max_t, float* t_enter)
+{
+	unsigned int mask = 0;
+	const __m128 exit_scale = _mm_set1_ps(slab_exit_scale);
+	for (int offset = 0; offset < N; offset += 4)
+	{
+		__m128 t_near = _mm_setzero_ps();
+		__m128 t_far = _mm_set1_ps(max_t);
+		for (int axis = 0; axis < 3; axis++)
+		{
+			__m128 near_t = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[ray.near_plane[axis]] + offset), ray.origin[axis]), ray.inv[axis]);
+			__m128 far_t = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[ray.far_plane[axis]] + offset), ray.origin[axis]), ray.inv[axis]), exit_scale);
+			// NaN from a ray lying in a slab plane keeps the previous bound
+			t_near = _mm_max_ps(near_t, t_near);
+			t_far = _mm_min_ps(far_t, t_far);
+		}
+		_mm_store_ps(t_enter + offset, t_near);
+		mask |= static_cast<unsigned int>(_mm_movemask_ps(_mm_cmple_ps(t_near, t_far))) << offset;
+	}
+	return mask;
+}
+
+static unsigned int IntersectChildren(const WideBVHNode<4>& node, const WideRay& ray, const float max_t, float* t_enter)
+{
+	return IntersectChildrenSSE(node, ray, max_t, t_enter);
+}
+
+static unsigned int IntersectChildren(const WideBVHNode<8>& node, const WideRay& ray, const float max_t, float* t_enter)
+{
+#if SIMD_AVX2
+	__m256 t_near = _mm256_setzero_ps();
+	__m256 t_far = _mm256_set1_ps(max_t);
+	const __m256 exit_scale = _mm256_set1_ps(slab_exit_scale);
+	for (int axis = 0; axis < 3; axis++)
+	{
+		__m256 near_t = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[ray.near_plane[axis]]), ray.origin8[axis]), ray.inv8[axis]);
+		__m256 far_t = _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[ray.far_plane[axis]]), ray.origin8[axis]), ray.inv8[axis]), exit_scale);
+		t_near = _mm256_max_ps(near_t, t_near);
+		t_far = _mm256_min_ps(far_t, t_far);
+	}
+	_mm256_store_ps(t_enter, t_near);
+	return static_cast<unsigned int>(_mm256_movemask_ps(_mm256_cmp_ps(t_near, t_far, _CMP_LE_OQ)));
+#else
+	return IntersectChildrenSSE(node, ray, max_t, t_enter);
+#endif
+}
+
+// Four bytes of a quantized plane widened to floats
+static __m128 LoadQuantized(const unsigned char* bounds)
+{
+	int packed;
+	std::memcpy(&packed, bounds, sizeof(packed));
+	const __m128i zero = _mm_setzero_si128();
+	__m128i words = _mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero);
+	return _mm_cvtepi32_ps(_mm_unpacklo_epi16(words, zero));
+}
+
+// Grid step 2^exponent built from the float exponent bits
+static float QuantizedScale(signed char exponent)
+{
+	unsigned int bits = static_cast<unsigned int>(exponent + 127) << 23;
+	float scale;
+	std::memcpy(&scale, &bits, sizeof(scale));
+	return scale;
+}
+
+template<int N>
+static unsigned int IntersectChildrenSSE(const QuantizedBVHNode<N>& node, const WideRay& ray, const float max_t, float* t_enter)
+{
+	// Child planes are rebuilt as origin + q * scale, exactly the values the build checked
+	__m128 scale[3];
+	__m128 offset[3];
+	for (int axis = 0; axis < 3; axis++)
+	{
+		scale[axis] = _mm_set1_ps(QuantizedScale(node.exponent[axis]));
+		offset[axis] = _mm_set1_ps(node.origin[axis]);
+	}
+	unsigned int mask = 0;
+	const __m128 exit_scale = _mm_set1_ps(slab_exit_scale);
+	for (int first = 0; first < N; first += 4)
+	{
+		__m128 t_near = _mm_setzero_ps();
+		__m128 t_far = _mm_set1_ps(max_t);
+		for (int axis = 0; axis < 3; axis++)
+		{
+			__m128 near_bound = _mm_add_ps(_mm_mul_ps(LoadQuantized(node.bounds[ray.near_plane[axis]] + first), scale[axis]), offset[axis]);
+			__m128 far_bound = _mm_add_ps(_mm_mul_ps(LoadQuantized(node.bounds[ray.far_plane[axis]] + first), scale[axis]), offset[axis]);
+			__m128 near_t = _mm_mul_ps(_mm_sub_ps(near_bound, ray.origin[axis]), ray.inv[axis]);
+			__m128 far_t = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(far_bound, ray.origin[axis]), ray.inv[axis]), exit_scale);
+			t_near = _mm_max_ps(near_t, t_near);
+			t_far = _mm_min_ps(far_t, t_far);
+		}
+		_mm_store_ps(t_enter + first, t_near);
+		mask |= static_cast<unsigned int>(_mm_movemask_ps(_mm_cmple_ps(t_near, t_far))) << first;
+	}
+	return mask;
+}
+
+static unsigned int IntersectChildren(const QuantizedBVHNode<4>& node, const WideRay& ray, const float max_t, float* t_enter)
+{
+	return IntersectChildrenSSE(node, ray, max_t, t_enter);
+}
+
+static unsigned int IntersectChildren(const QuantizedBVHNode<8>& node, const WideRay& ray, const float max_t, float* t_enter)
+{
+#if SIMD_AVX2
+	__m256 t_near = _mm256_setzero_ps();
+	__m256 t_far = _mm256_set1_ps(max_t);
+	const __m256 exit_scale = _mm256_set1_ps(slab_exit_scale);
+	for (int axis = 0; axis < 3; axis++)
+	{
+		__m256 scale = _mm256_set1_ps(QuantizedScale(node.exponent[axis]));
+		__m256 offset = _mm256_set1_ps(node.origin[axis]);
+		__m256 near_bound = _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(node.bounds[ray.near_plane[axis]])))), scale), offset);
+		__m256 far_bound = _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(node.bounds[ray.far_plane[axis]])))), scale), offset);
+		__m256 near_t = _mm256_mul_ps(_mm256_sub_ps(near_bound, ray.origin8[axis]), ray.inv8[axis]);
+		__m256 far_t = _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(far_bound, ray.origin8[axis]), ray.inv8[axis]), exit_scale);
+		t_near = _mm256_max_ps(near_t, t_near);
+		t_far = _mm256_min_ps(far_t, t_far);
+	}
+	_mm256_store_ps(t_enter, t_near);
+	return static_cast<unsigned int>(_mm256_movemask_ps(_mm256_cmp_ps(t_near, t_far, _CMP_LE_OQ)));
+#else
+	return IntersectChildrenSSE(node, ray, max_t, t_enter);
+#endif
+}
+
+template<PrimitiveType type, typename WideNode>
+bool BVH::ClosestHitWide(const std::vector<WideNode>& wide_nodes, const Ray& ray, HitRecord& closest, unsigned int* steps, unsigned int root) const
+{
+	const int N = WideNode::width;
+	if (wide_nodes.empty())
+	{
+		return false;
+	}
+
+	WideRay wide_ray(ray);
+	WideStackEntry stack[max_depth * (N - 1) + 1];
+	unsigned int stack_size = 0;
+	stack[stack_size++] = { root, 0, 0.f };
+	bool hit = false;
+
+	while (stack_size > 0)
+	{
+		WideStackEntry entry = stack[--stack_size];
+		if (entry.t >= closest.t)
+		{
+			continue;
+		}
+		if (entry.count > 0)
+		{
+			hit |= IntersectPrimitives<type>(ray, entry.child, entry.count, closest);
+			continue;
+		}
+
+		const WideNode& node = wide_nodes[entry.child];
+		if (steps)
+		{
+			(*steps)++;
+		}
+		alignas(32) float t_enter[N];
+		unsigned int mask = IntersectChildren(node, wide_ray, closest.t, t_enter);
+
+		// Keep the hit children sorted far to near, so the nearest one is popped first
+		unsigned int first = stack_size;
+		while (mask)
+		{
+			int i = LowestBit(mask);
+			mask &= mask - 1;
+			WideStackEntry child = ChildEntry(node, i, t_enter[i], quantized_leaves);
+			unsigned int j = stack_size++;
+			while (j > first && stack[j - 1].t < child.t)
+			{
+				stack[j] = stack[j - 1];
+				j--;
+			}
+			stack[j] = child;
+		}
+	}
+	return hit;
+}
+
+template<PrimitiveType type, typename WideNode>
+bool BVH::OccludedWide(const std::vector<WideNode>& wide_nodes, const Ray& ray, const float max_t, unsigned int root) const
+{
+	const int N = WideNode::width;
+	if (wide_nodes.empty())
+	{
+		return false;
+	}
+
+	WideRay wide_ray(ray);
+	WideStackEntry stack[max_depth * (N - 1) + 1];
+	unsigned int stack_size = 0;
+	stack[stack_size++] = { root, 0, 0.f };
+
+	while (stack_size > 0)
+	{
+		WideStackEntry entry = stack[--stack_size];
+		if (entry.count > 0)
+		{
+			if (OccludedPrimitives<type>(ray, entry.child, entry.count, max_t))
+			{
+				return true;
 			}
+			continue;
+		}
+
+		// Hit children are pushed unsorted: any hit within max_t ends the query
+		const WideNode& node = wide_nodes[entry.child];
+		alignas(32) float t_enter[N];
+		unsigned int mask = IntersectChildren(node, wide_ray, max_t, t_enter);
+		while (mask)
+		{
+			int i = LowestBit(mask);
+			mask &= mask - 1;
+			stack[stack_size++] = ChildEntry(node, i, t_enter[i], quantized_leaves);
 		}
 	}
-	return max_t;
+	return false;
+}
+
+float BVHBuildNode::SurfaceArea() const
+{
+	float3 extent = aabb_max - aabb_min;
+	return 2.f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+}
+
+float BVHNode::SurfaceArea() const
+{
+	float3 extent = aabb_max - aabb_min;
+	return 2.f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
 }
 
-bool TLAS::AABBTest(const Ray& ray) const
+bool BVHNode::AABBTest(const Ray& ray, const float3& inv_direction, const float max_t) const
 {
-	float3 invRaydir = float3(1.0) / ray.direction;
-	float3 t0 = (aabb_max - ray.position) * invRaydir;
-	float3 t1 = (aabb_min - ray.position) * invRaydir;
+	float3 t0 = (aabb_max - ray.position) * inv_direction;
+	float3 t1 = (aabb_min - ray.position) * inv_direction;
 	float3 tmin = min(t0, t1);
 	float3 tmax = max(t0, t1);
-	return maxelem(tmin) <= minelem(tmax);
+	float t_enter = maxelem(tmin);
+	float t_exit = minelem(tmax) * slab_exit_scale;
+	return t_enter <= t_exit && t_exit >= 0.f && t_enter < max_t;
 }
 
-void TLAS::AddMesh(const Mesh mesh)
+std::ostream& operator<<(std::ostream& stream, const BVHBuildReport& report)
 {
-	if (meshes.empty())
+	stream << "BVH: " << report.triangle_count << " triangles, ";
+	if (report.sphere_count > 0)
+	{
+		stream << report.sphere_count << " spheres, ";
+	}
+	stream << report.node_count << " nodes, "
+		<< report.leaf_count << " leaves, depth " << report.max_depth << std::endl;
+	stream << "Leaf occupancy: min " << report.min_leaf_size
+		<< ", max " << report.max_leaf_size
+		<< ", avg " << report.average_leaf_size << std::endl;
+	if (report.instance_count > 1)
+	{
+		stream << "TLAS: " << report.instance_count << " instances of " << report.blas_count << " BLAS" << std::endl;
+	}
+	if (report.branching_factor > 2)
+	{
+		stream << "BVH" << report.branching_factor << ": " << report.wide_node_count
+			<< (report.quantized ? " quantized nodes, " : " nodes, ") << report.node_bytes / 1024 << " KB" << std::endl;
+	}
+	if (report.reference_count > report.triangle_count)
 	{
-		aabb_max = mesh.aabb_max;
-		aabb_min = mesh.aabb_min;
+		stream << "Spatial splits: " << report.spatial_split_count << ", "
+			<< report.reference_count - report.triangle_count << " duplicated references" << std::endl;
 	}
-	meshes.push_back(mesh);
-	aabb_max = max(mesh.aabb_max, aabb_max);
-	aabb_min = min(mesh.aabb_min, aabb_min);
+	const char* mode_names[] = { "Binned SAH", "LBVH", "SBVH" };
+	stream << mode_names[static_cast<int>(report.build_mode)]
+		<< " SAH cost: " << report.sah_cost << ", overlap: " << report.overlap
+		<< (report.cached ? ", loaded from cache in: " : ", build time: ") << report.build_time_ms << " ms";
+	return stream;
 }
@@ -1,24 +1,259 @@
 #pragma once
 
 #include "aabb.h"
+#include "indexed_geometry.h"
+#include "ray_packet.h"
+#include "scene_cache.h"
+#include "simd.h"
+#include "triangle_block.h"
+#include "triangle_intersectors.h"
 
-class TLAS
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <utility>
+
+// Node of the temporary tree produced by the builder
+class BVHBuildNode
 {
 public:
-	TLAS() { meshes.clear(); };
-	virtual ~TLAS() { meshes.clear(); };
+	float3 aabb_min;
+	float3 aabb_max;
+	// Interior nodes: index of the left child, the right one is stored next to it.
+	// Leaves: index of the first entry in BVH::triangle_indices.
+	unsigned int left_first = 0;
+	unsigned int count = 0;
+	unsigned int axis = 0;
 
-	bool AABBTest(const Ray& ray) const;
-	void AddMesh(const Mesh mesh);
+	bool IsLeaf() const { return count > 0; };
+	float SurfaceArea() const;
+};
 
+// A triangle, or the part of it on one side of a spatial split, while the SBVH
+// builder distributes it. Split parts of one triangle end up in several leaves.
+class BVHReference
+{
+public:
+	unsigned int triangle = 0;
 	float3 aabb_min;
 	float3 aabb_max;
-	float3 aabb_center() const { return aabb_min + (aabb_max - aabb_min) / 2.0f; };
 
-	const std::vector<Mesh> GetMeshes() const { return meshes; };
+	bool IsEmpty() const { return aabb_min.x > aabb_max.x || aabb_min.y > aabb_max.y || aabb_min.z > aabb_max.z; };
+};
 
-protected:
-	std::vector<Mesh> meshes;
+// Node of the linear BVH used for traversal. Nodes are stored in depth-first
+// order, so the first child of an interior node always follows its parent.
+class alignas(32) BVHNode
+{
+public:
+	float3 aabb_min;
+	// Leaves: index of the first entry in BVH::triangle_indices.
+	// Interior nodes: index of the second child.
+	unsigned int offset = 0;
+	float3 aabb_max;
+	unsigned short count = 0;
+	unsigned short axis = 0;
+
+	bool IsLeaf() const { return count > 0; };
+	float SurfaceArea() const;
+	bool AABBTest(const Ray& ray, const float3& inv_direction, const float max_t) const;
+};
+
+static_assert(sizeof(BVHNode) == 32, "BVHNode should take a half of a cache line");
+
+// Node of a 4- or 8-wide BVH collapsed from the binary one. Child bounds are
+// stored as structure of arrays, so a ray is tested against all children with
+// one SIMD slab test. Empty slots have inverted bounds and are never hit.
+template<int N>
+class alignas(64) WideBVHNode
+{
+public:
+	static const int width = N;
+
+	WideBVHNode()
+	{
+		for (int i = 0; i < N; i++)
+		{
+			for (int axis = 0; axis < 3; axis++)
+			{
+				bounds[2 * axis][i] = std::numeric_limits<float>::infinity();
+				bounds[2 * axis + 1][i] = -std::numeric_limits<float>::infinity();
+			}
+			child[i] = 0;
+			count[i] = 0;
+		}
+	};
+
+	// min x, max x, min y, max y, min z, max z of every child
+	float bounds[6][N];
+	// Interior children: index of the child node.
+	// Leaf children: index of the first entry in BVH::triangle_indices.
+	unsigned int child[N];
+	// Number of triangles of leaf children, 0 for interior children
+	unsigned short count[N];
+};
+
+// Range of BVH::triangle_indices of a leaf child of a quantized node
+class QuantizedLeaf
+{
+public:
+	unsigned int offset = 0;
+	unsigned int count = 0;
+};
+
+// Wide node whose child bounds are 8-bit steps on a grid over the node's own box
+// (Ylitie et al. 2017). The bounds are rounded outwards, so a child box can only
+// grow and traversal finds the same hits. Interior children are stored one after
+// another from child_base, leaf children from leaf_base in BVH::quantized_leaves.
+// Empty slots have inverted bounds and are never hit.
+template<int N>
+class alignas(16) QuantizedBVHNode
+{
+public:
+	static const int width = N;
+
+	QuantizedBVHNode()
+	{
+		for (int i = 0; i < N; i++)
+		{
+			for (int axis = 0; axis < 3; axis++)
+			{
+				bounds[2 * axis][i] = 255;
+				bounds[2 * axis + 1][i] = 0;
+			}
+		}
+	};
+
+	// Minimum corner of the node's box
+	float origin[3] = { 0.f, 0.f, 0.f };
+	// The grid step of every axis is 2^exponent
+	signed char exponent[3] = { 0, 0, 0 };
+	// Bit i is set when child i is a leaf
+	unsigned char leaf_mask = 0;
+	// min x, max x, min y, max y, min z, max z of every child in grid steps
+	unsigned char bounds[6][N];
+	unsigned int child_base = 0;
+	unsigned int leaf_base = 0;
+};
+
+static_assert(sizeof(QuantizedBVHNode<4>) == 48, "A quantized 4-wide node should fit in a cache line");
+static_assert(sizeof(QuantizedBVHNode<8>) == 80, "A quantized 8-wide node should fit in two cache lines");
+
+// Bottom-level BVH over the triangles of one loaded model, or over all analytic
+// spheres, built once however many instances refer to it. Its nodes live in the
+// shared BVH arrays.
+class BLAS
+{
+public:
+	PrimitiveType primitive_type = PrimitiveType::Triangle;
+	unsigned int first_mesh = 0;
+	unsigned int mesh_count = 0;
+	// Range in the geometry array of the primitive type, and in triangle_indices or sphere_indices
+	unsigned int first_primitive = 0;
+	unsigned int primitive_count = 0;
+	// Roots in BVH::nodes, nodes4 and nodes8, or in quantized_nodes4 and quantized_nodes8
+	// when those are built. The binary nodes of a BLAS are the contiguous range
+	// [root, root + node_count) in depth-first order.
+	unsigned int root = 0;
+	unsigned int root4 = 0;
+	unsigned int root8 = 0;
+	unsigned int node_count = 0;
+	// SAH cost now and right after the last build, to tell how much refitting degraded the tree
+	float sah_cost = 0.f;
+	float built_sah_cost = 0.f;
+	// Vertices moved since the last UpdateBVH
+	bool dirty = false;
+};
+
+// Placement of a BLAS in the scene. Rays are moved into object space with the
+// inverse transform; directions are not renormalized, so hit distances stay in world units.
+class BVHInstance
+{
+public:
+	unsigned int blas = 0;
+	float4x4 transform;
+	float4x4 inverse_transform;
+	// Transforms object space normals to world space
+	float3x3 normal_transform;
+	bool identity = true;
+	float3 aabb_min;
+	float3 aabb_max;
+};
+
+enum class BVHBuildMode
+{
+	// Binned SAH splits, slower to build and faster to trace
+	SAH,
+	// Linear BVH: triangles sorted by the Morton code of their centroid and split at code bits
+	LBVH,
+	// Binned SAH that also splits space where the children of an object split overlap,
+	// referencing straddling triangles from both sides. Built on one thread.
+	SBVH
+};
+
+// 30-bit Morton code of a position normalized to [0, 1]^3, 10 bits per axis
+unsigned int MortonCode(const float3& position);
+// Stable LSD radix sort of the keys, applying the same permutation to the values
+void RadixSort(std::vector<unsigned int>& keys, std::vector<unsigned int>& values);
+
+class BVHTraversalStats
+{
+public:
+	unsigned long long rays = 0;
+	unsigned long long steps = 0;
+	unsigned long long occluded = 0;
+	// Rays aimed at a shared edge that passed between its two triangles
+	unsigned long long leaked = 0;
+	double seconds = 0.0;
+
+	double StepsPerRay() const { return rays > 0 ? steps / static_cast<double>(rays) : 0.0; };
+	double RaysPerSecond() const { return seconds > 0.0 ? rays / seconds : 0.0; };
+};
+
+class BVHBuildReport
+{
+public:
+	unsigned int triangle_count = 0;
+	unsigned int sphere_count = 0;
+	unsigned int node_count = 0;
+	unsigned int leaf_count = 0;
+	unsigned int max_depth = 0;
+	unsigned int min_leaf_size = 0;
+	unsigned int max_leaf_size = 0;
+	float average_leaf_size = 0.f;
+	// Expected cost of a random ray relative to the root surface area
+	float sah_cost = 0.f;
+	unsigned int branching_factor = 2;
+	unsigned int wide_node_count = 0;
+	bool quantized = false;
+	// Nodes traversed with the selected branching factor, and quantized leaves
+	size_t node_bytes = 0;
+	unsigned int blas_count = 0;
+	unsigned int instance_count = 0;
+	// Leaf entries, more than triangle_count when spatial splits duplicate triangles
+	unsigned int reference_count = 0;
+	unsigned int spatial_split_count = 0;
+	// Surface area where the two children of a node overlap, weighted like the SAH cost
+	float overlap = 0.f;
+	BVHBuildMode build_mode = BVHBuildMode::SAH;
+	// Read from a scene cache instead of built, build_time_ms is then the load time
+	bool cached = false;
+	double build_time_ms = 0.0;
+};
+
+std::ostream& operator<<(std::ostream& stream, const BVHBuildReport& report);
+
+class BVHUpdateReport
+{
+public:
+	unsigned int refit_blas_count = 0;
+	unsigned int rebuilt_blas_count = 0;
+	bool full_rebuild = false;
+	// Largest SAH cost after refitting relative to the cost after the last build
+	float max_sah_growth = 1.f;
+	// Whole update, and the part of it spent rebuilding
+	double update_time_ms = 0.0;
+	double rebuild_time_ms = 0.0;
 };
 
 class BVH : public AABB
@@ -27,11 +262,214 @@ public:
 	BVH(short width, short height);
 	virtual ~BVH();
 
+	// Every call adds a model that gets its own bottom-level BVH. Its triangles go
+	// straight into the indexed geometry, the BVH keeps no per-mesh copies.
+	virtual int LoadGeometry(std::string filename);
 	virtual void BuildBVH();
+	virtual void DrawScene();
 
 	virtual Payload TraceRay(const Ray& ray, const unsigned int max_raytrace_depth) const;
-	virtual float TraceShadowRay(const Ray& ray, const float max_t) const;
+	virtual bool Occluded(const Ray& ray, const float max_t) const;
+
+	// Clamped to leaf_size_limit, the most triangles a BVHNode can count
+	void SetLeafSize(unsigned int size) { leaf_size = size > leaf_size_limit ? leaf_size_limit : std::max(1u, size); };
+	void SetBuildMode(BVHBuildMode mode) { build_mode = mode; };
+	// SBVH stops splitting triangles once this fraction of them has been duplicated
+	void SetSpatialSplitBudget(float budget) { spatial_split_budget = std::max(0.f, budget); };
+	// Loaded meshes that are a tessellated sphere become one analytic sphere each, from the next
+	// LoadGeometry on. They no longer count as meshes.
+	void SetAnalyticSpheres(bool analytic) { analytic_spheres = analytic; };
+	unsigned int AddSphere(const float3& center, float radius, const Material& material) { return geometry.AddSphere(center, radius, material); };
+	// Places a loaded model in the scene; without instances every model is placed once as loaded.
+	// All spheres together are one more model after the loaded ones.
+	unsigned int AddInstance(unsigned int model, const float4x4& transform);
+	void ClearInstances() { instances.clear(); };
+	unsigned int GetModelCount() const { return static_cast<unsigned int>(models.size()) + (geometry.SphereCount() > 0 ? 1 : 0); };
+	unsigned int GetMeshCount() const { return static_cast<unsigned int>(mesh_first_triangle.size()); };
+	unsigned int GetMeshTriangleCount(unsigned int mesh) const;
+	// Three positions per triangle, in the order UpdateMesh takes them
+	std::vector<float3> GetMeshPositions(unsigned int mesh) const;
+	GeometryMemoryReport GetMemoryReport() const { return geometry.MemoryReport(); };
+
+	// Moves the vertices of a loaded mesh, three positions per triangle. The BVH is
+	// brought up to date by the next UpdateBVH or BuildBVH.
+	void UpdateMesh(unsigned int mesh, const std::vector<float3>& positions);
+	// Refits the bounds of the BLASes with moved meshes. A BLAS whose SAH cost grew
+	// past the rebuild threshold times its cost after the last build is rebuilt,
+	// and the whole BVH when all of them need it. Only the triangle blocks and wide
+	// nodes of the moved BLASes are made again, the build report stays that of BuildBVH.
+	void UpdateBVH();
+	void SetRebuildThreshold(float threshold) { rebuild_threshold = std::max(1.f, threshold); };
+	const BVHUpdateReport& GetUpdateReport() const { return update_report; };
+	// 2 traverses the binary tree, 4 and 8 collapse it into a wide BVH on the next BuildBVH
+	void SetBranchingFactor(unsigned int factor) { branching_factor = (factor >= 8) ? 8 : (factor >= 4 ? 4 : 2); };
+	// Stores the 4- and 8-wide nodes with 8-bit child bounds from the next BuildBVH on
+	void SetQuantizedNodes(bool quantized) { quantized_nodes = quantized; };
+	// 4, 8 or 16 packs leaf triangles into SoA blocks for the SIMD kernel, 0 keeps the scalar Triangle::Intersect
+	void SetTriangleBlockWidth(unsigned int width) { triangle_block_width = (width >= 16) ? 16 : (width >= 8 ? 8 : (width >= 4 ? 4 : 0)); };
+	// 4 or 8 traces primary rays in packets of size x size samples, 0 (the default) traces them one by one
+	void SetPacketSize(unsigned int size) { packet_size = (size >= 8) ? 8 : (size >= 4 ? 4 : 0); };
+	// Test used for leaf triangles. The SoA blocks only run Moller-Trumbore, so Affine and Watertight
+	// keep the leaves scalar whatever the block width. Either takes effect on the next BuildBVH.
+	void SetTriangleIntersector(TriangleIntersector intersector) { triangle_intersector = intersector; };
+	const BVHBuildReport& GetBuildReport() const { return build_report; };
+
+	// Writes the loaded meshes and the built BVH to a binary cache tagged with the hash of source_file
+	bool SaveSceneCache(const std::string& cache_file, const std::string& source_file) const;
+	// Replaces the loaded meshes and the BVH with a cache written by SaveSceneCache. Returns false
+	// and keeps the scene when the cache is missing, was written by another version, from another
+	// source file or with other build settings.
+	bool LoadSceneCache(const std::string& cache_file, const std::string& source_file);
+
+	// Traces one closest-hit ray per pixel without shading
+	BVHTraversalStats MeasurePrimaryRays();
+	// Traces one occlusion ray from every primary hit towards the light
+	BVHTraversalStats MeasureShadowRays(const float3& light_position);
+	// Traces rays from origin through points spread along every edge shared by two triangles
+	// that both face the origin. Such a ray has to stop at the edge at the latest.
+	BVHTraversalStats MeasureEdgeLeaks(const float3& origin, unsigned int samples_per_edge);
+
+	static const unsigned int bin_count = 16;
+	// Traversal stack size
+	static const unsigned int max_depth = 64;
+	// Leaves hold at most this many primitives, the range of BVHNode::count
+	static const unsigned int leaf_size_limit = 65535;
+	// The builders make a leaf once a branch gets this deep. A larger range than
+	// leaf_size_limit is halved instead, which takes at most 17 more levels.
+	static const unsigned int max_build_depth = max_depth - 17;
+	// A packet finishes a subtree ray by ray once fewer lanes than this are active
+	static const unsigned int packet_min_lanes = 4;
+	// Nodes with at least this many triangles are binned by all threads
+	static const unsigned int parallel_binning_size = 65536;
+	// Subtrees with at most this many triangles are built as independent parallel tasks
+	static const unsigned int parallel_subtree_size = 1024;
+	const float traversal_cost = 1.f;
+	const float intersection_cost = 1.f;
 
 protected:
-	std::vector<TLAS> tlases;
-};
\ No newline at end of file
+	// The builders sort indices, which is triangle_indices for a BLAS and instance_indices for the TLAS
+	void UpdateNodeBounds(BVHBuildNode& node, const std::vector<unsigned int>& indices, const std::vector<float3>& triangle_min, const std::vector<float3>& triangle_max) const;
+	// Both builders split a node in two and return true, or leave it a leaf
+	bool SplitNode(unsigned int node_index, unsigned int depth, std::vector<unsigned int>& indices, const std::vector<float3>& triangle_min, const std::vector<float3>& triangle_max, const std::vector<float3>& centroids);
+	bool SplitNodeMorton(unsigned int node_index, unsigned int depth, std::vector<unsigned int>& indices, const std::vector<float3>& triangle_min, const std::vector<float3>& triangle_max, const std::vector<unsigned int>& codes);
+	// Build the whole subtree under a node on the calling thread
+	void Subdivide(unsigned int node_index, unsigned int depth, std::vector<unsigned int>& indices, const std::vector<float3>& triangle_min, const std::vector<float3>& triangle_max, const std::vector<float3>& centroids);
+	void SubdivideMorton(unsigned int node_index, unsigned int depth, std::vector<unsigned int>& indices, const std::vector<float3>& triangle_min, const std::vector<float3>& triangle_max, const std::vector<unsigned int>& codes);
+	void SortByMortonCode(unsigned int first, unsigned int count, const std::vector<float3>& centroids, std::vector<unsigned int>& codes);
+	// SBVH builder. Leaves append their triangles to output; budget counts the duplicates still allowed.
+	unsigned int SubdivideSpatialBLAS(const BLAS& blas, const std::vector<float3>& triangle_min, const std::vector<float3>& triangle_max, std::vector<unsigned int>& output);
+	void SubdivideSpatial(unsigned int node_index, unsigned int depth, std::vector<BVHReference>& references, float root_area, std::vector<unsigned int>& output, unsigned int& budget);
+	void SplitReference(const BVHReference& reference, int axis, float position, BVHReference& left, BVHReference& right) const;
+	unsigned int AllocateNodePair() { return build_node_count.fetch_add(2); };
+	unsigned int Flatten(unsigned int build_node_index, std::vector<BVHNode>& target);
+	void ComputeTriangleBounds(unsigned int first, unsigned int count, std::vector<float3>& triangle_min, std::vector<float3>& triangle_max, std::vector<float3>& centroids);
+	// Splits the top of a BLAS and returns its build root, leaving the smaller subtrees in deferred
+	unsigned int SubdivideBLAS(const BLAS& blas, const std::vector<float3>& triangle_min, const std::vector<float3>& triangle_max, const std::vector<float3>& centroids, std::vector<unsigned int>& codes, std::vector<std::pair<unsigned int, unsigned int>>& deferred);
+	// Binned SAH over sphere_indices whatever the build mode, spheres are few and cannot be split
+	unsigned int SubdivideSpheres(const BLAS& blas);
+	void SubdivideDeferred(const std::vector<std::pair<unsigned int, unsigned int>>& deferred, const std::vector<float3>& triangle_min, const std::vector<float3>& triangle_max, const std::vector<float3>& centroids, const std::vector<unsigned int>& codes);
+	void RebuildBLAS(unsigned int blas_index);
+	void RefitBLAS(const BLAS& blas);
+	float BLASCost(const BLAS& blas) const;
+	float BLASOverlap(const BLAS& blas) const;
+	// Triangle blocks, wide nodes and the TLAS all follow the binary BLAS nodes
+	void FinishBuild();
+	void BuildTLAS();
+	// Children of a binary node once the largest interior ones are opened up to N of them
+	template<int N> unsigned int WideChildren(unsigned int node_index, unsigned int (&children)[N]) const;
+	template<int N> unsigned int CollapseWide(std::vector<WideBVHNode<N>>& wide_nodes, unsigned int node_index) const;
+	template<int N> unsigned int CollapseQuantized(std::vector<QuantizedBVHNode<N>>& wide_nodes, unsigned int node_index);
+	template<int N> void FillQuantized(std::vector<QuantizedBVHNode<N>>& wide_nodes, unsigned int node_index, unsigned int quantized_index);
+	template<int N> void PackTriangleBlocks(std::vector<TriangleBlock<N>>& blocks);
+	// Appends the blocks of one BLAS, its leaves find them from base on
+	template<int N> void PackBLASBlocks(const BLAS& blas, std::vector<TriangleBlock<N>>& blocks, unsigned int base);
+	unsigned int FirstBlock(const BLAS& blas) const;
+	// Packs and collapses a BLAS whose nodes changed again, in place of its old blocks
+	// and wide nodes. Those of the BLASes behind it move along when the count changed.
+	void RepackBLAS(unsigned int blas_index, unsigned int first_block);
+	template<int N> void RepackBlocks(std::vector<TriangleBlock<N>>& blocks, unsigned int blas_index, unsigned int first);
+	template<typename WideNode> void RecollapseBLAS(std::vector<WideNode>& wide_nodes, unsigned int blas_index);
+	template<int N> unsigned int Collapse(std::vector<WideBVHNode<N>>& wide_nodes, unsigned int node_index) { return CollapseWide(wide_nodes, node_index); };
+	template<int N> unsigned int Collapse(std::vector<QuantizedBVHNode<N>>& wide_nodes, unsigned int node_index) { return CollapseQuantized(wide_nodes, node_index); };
+	void PrecomputeTriangles();
+	void FillBuildReport();
+
+	bool ClosestHit(const Ray& ray, HitRecord& closest, unsigned int* steps = nullptr) const;
+	bool ClosestHitBLAS(const BLAS& blas, const Ray& ray, HitRecord& closest, unsigned int* steps) const;
+	bool OccludedBLAS(const BLAS& blas, const Ray& ray, const float max_t) const;
+	Ray ObjectSpaceRay(const BVHInstance& instance, const Ray& ray) const;
+	// The hit triangle in world space, put together from the indexed geometry for shading
+	MaterialTriangle WorldTriangle(unsigned int instance, unsigned int triangle) const;
+	// Shading data of any hit primitive at the world space hit point
+	MaterialTriangle HitSurface(const HitRecord& hit, const float3& point) const;
+	virtual Payload TracePrimaryRay(const Ray& ray, PixelFeatures& features) const;
+	// True when the scene is a single model placed as loaded, so the TLAS can be skipped
+	bool SingleIdentityInstance() const { return tlas_instances.size() == 1 && tlas_instances[0].identity; };
+	// Packets only trace a single triangle BLAS
+	bool PacketTraceable() const { return SingleIdentityInstance() && blases[tlas_instances[0].blas].primitive_type == PrimitiveType::Triangle; };
+	template<PrimitiveType type = PrimitiveType::Triangle> bool ClosestHitBinary(const Ray& ray, HitRecord& closest, unsigned int* steps, unsigned int root) const;
+	unsigned long long ClosestHitPacket(const std::vector<Ray>& rays, HitRecord* closest, unsigned int* steps = nullptr) const;
+	void GetTileRays(std::vector<Ray>& rays, short x0, short y0, short target_width, short target_height) const;
+	template<PrimitiveType type> bool OccludedBinary(const Ray& ray, const float max_t, unsigned int root) const;
+	template<PrimitiveType type, typename WideNode> bool ClosestHitWide(const std::vector<WideNode>& wide_nodes, const Ray& ray, HitRecord& closest, unsigned int* steps, unsigned int root) const;
+	template<PrimitiveType type, typename WideNode> bool OccludedWide(const std::vector<WideNode>& wide_nodes, const Ray& ray, const float max_t, unsigned int root) const;
+	template<PrimitiveType type> bool ClosestHitTyped(const BLAS& blas, const Ray& ray, HitRecord& closest, unsigned int* steps) const;
+	template<PrimitiveType type> bool OccludedTyped(const BLAS& blas, const Ray& ray, const float max_t) const;
+	// Leaf tests of the traversals, resolved at compile time from the BLAS primitive type
+	template<PrimitiveType type> bool IntersectPrimitives(const Ray& ray, unsigned int first, unsigned int count, HitRecord& closest) const;
+	template<PrimitiveType type> bool OccludedPrimitives(const Ray& ray, unsigned int first, unsigned int count, const float max_t) const;
+	// Block width the leaves are packed and traced with, 0 unless the intersector is Moller-Trumbore
+	unsigned int BlockWidth() const { return triangle_intersector == TriangleIntersector::MollerTrumbore ? triangle_block_width : 0; };
+	bool IntersectLeaf(const Ray& ray, unsigned int first, unsigned int count, HitRecord& closest) const;
+	bool OccludedLeaf(const Ray& ray, unsigned int first, unsigned int count, const float max_t) const;
+	bool IntersectSphereLeaf(const Ray& ray, unsigned int first, unsigned int count, HitRecord& closest) const;
+	bool OccludedSphereLeaf(const Ray& ray, unsigned int first, unsigned int count, const float max_t) const;
+	template<int N> bool IntersectLeafBlocks(const std::vector<TriangleBlock<N>>& blocks, const Ray& ray, unsigned int first, unsigned int count, HitRecord& closest) const;
+	template<int N> bool OccludedLeafBlocks(const std::vector<TriangleBlock<N>>& blocks, const Ray& ray, unsigned int first, unsigned int count, const float max_t) const;
+
+	IndexedGeometry geometry;
+	std::vector<unsigned int> triangle_indices;
+	std::vector<unsigned int> sphere_indices;
+	std::vector<BVHBuildNode> build_nodes;
+	std::atomic<unsigned int> build_node_count{ 0 };
+	std::vector<BVHNode> nodes;
+	std::vector<WideBVHNode<4>> nodes4;
+	std::vector<WideBVHNode<8>> nodes8;
+	std::vector<QuantizedBVHNode<4>> quantized_nodes4;
+	std::vector<QuantizedBVHNode<8>> quantized_nodes8;
+	std::vector<QuantizedLeaf> quantized_leaves;
+	std::vector<TriangleBlock<4>> blocks4;
+	std::vector<TriangleBlock<8>> blocks8;
+	std::vector<TriangleBlock<16>> blocks16;
+	// First block of the leaf that starts at a given entry of triangle_indices
+	std::vector<unsigned int> leaf_blocks;
+	// Affine transform of every entry of triangle_indices when that intersector is selected
+	std::vector<AffineTriangle> affine_triangles;
+
+	// First mesh and mesh count of every LoadGeometry call
+	std::vector<std::pair<unsigned int, unsigned int>> models;
+	std::vector<BLAS> blases;
+	// Instances added by the user, and the ones the TLAS was built over
+	std::vector<BVHInstance> instances;
+	std::vector<BVHInstance> tlas_instances;
+	std::vector<unsigned int> instance_indices;
+	std::vector<BVHNode> tlas_nodes;
+	// First triangle in geometry of every mesh
+	std::vector<unsigned int> mesh_first_triangle;
+
+	unsigned int leaf_size = 4;
+	unsigned int branching_factor = 2;
+	unsigned int triangle_block_width = 4;
+	bool quantized_nodes = false;
+	bool analytic_spheres = false;
+	unsigned int packet_size = 0;
+	TriangleIntersector triangle_intersector = TriangleIntersector::MollerTrumbore;
+	BVHBuildMode build_mode = BVHBuildMode::SAH;
+	BVHBuildReport build_report;
+	float rebuild_threshold = 1.5f;
+	float spatial_split_budget = 0.3f;
+	// Spatial splits are only tried where the object split children overlap by more than this share of the root area
+	const float spatial_split_alpha = 1e-5f;
+	unsigned int spatial_split_count = 0;
+	BVHUpdateReport update_report;
+};
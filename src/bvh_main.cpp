@@ -3,16 +3,25 @@
 int main(int argc, char* argv[])
 {
 	BVH* render = new BVH(1920, 1080);
-	int result = render->LoadGeometry("models/CornellBox-Sphere.obj");
-	if (result)
+	const std::string model = "models/CornellBox-Sphere.obj";
+	const std::string cache = "models/CornellBox-Sphere.bvhcache";
+	// The OBJ is parsed and the BVH built only when there is no up to date cache
+	if (!render->LoadSceneCache(cache, model))
 	{
-		return result;
+		int result = render->LoadGeometry(model);
+		if (result)
+		{
+			return result;
+		}
+		render->BuildBVH();
+		render->SaveSceneCache(cache, model);
 	}
 	render->SetCamera(float3{ 0.0f, 0.795f, 1.6f }, float3{ 0, 0.795f, -1 }, float3{ 0, 1, 0 });
 	render->AddLight(new Light(float3{ 0, 1.58f, -0.03f }, float3{ 0.78f, 0.78f, 0.78f }));
-	render->BuildBVH();
+	std::cout << render->GetBuildReport() << std::endl;
+	std::cout << render->GetMemoryReport() << std::endl;
 	render->Clear();
 	render->DrawScene();
-	result = render->Save("results/bvh.png");
+	int result = render->Save("results/bvh.png");
 	return result;
 }
\ No newline at end of file
@@ -1,12 +1,17 @@
 #include "denoising.h"
+#include "random.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
-#include <time.h>
-#include <omp.h>
-#include <random>
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <numeric>
 
-Denoising::Denoising(short width, short height) : AABB(width, height)
+// Pixel traced by the recursive integrator on this thread, for the sampler in Hit
+static thread_local unsigned int traced_pixel = 0;
+
+Denoising::Denoising(short width, short height) : BVH(width, height)
 {
 	raytracing_depth = 16;
 }
@@ -17,8 +22,25 @@ Denoising::~Denoising()
 
 void Denoising::Clear()
 {
-	history_buffer.resize(width * height);
+	history_buffer.assign(width * height, float3{ 0, 0, 0 });
+	luminance_squares.assign(width * height, 0.f);
+	sample_count.assign(width * height, 0);
 	frame_buffer.resize(width * height);
+	radiance.resize(width * height);
+	// G-buffer of the filter and the reprojection, rewritten by every traced frame
+	pixel_features.assign(width * height, PixelFeatures());
+	history_camera_valid = false;
+	accumulated_frames = 0;
+	ResetConvergence();
+}
+
+void Denoising::ResetConvergence()
+{
+	// Convergence is tracked on the tiles of the scheduler
+	tile_size = scheduler.GetTileSize();
+	tiles_x = (width + tile_size - 1) / tile_size;
+	short tiles_y = (height + tile_size - 1) / tile_size;
+	tile_converged.assign(tiles_x * tiles_y, 0);
 }
 
 Payload Denoising::Hit(const Ray& ray, const IntersectableData& data, const MaterialTriangle* triangle, const unsigned int max_raytrace_depth) const
@@ -47,12 +69,7 @@ Payload Denoising::Hit(const Ray& ray, const IntersectableData& data, const Mate
 	float3 color;
 	for (int i = 0; i < numSecondaryRays; i++)
 	{
-		float3 randDirection = blue_noise[GetRandom(omp_get_thread_num() + clock())];
-		if (dot(randDirection, N) <= 0)
-		{
-			randDirection = -randDirection;
-		}
-		Ray toLight(X, randDirection);
+		Ray toLight(X, SampleDirection(N, traced_pixel, raytracing_depth - max_raytrace_depth));
 
 		Payload lightPayload = TraceRay(toLight, max_raytrace_depth - 1);
 
@@ -74,53 +91,519 @@ float3 Denoising::GetHistory(unsigned short x, unsigned short y) const
 	return history_buffer[y * width + x];
 }
 
+static float Luminance(const float3& color)
+{
+	return dot(color, float3{ 0.2126f, 0.7152f, 0.0722f });
+}
+
+void Denoising::AddSample(unsigned short x, unsigned short y, float3 color)
+{
+	unsigned int pixel = y * width + x;
+	float luminance = Luminance(color);
+	history_buffer[pixel] += color;
+	luminance_squares[pixel] += luminance * luminance;
+	sample_count[pixel]++;
+}
+
+bool Denoising::IsPixelActive(unsigned short x, unsigned short y) const
+{
+	return !tile_converged[(y / tile_size) * tiles_x + x / tile_size];
+}
+
+float Denoising::GetTileNoise(const Tile& tile) const
+{
+	// RMS standard error of the pixel means over the mean brightness of the tile, so that
+	// a dark pixel next to a bright one does not count as converged on its own
+	double error = 0.0;
+	double mean = 0.0;
+	unsigned int pixels = 0;
+	for (short y = tile.y0; y < tile.y1; y++)
+	{
+		for (short x = tile.x0; x < tile.x1; x++)
+		{
+			unsigned int pixel = y * width + x;
+			double n = sample_count[pixel];
+			if (n < 2)
+			{
+				return std::numeric_limits<float>::infinity();
+			}
+			double pixel_mean = Luminance(history_buffer[pixel]) / n;
+			double variance = std::max(luminance_squares[pixel] / n - pixel_mean * pixel_mean, 0.0) * n / (n - 1);
+			error += variance / n;
+			mean += pixel_mean;
+			pixels++;
+		}
+	}
+	return static_cast<float>(std::sqrt(error / pixels) / std::max(mean / pixels, 1e-3));
+}
+
+unsigned int Denoising::UpdateConvergence(int frame_number)
+{
+	std::vector<float> noise(tile_converged.size(), 0.f);
+	scheduler.Run(width, height, [&](const Tile& tile)
+	{
+		noise[(tile.y0 / tile_size) * tiles_x + tile.x0 / tile_size] = GetTileNoise(tile);
+	});
+
+	bool retire = noise_target > 0.f && frame_number + 1 >= min_adaptive_frames;
+	unsigned int active = 0;
+	sampling_report.max_noise = 0.f;
+	sampling_report.max_retired_noise = 0.f;
+	for (size_t i = 0; i < tile_converged.size(); i++)
+	{
+		if (retire && noise[i] < noise_target)
+		{
+			tile_converged[i] = 1;
+		}
+		active += tile_converged[i] ? 0 : 1;
+		sampling_report.max_noise = std::max(sampling_report.max_noise, noise[i]);
+		if (tile_converged[i])
+		{
+			sampling_report.max_retired_noise = std::max(sampling_report.max_retired_noise, noise[i]);
+		}
+	}
+	return active;
+}
+
 
 Payload Denoising::Miss(const Ray& ray) const
 {
 	return Payload();
 }
 
-int Denoising::GetRandom(const int thread_num) const
+float3 Denoising::SampleDirection(const float3& N, unsigned int pixel, unsigned int bounce) const
 {
-	static std::default_random_engine generator(thread_num);
-	static std::uniform_int_distribution<int> distribution(0, 512 * 512);
-	return distribution(generator);
+	CounterRng rng(pixel, frame_index, bounce);
+	if (!sampler && !blue_noise.empty())
+	{
+		float3 randDirection = blue_noise[rng.NextUInt() % blue_noise.size()];
+		return dot(randDirection, N) <= 0 ? -randDirection : randDirection;
+	}
+	// Orthonormal basis around the normal (Duff et al. 2017)
+	float3 n = normalize(N);
+	float sign = std::copysign(1.f, n.z);
+	float a = -1.f / (sign + n.z);
+	float b = n.x * n.y * a;
+	float3 tangent{ 1.f + sign * n.x * n.x * a, sign * b, -sign * n.x };
+	float3 bitangent{ b, sign + n.y * n.y * a, -n.y };
+
+	// Without a sampler or a blue-noise table the directions are plain random
+	float2 u = sampler ? sampler->Get2D(pixel, frame_index, 2 + 2 * bounce) : rng.NextFloat2();
+	float z = u.x;
+	float r = std::sqrt(std::max(0.f, 1.f - z * z));
+	float phi = 6.2831853f * u.y;
+	return tangent * (r * std::cos(phi)) + bitangent * (r * std::sin(phi)) + n * z;
+}
+
+Ray Denoising::GetPixelRay(unsigned short x, unsigned short y) const
+{
+	if (!sampler)
+	{
+		return camera.GetCameraRay(x, y);
+	}
+	float2 jitter = sampler->Get2D(y * width + x, frame_index, 0);
+	return camera.GetCameraRay(x, y, float3{ jitter.x, jitter.y, 0.f });
 }
 
 void Denoising::DrawScene(int max_frame_number)
 {
 	camera.SetRenderTargetSize(width, height);
+	if (tile_size != scheduler.GetTileSize())
+	{
+		ResetConvergence();
+	}
+	reprojection_report = ReprojectionReport();
+	if (history_limit > 0 && history_camera_valid && !(camera == history_camera))
+	{
+		ReprojectHistory();
+	}
+	sampling_report = AdaptiveSamplingReport();
+	sampling_report.tile_count = static_cast<unsigned int>(tile_converged.size());
+	sampling_report.fixed_samples = static_cast<unsigned long long>(max_frame_number) * width * height;
+	sampler = CreateSampler(sampler_type, max_frame_number, blue_noise, blue_noise_width, width);
+	// Samples carried over from earlier calls and reprojected history are not traced by this one
+	const unsigned long long previous_samples = std::accumulate(sample_count.begin(), sample_count.end(), 0ull);
 	for (int frame_number = 0; frame_number < max_frame_number; frame_number++)
 	{
 		std::cout << "Frame " << frame_number + 1 << std::endl;
-#pragma omp parallel for
-		for (short x = 0; x < width; x++)
+		frame_index = accumulated_frames + frame_number;
+		if (wavefront)
 		{
-#pragma omp parallel for
-			for (short y = 0; y < height; y++)
+			DrawFrameWavefront();
+		}
+		else
+		{
+			DrawFrameRecursive();
+		}
+		sampling_report.frames = frame_number + 1;
+		if (UpdateConvergence(frame_number) == 0)
+		{
+			break;
+		}
+	}
+
+	sampling_report.samples = std::accumulate(sample_count.begin(), sample_count.end(), 0ull) - previous_samples;
+	sampling_report.converged_tiles = static_cast<unsigned int>(std::count(tile_converged.begin(), tile_converged.end(), 1));
+	accumulated_frames += sampling_report.frames;
+	history_camera = camera;
+	history_camera_valid = true;
+	Resolve();
+}
+
+void Denoising::ReprojectHistory()
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	std::vector<float3> colors(width * height, float3{ 0, 0, 0 });
+	std::vector<float> squares(width * height, 0.f);
+	std::vector<unsigned int> counts(width * height, 0);
+	std::vector<unsigned char> outcome(width * height, 0);
+	const unsigned char reprojected = 1;
+	const unsigned char rejected = 2;
+
+	scheduler.Run(width, height, [&](const Tile& tile)
+	{
+		for (short y = tile.y0; y < tile.y1; y++)
+		{
+			for (short x = tile.x0; x < tile.x1; x++)
 			{
+				unsigned int pixel = y * width + x;
 				Ray ray = camera.GetCameraRay(x, y);
-				Payload payload = TraceRay(ray, raytracing_depth);
+				HitRecord closest(t_max);
+				if (!ClosestHit(ray, closest))
+				{
+					continue;
+				}
+				float3 X = ray.position + ray.direction * closest.t;
+				const MaterialTriangle surface = HitSurface(closest, X);
+				float3 N = normalize(surface.GetNormal(closest.baricentric));
+				float2 previous;
+				// A mirror shows another reflection from every view
+				if (surface.reflectiveness || !history_camera.Project(X, previous))
+				{
+					outcome[pixel] = rejected;
+					continue;
+				}
+				// G-buffer depth is the hit distance from the old camera
+				float expected_depth = length(X - history_camera.GetPosition());
+
+				// Bilinear taps around the point, pixel centers sit at +0.5
+				float fx = previous.x - 0.5f;
+				float fy = previous.y - 0.5f;
+				int x0 = static_cast<int>(std::floor(fx));
+				int y0 = static_cast<int>(std::floor(fy));
+				float ax = fx - x0;
+				float ay = fy - y0;
+				float weight = 0.f;
+				float3 color{ 0, 0, 0 };
+				float square = 0.f;
+				float count = 0.f;
+				for (int tap = 0; tap < 4; tap++)
+				{
+					int tx = x0 + (tap & 1);
+					int ty = y0 + (tap >> 1);
+					if (tx < 0 || ty < 0 || tx >= width || ty >= height)
+					{
+						continue;
+					}
+					unsigned int source = ty * width + tx;
+					const PixelFeatures& features = pixel_features[source];
+					if (features.primitive == PixelFeatures::miss ||
+						std::abs(features.depth - expected_depth) > reprojection_depth_tolerance * expected_depth ||
+						dot(normalize(features.normal), N) < reprojection_normal_cos)
+					{
+						continue;
+					}
+					float w = ((tap & 1) ? ax : 1.f - ax) * ((tap >> 1) ? ay : 1.f - ay);
+					weight += w;
+					color += w * history_buffer[source];
+					square += w * luminance_squares[source];
+					count += w * sample_count[source];
+				}
+				if (weight < 1e-3f || count / weight < 0.5f)
+				{
+					outcome[pixel] = rejected;
+					continue;
+				}
+
+				// Sums are rescaled to a whole number of samples, at most history_limit, keeping the mean
+				count /= weight;
+				float kept = std::min(std::round(count), static_cast<float>(history_limit));
+				colors[pixel] = color * (kept / (count * weight));
+				squares[pixel] = square * (kept / (count * weight));
+				counts[pixel] = static_cast<unsigned int>(kept);
+				outcome[pixel] = reprojected;
+			}
+		}
+	});
+
+	std::swap(history_buffer, colors);
+	std::swap(luminance_squares, squares);
+	std::swap(sample_count, counts);
+	// Every tile is looked at again from the new view
+	std::fill(tile_converged.begin(), tile_converged.end(), 0);
+
+	reprojection_report.pixels = width * height;
+	reprojection_report.reprojected = static_cast<unsigned int>(std::count(outcome.begin(), outcome.end(), reprojected));
+	reprojection_report.rejected = static_cast<unsigned int>(std::count(outcome.begin(), outcome.end(), rejected));
+	reprojection_report.ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+void Denoising::Resolve()
+{
+	// Retired tiles hold fewer samples than the rest
+	std::vector<float3>& color = resolved;
+	color.resize(width * height);
+	std::vector<float> variance(width * height);
+	scheduler.Run(width, height, [&](const Tile& tile)
+	{
+		for (short y = tile.y0; y < tile.y1; y++)
+		{
+			for (short x = tile.x0; x < tile.x1; x++)
+			{
+				unsigned int pixel = y * width + x;
+				float n = static_cast<float>(std::max(sample_count[pixel], 1u));
+				color[pixel] = GetHistory(x, y) / n;
+				float mean = Luminance(color[pixel]);
+				// A single sample says nothing about the spread, assume it is as large as the value
+				variance[pixel] = n < 2.f ? mean * mean :
+					std::max(luminance_squares[pixel] / n - mean * mean, 0.f) / (n - 1.f);
+			}
+		}
+	});
+
+	if (filter_iterations > 0)
+	{
+		filter.SetIterations(filter_iterations);
+		std::vector<float3> filtered;
+		filter.Apply(width, height, color, variance, pixel_features, filtered, scheduler);
+		std::swap(color, filtered);
+	}
+
+	scheduler.Run(width, height, [&](const Tile& tile)
+	{
+		for (short y = tile.y0; y < tile.y1; y++)
+		{
+			for (short x = tile.x0; x < tile.x1; x++)
+			{
+				SetPixel(x, y, color[y * width + x]);
+			}
+		}
+	});
+}
+
+void Denoising::DrawFrameRecursive()
+{
+	scheduler.Run(width, height, [&](const Tile& tile)
+	{
+		if (!IsPixelActive(tile.x0, tile.y0))
+		{
+			return;
+		}
+		for (short y = tile.y0; y < tile.y1; y++)
+		{
+			for (short x = tile.x0; x < tile.x1; x++)
+			{
+				traced_pixel = y * width + x;
+				pixel_features[traced_pixel] = PixelFeatures();
+				Payload payload = TracePrimaryRay(GetPixelRay(x, y), pixel_features[traced_pixel]);
 				SetPixel(x, y, payload.color);
-				SetHistory(x, y, GetHistory(x, y) + payload.color);
+				AddSample(x, y, payload.color);
 			}
 		}
+	});
+	render_tile_report = scheduler.GetReport();
+}
+
+void Denoising::DrawFrameWavefront()
+{
+	GeneratePaths();
+	for (unsigned int depth = 0; depth < raytracing_depth && paths.Size() > 0; depth++)
+	{
+		ExtendPaths();
+		if (depth == 0)
+		{
+			render_tile_report = scheduler.GetReport();
+		}
+		ShadePaths(depth);
+		SortPaths();
 	}
-#pragma omp parallel for
-	for (short x = 0; x < width; x++)
+
+	// Accumulate
+	scheduler.Run(width, height, [&](const Tile& tile)
 	{
-#pragma omp parallel for
-		for (short y = 0; y < height; y++)
+		for (short y = tile.y0; y < tile.y1; y++)
 		{
-			SetPixel(x, y, GetHistory(x, y) / max_frame_number);
+			for (short x = tile.x0; x < tile.x1; x++)
+			{
+				if (IsPixelActive(x, y))
+				{
+					unsigned int i = y * width + x;
+					SetPixel(x, y, radiance[i]);
+					AddSample(x, y, radiance[i]);
+				}
+			}
 		}
+	});
+}
+
+void Denoising::RunPaths(size_t count, const std::function<void(unsigned int, unsigned int)>& stage)
+{
+	if (count == 0)
+	{
+		return;
 	}
+	// Chunks are the columns of an image one pixel high, so the scheduler hands out
+	// and steals runs of neighbouring chunks the way it does with screen tiles
+	const size_t max_chunks = std::numeric_limits<short>::max();
+	unsigned int chunk = static_cast<unsigned int>(std::max<size_t>(path_chunk, (count + max_chunks - 1) / max_chunks));
+	short chunks = static_cast<short>((count + chunk - 1) / chunk);
+	scheduler.Run(chunks, 1, [&](const Tile& tile)
+	{
+		stage(tile.x0 * chunk, static_cast<unsigned int>(std::min<size_t>(static_cast<size_t>(tile.x1) * chunk, count)));
+	});
+}
+
+void Denoising::GeneratePaths()
+{
+	// Retired tiles get no paths
+	std::vector<unsigned int> pixels;
+	pixels.reserve(static_cast<size_t>(width) * height);
+	for (int i = 0; i < width * height; i++)
+	{
+		if (IsPixelActive(static_cast<unsigned short>(i % width), static_cast<unsigned short>(i / width)))
+		{
+			pixels.push_back(i);
+		}
+	}
+
+	paths.Resize(pixels.size());
+	RunPaths(pixels.size(), [&](unsigned int first, unsigned int last)
+	{
+		for (unsigned int i = first; i < last; i++)
+		{
+			unsigned int pixel = pixels[i];
+			Ray ray = GetPixelRay(static_cast<unsigned short>(pixel % width), static_cast<unsigned short>(pixel / width));
+			paths.origin[i] = ray.position;
+			paths.direction[i] = ray.direction;
+			paths.throughput[i] = float3{ 1, 1, 1 };
+			paths.pixel[i] = pixel;
+			radiance[pixel] = float3{ 0, 0, 0 };
+			pixel_features[pixel] = PixelFeatures();
+		}
+	});
+}
+
+void Denoising::ExtendPaths()
+{
+	RunPaths(paths.Size(), [&](unsigned int first, unsigned int last)
+	{
+		for (unsigned int i = first; i < last; i++)
+		{
+			HitRecord closest(t_max);
+			Ray ray(paths.origin[i], paths.direction[i]);
+			paths.alive[i] = ClosestHit(ray, closest) ? 1 : 0;
+			paths.hit[i] = closest;
+		}
+	});
+}
+
+void Denoising::ShadePaths(unsigned int bounce)
+{
+	// Same estimator as Hit, with the recursion unrolled into a throughput
+	RunPaths(paths.Size(), [&](unsigned int first, unsigned int last)
+	{
+		for (unsigned int i = first; i < last; i++)
+		{
+			if (!paths.alive[i])
+			{
+				continue;
+			}
+			float3 X = paths.origin[i] + paths.direction[i] * paths.hit[i].t;
+			const MaterialTriangle triangle = HitSurface(paths.hit[i], X);
+			float3 N = triangle.GetNormal(paths.hit[i].baricentric);
+			if (bounce == 0)
+			{
+				PixelFeatures& features = pixel_features[paths.pixel[i]];
+				features.primitive = paths.hit[i].primitive;
+				features.instance = paths.hit[i].instance;
+				features.normal = N;
+				features.albedo = triangle.diffuse_color;
+				features.emission = triangle.emissive_color;
+				features.depth = paths.hit[i].t;
+			}
+			if (triangle.emissive_color > float3{ 0,0,0 })
+			{
+				radiance[paths.pixel[i]] += paths.throughput[i] * triangle.emissive_color;
+				paths.alive[i] = 0;
+				continue;
+			}
+
+			paths.origin[i] = X;
+
+			if (triangle.reflectiveness)
+			{
+				paths.direction[i] = normalize(paths.direction[i] - 2.f * dot(N, paths.direction[i]) * N);
+				continue;
+			}
+
+			float3 direction = normalize(SampleDirection(N, paths.pixel[i], bounce));
+			paths.direction[i] = direction;
+			paths.throughput[i] *= triangle.diffuse_color * std::max(dot(N, direction), 0.f);
+		}
+	});
+}
+
+unsigned int Denoising::PathKey(const float3& origin, const float3& direction) const
+{
+	// 3 bits of direction octant above a 27-bit Morton code of the origin in the scene bounds
+	unsigned int octant = (direction.x < 0 ? 4 : 0) | (direction.y < 0 ? 2 : 0) | (direction.z < 0 ? 1 : 0);
+	float3 extent = max(tlas_nodes[0].aabb_max - tlas_nodes[0].aabb_min, float3{ 1e-6f, 1e-6f, 1e-6f });
+	return (octant << 27) | (MortonCode((origin - tlas_nodes[0].aabb_min) / extent) >> 3);
+}
+
+void Denoising::SortPaths()
+{
+	const unsigned int dead = 0xFFFFFFFFu;
+	const int size = static_cast<int>(paths.Size());
+	std::vector<unsigned int> keys(size);
+	std::vector<unsigned int> order(size);
+	RunPaths(size, [&](unsigned int first, unsigned int last)
+	{
+		for (unsigned int i = first; i < last; i++)
+		{
+			keys[i] = paths.alive[i] ? PathKey(paths.origin[i], paths.direction[i]) : dead;
+			order[i] = i;
+		}
+	});
+
+	RadixSort(keys, order);
+
+	// Finished paths carry the largest key and end up at the back
+	size_t alive = std::lower_bound(keys.begin(), keys.end(), dead) - keys.begin();
+	sorted_paths.Resize(alive);
+	RunPaths(alive, [&](unsigned int first, unsigned int last)
+	{
+		for (unsigned int i = first; i < last; i++)
+		{
+			unsigned int source = order[i];
+			sorted_paths.origin[i] = paths.origin[source];
+			sorted_paths.direction[i] = paths.direction[source];
+			sorted_paths.throughput[i] = paths.throughput[source];
+			sorted_paths.pixel[i] = paths.pixel[source];
+		}
+	});
+	std::swap(paths, sorted_paths);
 }
 
 void Denoising::LoadBlueNoise(std::string file_name)
 {
 	int width, height, channels;
 	unsigned char* img = stbi_load(file_name.c_str(), &width, &height, &channels, 0);
+	if (img == nullptr)
+	{
+		return;
+	}
+	blue_noise_width = width;
 	for (int i = 0; i < width * height; i++)
 	{
 		float3 pixel{
@@ -130,3 +613,30 @@ void Denoising::LoadBlueNoise(std::string file_name)
 		blue_noise.push_back(pixel);
 	}
 }
+
+void PathQueue::Resize(size_t size)
+{
+	origin.resize(size);
+	direction.resize(size);
+	throughput.resize(size);
+	pixel.resize(size);
+	hit.resize(size, HitRecord(0.f));
+	alive.resize(size);
+}
+
+std::ostream& operator<<(std::ostream& stream, const AdaptiveSamplingReport& report)
+{
+	double fraction = report.fixed_samples > 0 ? static_cast<double>(report.samples) / report.fixed_samples : 1.0;
+	stream << "Adaptive sampling: " << report.frames << " frames, " << report.samples << " samples, "
+		<< 100.0 * fraction << "% of " << report.fixed_samples << " for fixed frames" << std::endl;
+	stream << "Converged tiles: " << report.converged_tiles << " of " << report.tile_count
+		<< ", max noise " << report.max_noise << ", " << report.max_retired_noise << " in retired tiles" << std::endl;
+	return stream;
+}
+
+std::ostream& operator<<(std::ostream& stream, const ReprojectionReport& report)
+{
+	stream << "Reprojection: " << report.reprojected << " of " << report.pixels << " pixels kept their history, "
+		<< report.rejected << " rejected, " << report.ms << " ms" << std::endl;
+	return stream;
+}
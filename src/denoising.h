@@ -1,8 +1,56 @@
 #pragma once
 
-#include "aabb.h"
+#include "atrous_filter.h"
+#include "bvh.h"
+#include "sampler.h"
 
-class Denoising: public AABB
+// Paths in flight of the wavefront integrator, stored as structure of arrays
+class PathQueue
+{
+public:
+	void Resize(size_t size);
+	size_t Size() const { return pixel.size(); };
+
+	std::vector<float3> origin;
+	std::vector<float3> direction;
+	std::vector<float3> throughput;
+	std::vector<unsigned int> pixel;
+
+	// Filled by the extend stage
+	std::vector<HitRecord> hit;
+	std::vector<unsigned char> alive;
+};
+
+class AdaptiveSamplingReport
+{
+public:
+	unsigned int frames = 0;
+	unsigned long long samples = 0;
+	// Cost of tracing every frame at every pixel
+	unsigned long long fixed_samples = 0;
+	unsigned int tile_count = 0;
+	unsigned int converged_tiles = 0;
+	// Relative noise of the noisiest tile after the last frame, and of the noisiest retired one
+	float max_noise = 0.f;
+	float max_retired_noise = 0.f;
+};
+
+std::ostream& operator<<(std::ostream& stream, const AdaptiveSamplingReport& report);
+
+class ReprojectionReport
+{
+public:
+	unsigned int pixels = 0;
+	// Pixels that took over history from the previous view
+	unsigned int reprojected = 0;
+	// Surfaces hidden or off screen in the previous view, and mirrors, start over
+	unsigned int rejected = 0;
+	double ms = 0.0;
+};
+
+std::ostream& operator<<(std::ostream& stream, const ReprojectionReport& report);
+
+class Denoising: public BVH
 {
 public:
 	Denoising(short width, short height);
@@ -10,14 +58,99 @@ public:
 	virtual void Clear();
 	virtual void DrawScene(int max_frame_number);
 	void LoadBlueNoise(std::string file_name);
+	// Wavefront mode traces every bounce of all paths as one batch, otherwise each pixel recurses through TraceRay
+	void SetWavefront(bool enabled) { wavefront = enabled; };
+	// Retires a tile once the standard error of its pixels relative to its brightness
+	// drops below target, checked from min_frames on. DrawScene then stops when every
+	// tile is retired, max_frame_number becomes a limit. 0 samples every frame everywhere.
+	void SetNoiseTarget(float target, int min_frames = 4) { noise_target = target; min_adaptive_frames = min_frames; };
+	const AdaptiveSamplingReport& GetSamplingReport() const { return sampling_report; };
+	// Sequence behind the pixel jitter and the bounce directions, picked up by the next DrawScene
+	void SetSampler(SamplerType type) { sampler_type = type; };
+	// A-trous passes over the result of DrawScene, guided by the G-buffer of the primary hits. 0 turns the filter off.
+	void SetSpatialFilter(unsigned int iterations) { filter_iterations = iterations; };
+	const AtrousReport& GetFilterReport() const { return filter.GetReport(); };
+	// Color of every pixel as written to the frame buffer by the last DrawScene, before it is cut to 8 bits
+	const std::vector<float3>& GetResolvedImage() const { return resolved; };
+	// When the camera moved since the last DrawScene, the accumulated history follows the
+	// surfaces to their new pixels instead of smearing. A pixel carries at most max_history
+	// samples over, so that new samples weigh at least 1 / (max_history + 1) and the image
+	// keeps up with the motion. 0 turns reprojection off.
+	void SetTemporalReprojection(unsigned int max_history) { history_limit = max_history; };
+	const ReprojectionReport& GetReprojectionReport() const { return reprojection_report; };
+	// Tiles of the render pass of the last frame, the filter and bookkeeping passes are left out.
+	// In wavefront mode that is the extend stage of the primary rays, its tiles are runs of path chunks.
+	virtual TileReport GetTileReport() const { return render_tile_report; };
 
 protected:
 	Payload Hit(const Ray& ray, const IntersectableData& data, const MaterialTriangle* triangle, const unsigned int max_raytrace_depth) const;
 	void SetHistory(unsigned short x, unsigned short y, float3 color);
 	float3 GetHistory(unsigned short x, unsigned short y) const;
+	// Adds a sample to the history and to the running variance of the pixel
+	void AddSample(unsigned short x, unsigned short y, float3 color);
+	bool IsPixelActive(unsigned short x, unsigned short y) const;
+	float GetTileNoise(const Tile& tile) const;
+	// Marks every tile of the scheduler's current tile size as sampled
+	void ResetConvergence();
+	// Retires converged tiles, returns how many are still sampled
+	unsigned int UpdateConvergence(int frame_number);
 	Payload Miss(const Ray& ray) const;
 	std::vector<float3> history_buffer;
+	std::vector<float> luminance_squares;
+	std::vector<unsigned int> sample_count;
+	std::vector<unsigned char> tile_converged;
+	short tile_size = 0;
+	short tiles_x = 0;
 	std::vector<float3> blue_noise;
 
-	int GetRandom(const int thread_num) const;
-};
\ No newline at end of file
+	// Direction off a diffuse surface, uniform over the hemisphere around N
+	float3 SampleDirection(const float3& N, unsigned int pixel, unsigned int bounce) const;
+	Ray GetPixelRay(unsigned short x, unsigned short y) const;
+
+	void DrawFrameRecursive();
+	void DrawFrameWavefront();
+	// Wavefront stages
+	// Calls stage for consecutive ranges [first, last) of count paths on the scheduler's workers
+	void RunPaths(size_t count, const std::function<void(unsigned int, unsigned int)>& stage);
+	void GeneratePaths();
+	void ExtendPaths();
+	void ShadePaths(unsigned int bounce);
+	// Drops finished paths and orders the rest by direction octant and origin Morton code
+	void SortPaths();
+	unsigned int PathKey(const float3& origin, const float3& direction) const;
+	// Mean color and variance of the mean luminance of every pixel, run through the filter when it is on
+	void Resolve();
+	// Moves the history from the view of history_camera to the current one. Each pixel
+	// center is traced to its surface and projected into the old view, the four pixels
+	// around that point are blended if their G-buffer depth and normal match.
+	void ReprojectHistory();
+	// Relative distance and normal cosine below which a history pixel shows another surface
+	const float reprojection_depth_tolerance = 0.05f;
+	const float reprojection_normal_cos = 0.9f;
+	// Paths in the smallest range a worker takes at a time
+	static const unsigned int path_chunk = 256;
+
+	bool wavefront = true;
+	float noise_target = 0.f;
+	int min_adaptive_frames = 4;
+	AdaptiveSamplingReport sampling_report;
+	TileReport render_tile_report;
+	SamplerType sampler_type = SamplerType::None;
+	std::unique_ptr<Sampler> sampler;
+	unsigned int blue_noise_width = 0;
+	// Sample index of the frame being traced
+	unsigned int frame_index = 0;
+	unsigned int filter_iterations = 0;
+	AtrousFilter filter;
+	unsigned int history_limit = 0;
+	// View the history was accumulated in, valid after the first DrawScene since Clear
+	Camera history_camera;
+	bool history_camera_valid = false;
+	// Frames accumulated since Clear, so that consecutive DrawScene calls draw new samples
+	unsigned int accumulated_frames = 0;
+	ReprojectionReport reprojection_report;
+	PathQueue paths;
+	PathQueue sorted_paths;
+	std::vector<float3> radiance;
+	std::vector<float3> resolved;
+};
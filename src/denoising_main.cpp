@@ -4,15 +4,44 @@
 int main(int argc, char* argv[])
 {
 	Denoising* render = new Denoising(1920, 1080);
-	int result = render->LoadGeometry("models/CornellBox-Mirror.obj");
-	if (result)
+	const std::string model = "models/CornellBox-Mirror.obj";
+	const std::string cache = "models/CornellBox-Mirror.bvhcache";
+	if (!render->LoadSceneCache(cache, model))
 	{
-		return result;
+		int result = render->LoadGeometry(model);
+		if (result)
+		{
+			return result;
+		}
+		render->BuildBVH();
+		render->SaveSceneCache(cache, model);
 	}
 	render->SetCamera(float3{ -0.5f, 0.99f, 1.5f }, float3{ 0, 0.99f, -1 }, float3{ 0, 1, 0 });
 	render->LoadBlueNoise("textures/blue-noise.png");
+	render->SetSampler(SamplerType::Sobol);
 	render->Clear();
+	// Up to 24 frames, flat areas stop earlier, the a-trous filter takes out the rest of the noise
+	render->SetNoiseTarget(2.f);
+	render->SetSpatialFilter(5);
 	render->DrawScene(24);
-	result = render->Save("results/denoising.png");
-	return result;
+	std::cout << render->GetSamplingReport();
+	std::cout << render->GetFilterReport();
+	int result = render->Save("results/denoising.png");
+	if (result || argc < 2 || std::string(argv[1]) != "--reprojection")
+	{
+		return result;
+	}
+
+	// One sample per frame of a short camera move, the history follows the surfaces
+	render->SetNoiseTarget(0.f);
+	render->SetTemporalReprojection(32);
+	render->Clear();
+	for (int frame = 0; frame < 4; frame++)
+	{
+		render->SetCamera(float3{ -0.65f + 0.05f * frame, 0.99f, 1.5f }, float3{ 0, 0.99f, -1 }, float3{ 0, 1, 0 });
+		render->DrawScene(1);
+		std::cout << render->GetReprojectionReport();
+	}
+	std::cout << render->GetSamplingReport();
+	return render->Save("results/denoising-reprojection.png");
 }
\ No newline at end of file
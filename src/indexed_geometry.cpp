@@ -0,0 +1,257 @@
+#include "indexed_geometry.h"
+
+#include <cstring>
+#include <unordered_map>
+
+Material::Material(const MaterialTriangle& triangle) :
+	emissive_color(triangle.emissive_color),
+	ambient_color(triangle.ambient_color),
+	diffuse_color(triangle.diffuse_color),
+	specular_color(triangle.specular_color),
+	specular_exponent(triangle.specular_exponent),
+	ior(triangle.ior),
+	reflectiveness(triangle.reflectiveness),
+	reflectiveness_and_transparency(triangle.reflectiveness_and_transparency)
+{
+}
+
+bool Material::operator==(const Material& other) const
+{
+	return emissive_color == other.emissive_color && ambient_color == other.ambient_color
+		&& diffuse_color == other.diffuse_color && specular_color == other.specular_color
+		&& specular_exponent == other.specular_exponent && ior == other.ior
+		&& reflectiveness == other.reflectiveness
+		&& reflectiveness_and_transparency == other.reflectiveness_and_transparency;
+}
+
+// Vertices are merged when all their bits are equal
+class IndexedVertexHash
+{
+public:
+	size_t operator()(const IndexedVertex& vertex) const
+	{
+		unsigned int bits[6];
+		std::memcpy(bits, &vertex.position, sizeof(float3));
+		std::memcpy(bits + 3, &vertex.normal, sizeof(float3));
+		size_t hash = 14695981039346656037ull;
+		for (unsigned int word : bits)
+		{
+			hash = (hash ^ word) * 1099511628211ull;
+		}
+		return hash;
+	}
+};
+
+class IndexedVertexEqual
+{
+public:
+	bool operator()(const IndexedVertex& a, const IndexedVertex& b) const
+	{
+		return std::memcmp(&a.position, &b.position, sizeof(float3)) == 0
+			&& std::memcmp(&a.normal, &b.normal, sizeof(float3)) == 0;
+	}
+};
+
+void IndexedGeometry::Clear()
+{
+	vertices.clear();
+	triangles.clear();
+	materials.clear();
+	spheres.clear();
+}
+
+void IndexedGeometry::AddTriangles(std::vector<MaterialTriangle>::const_iterator first, std::vector<MaterialTriangle>::const_iterator last)
+{
+	std::unordered_map<IndexedVertex, unsigned int, IndexedVertexHash, IndexedVertexEqual> vertex_map;
+	vertex_map.reserve(3 * (last - first));
+	triangles.reserve(triangles.size() + (last - first));
+	unsigned int material = 0;
+	for (auto source = first; source != last; ++source)
+	{
+		IndexedTriangle triangle;
+		const Vertex* corners[3] = { &source->a, &source->b, &source->c };
+		for (int corner = 0; corner < 3; corner++)
+		{
+			IndexedVertex vertex{ corners[corner]->position, corners[corner]->normal };
+			auto inserted = vertex_map.insert({ vertex, static_cast<unsigned int>(vertices.size()) });
+			if (inserted.second)
+			{
+				vertices.push_back(vertex);
+			}
+			triangle.vertex[corner] = inserted.first->second;
+		}
+
+		// Neighbouring triangles mostly share their material, so the last one is tried first
+		Material source_material(*source);
+		if (materials.empty() || !(materials[material] == source_material))
+		{
+			material = AddMaterial(source_material);
+		}
+		triangle.material = material;
+		triangles.push_back(triangle);
+	}
+}
+
+void IndexedGeometry::SetPositions(unsigned int first_triangle, const std::vector<float3>& positions)
+{
+	for (size_t i = 0; first_triangle + i < triangles.size() && 3 * i + 2 < positions.size(); i++)
+	{
+		for (int corner = 0; corner < 3; corner++)
+		{
+			vertices[triangles[first_triangle + i].vertex[corner]].position = positions[3 * i + corner];
+		}
+	}
+}
+
+unsigned int IndexedGeometry::AddSphere(const float3& center, float radius, const Material& material)
+{
+	IndexedSphere sphere;
+	sphere.center = center;
+	sphere.radius = radius;
+	sphere.material = AddMaterial(material);
+	spheres.push_back(sphere);
+	return static_cast<unsigned int>(spheres.size() - 1);
+}
+
+unsigned int IndexedGeometry::AddMaterial(const Material& material)
+{
+	unsigned int index = 0;
+	while (index < materials.size() && !(materials[index] == material))
+	{
+		index++;
+	}
+	if (index == materials.size())
+	{
+		materials.push_back(material);
+	}
+	return index;
+}
+
+IntersectableData IndexedGeometry::Intersect(unsigned int triangle, const Ray& ray) const
+{
+	const float3& a = Position(triangle, 0);
+	float3 ba = Position(triangle, 1) - a;
+	float3 ca = Position(triangle, 2) - a;
+
+	float3 pvec = cross(ray.direction, ca);
+	float dt = dot(ba, pvec);
+
+	if (dt > -1e-8f && dt < 1e-8f)
+	{
+		return IntersectableData(-1.f);
+	}
+
+	float3 tvec = ray.position - a;
+	float u = dot(tvec, pvec) / dt;
+
+	if (u < 0 || u > 1)
+	{
+		return IntersectableData(-1.f);
+	}
+
+	float3 qvec = cross(tvec, ba);
+	float v = dot(ray.direction, qvec) / dt;
+
+	if (v < 0 || u + v > 1)
+	{
+		return IntersectableData(-1.f);
+	}
+
+	float t = dot(ca, qvec) / dt;
+
+	return IntersectableData(t, float3{ 1.f - u - v, u, v });
+}
+
+static void SetMaterial(MaterialTriangle& triangle, const Material& material)
+{
+	triangle.emissive_color = material.emissive_color;
+	triangle.ambient_color = material.ambient_color;
+	triangle.diffuse_color = material.diffuse_color;
+	triangle.specular_color = material.specular_color;
+	triangle.specular_exponent = material.specular_exponent;
+	triangle.ior = material.ior;
+	triangle.reflectiveness = material.reflectiveness;
+	triangle.reflectiveness_and_transparency = material.reflectiveness_and_transparency;
+}
+
+MaterialTriangle IndexedGeometry::GetTriangle(unsigned int triangle) const
+{
+	const IndexedTriangle& indices = triangles[triangle];
+	Vertex corners[3] = {
+		Vertex(vertices[indices.vertex[0]].position),
+		Vertex(vertices[indices.vertex[1]].position),
+		Vertex(vertices[indices.vertex[2]].position) };
+	for (int corner = 0; corner < 3; corner++)
+	{
+		// Normals were normalized when the triangle was loaded
+		corners[corner].normal = vertices[indices.vertex[corner]].normal;
+	}
+
+	MaterialTriangle result(corners[0], corners[1], corners[2]);
+	SetMaterial(result, materials[indices.material]);
+	return result;
+}
+
+IntersectableData IndexedGeometry::IntersectSphere(unsigned int sphere, const Ray& ray, float t_min) const
+{
+	// Half-b form of the quadratic, with the offset taken from the center to keep precision
+	const IndexedSphere& source = spheres[sphere];
+	float3 oc = ray.position - source.center;
+	float a = dot(ray.direction, ray.direction);
+	float half_b = dot(oc, ray.direction);
+	float c = dot(oc, oc) - source.radius * source.radius;
+	float disc = half_b * half_b - a * c;
+	if (disc < 0)
+	{
+		return IntersectableData(-1.f);
+	}
+
+	float root = sqrtf(disc);
+	float t = (-half_b - root) / a;
+	if (t <= t_min)
+	{
+		t = (-half_b + root) / a;
+	}
+	return IntersectableData(t);
+}
+
+MaterialTriangle IndexedGeometry::GetSphereSurface(unsigned int sphere, const float3& point) const
+{
+	// Without vertex normals GetNormal returns geo_normal whatever the barycentrics are
+	const IndexedSphere& source = spheres[sphere];
+	MaterialTriangle result;
+	result.a = result.b = result.c = Vertex(point);
+	result.geo_normal = normalize(point - source.center);
+	SetMaterial(result, materials[source.material]);
+	return result;
+}
+
+GeometryMemoryReport IndexedGeometry::MemoryReport() const
+{
+	GeometryMemoryReport report;
+	report.triangle_count = static_cast<unsigned int>(triangles.size());
+	report.vertex_count = static_cast<unsigned int>(vertices.size());
+	report.material_count = static_cast<unsigned int>(materials.size());
+	report.sphere_count = static_cast<unsigned int>(spheres.size());
+	report.material_triangle_bytes = triangles.size() * sizeof(MaterialTriangle);
+	report.vertex_bytes = vertices.size() * sizeof(IndexedVertex);
+	report.triangle_bytes = triangles.size() * sizeof(IndexedTriangle);
+	report.material_bytes = materials.size() * sizeof(Material);
+	report.sphere_bytes = spheres.size() * sizeof(IndexedSphere);
+	return report;
+}
+
+std::ostream& operator<<(std::ostream& stream, const GeometryMemoryReport& report)
+{
+	stream << "Geometry: " << report.triangle_count << " triangles, "
+		<< report.vertex_count << " vertices, "
+		<< report.material_count << " materials";
+	if (report.sphere_count > 0)
+	{
+		stream << ", " << report.sphere_count << " spheres";
+	}
+	stream << std::endl;
+	stream << "Memory: " << report.MaterialTriangleBytesPerTriangle() << " bytes per triangle as MaterialTriangle, "
+		<< report.IndexedBytesPerTriangle() << " indexed (" << report.IndexedBytes() / 1024.0 << " KB)";
+	return stream;
+}
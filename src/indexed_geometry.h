@@ -0,0 +1,114 @@
+#pragma once
+
+#include "lighting.h"
+
+#include <vector>
+
+// Shading attributes of a MaterialTriangle, stored once for all triangles that share them
+class Material
+{
+public:
+	Material() {};
+	Material(const MaterialTriangle& triangle);
+
+	bool operator==(const Material& other) const;
+
+	float3 emissive_color;
+	float3 ambient_color;
+	float3 diffuse_color;
+	float3 specular_color;
+	float specular_exponent = 0.f;
+	float ior = 1.f;
+	bool reflectiveness = false;
+	bool reflectiveness_and_transparency = false;
+};
+
+class IndexedVertex
+{
+public:
+	float3 position;
+	// Zero when the OBJ has none, shading then falls back to the geometric normal
+	float3 normal;
+};
+
+class IndexedTriangle
+{
+public:
+	unsigned int vertex[3] = { 0, 0, 0 };
+	unsigned int material = 0;
+};
+
+static_assert(sizeof(IndexedTriangle) == 16, "Four indexed triangles should fit in a cache line");
+
+// Analytic sphere sharing the material table with the triangles
+class IndexedSphere
+{
+public:
+	float3 center;
+	float radius = 0.f;
+	unsigned int material = 0;
+};
+
+// Kind of primitive a BLAS is built over. Every type is kept in its own array
+// and traversal picks the leaf test for a whole BLAS, never per primitive.
+enum class PrimitiveType : unsigned int
+{
+	Triangle,
+	Sphere
+};
+
+class GeometryMemoryReport
+{
+public:
+	unsigned int triangle_count = 0;
+	unsigned int vertex_count = 0;
+	unsigned int material_count = 0;
+	unsigned int sphere_count = 0;
+	// The same triangles stored as MaterialTriangle copies
+	size_t material_triangle_bytes = 0;
+	size_t vertex_bytes = 0;
+	size_t triangle_bytes = 0;
+	size_t material_bytes = 0;
+	size_t sphere_bytes = 0;
+
+	size_t IndexedBytes() const { return vertex_bytes + triangle_bytes + material_bytes + sphere_bytes; };
+	float MaterialTriangleBytesPerTriangle() const { return triangle_count > 0 ? material_triangle_bytes / static_cast<float>(triangle_count) : 0.f; };
+	float IndexedBytesPerTriangle() const { return triangle_count > 0 ? IndexedBytes() / static_cast<float>(triangle_count) : 0.f; };
+};
+
+std::ostream& operator<<(std::ostream& stream, const GeometryMemoryReport& report);
+
+// Triangles as three indices into a shared vertex buffer and an index into a
+// material table. Full MaterialTriangles are only put together for shading.
+class IndexedGeometry
+{
+public:
+	void Clear();
+	// Appends the triangles. Corners with the same position and normal share a vertex
+	// within the range, equal materials are shared with everything added before.
+	void AddTriangles(std::vector<MaterialTriangle>::const_iterator first, std::vector<MaterialTriangle>::const_iterator last);
+	// Moves the vertices of the triangles from first_triangle on, three positions per
+	// triangle. A vertex shared by several corners gets the position of the last one.
+	void SetPositions(unsigned int first_triangle, const std::vector<float3>& positions);
+	unsigned int AddSphere(const float3& center, float radius, const Material& material);
+	// Index of an equal material in the table, appended when there is none
+	unsigned int AddMaterial(const Material& material);
+
+	unsigned int TriangleCount() const { return static_cast<unsigned int>(triangles.size()); };
+	const float3& Position(unsigned int triangle, int corner) const { return vertices[triangles[triangle].vertex[corner]].position; };
+	// Same Moller-Trumbore test as Triangle::Intersect, with the edges computed on the fly
+	IntersectableData Intersect(unsigned int triangle, const Ray& ray) const;
+	MaterialTriangle GetTriangle(unsigned int triangle) const;
+
+	unsigned int SphereCount() const { return static_cast<unsigned int>(spheres.size()); };
+	// Nearest of the two roots beyond t_min; the direction does not need to be normalized
+	IntersectableData IntersectSphere(unsigned int sphere, const Ray& ray, float t_min) const;
+	// Shading data at a point on the sphere: a MaterialTriangle whose normal is the sphere's there
+	MaterialTriangle GetSphereSurface(unsigned int sphere, const float3& point) const;
+	GeometryMemoryReport MemoryReport() const;
+
+	std::vector<IndexedVertex> vertices;
+	std::vector<IndexedTriangle> triangles;
+	std::vector<Material> materials;
+	std::vector<IndexedSphere> spheres;
+};
@@ -1,7 +1,5 @@
 #include "lighting.h"
-
-#define TINYOBJLOADER_IMPLEMENTATION
-#include "tiny_obj_loader.h"
+#include "obj_loader.h"
 
 #include <algorithm>
 
@@ -15,20 +13,11 @@ Lighting::~Lighting()
 
 int Lighting::LoadGeometry(std::string filename)
 {
-	std::string inputfile = filename;
-	tinyobj::attrib_t attrib;
-	std::vector<tinyobj::shape_t> shapes;
-	std::vector<tinyobj::material_t> materials;
-
+	ObjModel model;
 	std::string warn;
 	std::string err;
 
-	size_t delimeter = filename.find_last_of("/\\");
-
-	//how to search for materials
-	std::string directory = filename.substr(0, delimeter);
-
-	bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, inputfile.c_str(), directory.c_str());
+	bool ret = LoadObj(filename, model, warn, err);
 
 	if (!warn.empty()) {
 		std::cout << warn << std::endl;
@@ -42,49 +31,13 @@ int Lighting::LoadGeometry(std::string filename)
 		exit(1);
 	}
 
-	// Loop over shapes
-	for (size_t s = 0; s < shapes.size(); s++) {
-		// Loop over faces(polygon)
-		size_t index_offset = 0;
-		for (size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++) {
-			int fv = shapes[s].mesh.num_face_vertices[f];
-
-			std::vector<Vertex> vertices;
-
-			// Loop over vertices in the face.
-			for (size_t v = 0; v < fv; v++) {
-				// access to vertex
-				tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
-				tinyobj::real_t vx = attrib.vertices[3 * idx.vertex_index + 0];
-				tinyobj::real_t vy = attrib.vertices[3 * idx.vertex_index + 1];
-				tinyobj::real_t vz = attrib.vertices[3 * idx.vertex_index + 2];
-				auto vert = float3{ vx, vy, vz };
-				if (idx.normal_index > 0) {
-					tinyobj::real_t nx = attrib.normals[3 * idx.normal_index + 0];
-					tinyobj::real_t ny = attrib.normals[3 * idx.normal_index + 1];
-					tinyobj::real_t nz = attrib.normals[3 * idx.normal_index + 2];
-					vertices.push_back(Vertex(vert, float3{ nx, ny, nz }));
-				}
-				else {
-					vertices.push_back(Vertex(vert));
-				}
-			}
-			index_offset += fv;
-
-			auto triangle = new MaterialTriangle(vertices[0], vertices[1], vertices[2]);
-
-			auto material = materials[shapes[s].mesh.material_ids[f]];
-
-			triangle->SetEmisive(float3{ material.emission });
-			triangle->SetAmbient(float3{ material.ambient });
-			triangle->SetDiffuse(float3{ material.diffuse });
-			triangle->SetSpecular(float3{ material.specular }, material.shininess);
-			triangle->SetReflectiveness(material.illum == 5);
-			triangle->SetReflectivenessAndTransparency(material.illum == 7);
-			triangle->SetIor(material.ior);
-
-			material_objects.push_back(triangle);
-		}
+	if (material_objects.empty())
+	{
+		material_objects.swap(model.triangles);
+	}
+	else
+	{
+		material_objects.insert(material_objects.end(), model.triangles.begin(), model.triangles.end());
 	}
 
 	return 0;
@@ -98,15 +51,15 @@ void Lighting::AddLight(Light* light)
 Payload Lighting::TraceRay(const Ray& ray, const unsigned int max_raytrace_depth) const
 {
 	IntersectableData closestData(t_max);
-	MaterialTriangle* closestTriangle = nullptr;
+	const MaterialTriangle* closestTriangle = nullptr;
 
 	for (auto& object : material_objects)
 	{
-		auto data = object->Intersect(ray);
+		auto data = object.Intersect(ray);
 		if (data.t > t_min && data.t < closestData.t)
 		{
 			closestData = data;
-			closestTriangle = object;
+			closestTriangle = &object;
 		}
 	}
 
@@ -7,7 +7,7 @@ class MaterialTriangle : public Triangle
 public:
 	MaterialTriangle(Vertex a, Vertex b, Vertex c) : Triangle(a, b, c) { geo_normal = normalize(cross(ba, ca)); };
 	MaterialTriangle() { };
-	virtual ~MaterialTriangle() {};
+	~MaterialTriangle() {};
 
 	void SetEmisive(float3 emissive) { emissive_color = emissive; };
 	void SetAmbient(float3 ambient) { ambient_color = ambient; };
@@ -55,6 +55,6 @@ protected:
 	virtual Payload TraceRay(const Ray& ray, const unsigned int max_raytrace_depth) const;
 	virtual Payload Hit(const Ray& ray, const IntersectableData& data, const MaterialTriangle* traingle) const;
 
-	std::vector<MaterialTriangle*> material_objects;
+	std::vector<MaterialTriangle> material_objects;
 	std::vector<Light*> lights;
 };
\ No newline at end of file
@@ -0,0 +1,80 @@
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(const std::string& filename)
+{
+#ifdef _WIN32
+	HANDLE file_handle = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file_handle == INVALID_HANDLE_VALUE)
+	{
+		return;
+	}
+	file = file_handle;
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file_handle, &file_size) || file_size.QuadPart == 0)
+	{
+		return;
+	}
+	mapping = CreateFileMappingA(file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping == nullptr)
+	{
+		return;
+	}
+	data = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+	if (data != nullptr)
+	{
+		size = static_cast<size_t>(file_size.QuadPart);
+	}
+#else
+	int descriptor = open(filename.c_str(), O_RDONLY);
+	if (descriptor < 0)
+	{
+		return;
+	}
+	struct stat file_stat;
+	if (fstat(descriptor, &file_stat) == 0 && file_stat.st_size > 0)
+	{
+		void* view = mmap(nullptr, static_cast<size_t>(file_stat.st_size), PROT_READ, MAP_PRIVATE, descriptor, 0);
+		if (view != MAP_FAILED)
+		{
+			data = static_cast<const char*>(view);
+			size = static_cast<size_t>(file_stat.st_size);
+		}
+	}
+	// The mapping stays valid after the descriptor is closed
+	close(descriptor);
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+#ifdef _WIN32
+	if (data != nullptr)
+	{
+		UnmapViewOfFile(data);
+	}
+	if (mapping != nullptr)
+	{
+		CloseHandle(mapping);
+	}
+	if (file != nullptr)
+	{
+		CloseHandle(file);
+	}
+#else
+	if (data != nullptr)
+	{
+		munmap(const_cast<char*>(data), size);
+	}
+#endif
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <string>
+
+// Read-only view of a whole file mapped into memory. Pages are loaded on first
+// access and shared with every other process that maps the same file.
+class MappedFile
+{
+public:
+	MappedFile(const std::string& filename);
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool IsOpen() const { return data != nullptr; };
+	const char* Data() const { return data; };
+	size_t Size() const { return size; };
+
+protected:
+	const char* data = nullptr;
+	size_t size = 0;
+#ifdef _WIN32
+	void* file = nullptr;
+	void* mapping = nullptr;
+#endif
+};
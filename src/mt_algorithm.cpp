@@ -47,12 +47,12 @@ MTAlgorithm::~MTAlgorithm()
 
 int MTAlgorithm::LoadGeometry(std::string filename)
 {
-	objects.push_back(new Sphere(float3{ 2, 0, -1 }, 0.4f));
+	spheres.push_back(Sphere(float3{ 2, 0, -1 }, 0.4f));
 
 	Vertex a(float3{ -0.5f, -0.5f, -1.0f });
 	Vertex b(float3{ 0.5f, -0.5f, -1.0f });
 	Vertex c(float3{ 0.0f, 0.5f, -1.0f });
-	objects.push_back(new Triangle(a, b, c));
+	triangles.push_back(Triangle(a, b, c));
 
 	return 0;
 }
@@ -60,13 +60,20 @@ int MTAlgorithm::LoadGeometry(std::string filename)
 Payload MTAlgorithm::TraceRay(const Ray& ray, const unsigned int max_raytrace_depth) const
 {
 	IntersectableData closestData(t_max);
-	for (auto& object : objects)
+	auto record = [&](const IntersectableData& data)
 	{
-		IntersectableData data = object->Intersect(ray);
 		if (data.t > t_min && data.t < closestData.t)
 		{
 			closestData = data;
 		}
+	};
+	for (auto& sphere : spheres)
+	{
+		record(sphere.Intersect(ray));
+	}
+	for (auto& triangle : triangles)
+	{
+		record(triangle.Intersect(ray));
 	}
 
 	if (closestData.t < t_max)
@@ -14,13 +14,18 @@ public:
 	float3 baricentric;
 };
 
-class Intersectable
+// Closest hit of a scene traversal. The primitive and the instance it belongs to are
+// referenced by index, shading fetches their normal and material for the final hit only.
+class HitRecord : public IntersectableData
 {
 public:
-	virtual IntersectableData Intersect(const Ray& ray) const = 0;
+	HitRecord(float t) : IntersectableData(t) {};
+	HitRecord(const IntersectableData& data, unsigned int primitive, unsigned int instance) : IntersectableData(data), primitive(primitive), instance(instance) {};
+	unsigned int primitive = 0;
+	unsigned int instance = 0;
 };
 
-class Sphere : public Intersectable
+class Sphere
 {
 public:
 	Sphere(float3 center, float radius);
@@ -50,7 +55,7 @@ public:
 
 };
 
-class Triangle : public Intersectable
+class Triangle
 {
 public:
 	Triangle(Vertex a, Vertex b, Vertex c);
@@ -80,7 +85,9 @@ protected:
 	virtual Payload TraceRay(const Ray& ray, const unsigned int max_raytrace_depth) const;
 	virtual Payload Hit(const Ray& ray, const IntersectableData& t) const;
 
-	std::vector<Intersectable*> objects;
+	// One array per primitive type, so the hot loops call Intersect without virtual dispatch
+	std::vector<Sphere> spheres;
+	std::vector<Triangle> triangles;
 
 	const float t_min = 0.01f;
 	const float t_max = 1000.f;
@@ -0,0 +1,479 @@
+#include "obj_loader.h"
+#include "mapped_file.h"
+
+#define TINYOBJLOADER_IMPLEMENTATION
+#include "tiny_obj_loader.h"
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <omp.h>
+
+// Files are split into chunks of at least this size, smaller ones are parsed on one thread
+const size_t obj_min_chunk_size = 256 * 1024;
+
+// Index of a face corner into the positions or normals. Negative OBJ indices count
+// back from the last vertex read, which a chunk only knows relative to its own start.
+class ObjIndex
+{
+public:
+	int index = -1;
+	bool relative = false;
+};
+
+class ObjCorner
+{
+public:
+	ObjIndex position;
+	ObjIndex normal;
+};
+
+// Lines of the file parsed by one thread
+class ObjChunk
+{
+public:
+	void Parse();
+
+	const char* begin = nullptr;
+	const char* end = nullptr;
+	std::vector<float3> positions;
+	std::vector<float3> normals;
+	// Three per triangle
+	std::vector<ObjCorner> corners;
+	// Triangles of the chunk before each usemtl line and each g or o line
+	std::vector<std::pair<unsigned int, std::string>> material_names;
+	std::vector<unsigned int> groups;
+	std::vector<std::vector<std::string>> material_libraries;
+	unsigned int skipped_faces = 0;
+
+	// Set once all chunks are parsed
+	unsigned int first_position = 0;
+	unsigned int first_normal = 0;
+	unsigned int first_triangle = 0;
+	int initial_material = -1;
+	std::vector<std::pair<unsigned int, int>> materials;
+	bool invalid_index = false;
+};
+
+static bool IsSpace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static const char* SkipSpaces(const char* p, const char* end)
+{
+	while (p < end && IsSpace(*p))
+	{
+		p++;
+	}
+	return p;
+}
+
+static const char* SkipToken(const char* p, const char* end)
+{
+	while (p < end && !IsSpace(*p))
+	{
+		p++;
+	}
+	return p;
+}
+
+static bool IsKeyword(const char* p, const char* keyword_end, const char* keyword)
+{
+	size_t length = std::strlen(keyword);
+	return static_cast<size_t>(keyword_end - p) == length && std::memcmp(p, keyword, length) == 0;
+}
+
+// Missing or malformed values read as 0, like tinyobj does
+static float ParseFloat(const char*& p, const char* end)
+{
+	p = SkipSpaces(p, end);
+	if (p < end && *p == '+')
+	{
+		p++;
+	}
+	float value = 0.f;
+	auto result = std::from_chars(p, end, value);
+	p = result.ptr == p ? SkipToken(p, end) : result.ptr;
+	return value;
+}
+
+static bool ParseInt(const char*& p, const char* end, int& value)
+{
+	if (p < end && *p == '+')
+	{
+		p++;
+	}
+	auto result = std::from_chars(p, end, value);
+	if (result.ec != std::errc())
+	{
+		return false;
+	}
+	p = result.ptr;
+	return true;
+}
+
+static ObjIndex MakeIndex(int value, size_t count)
+{
+	ObjIndex index;
+	index.relative = value < 0;
+	index.index = value < 0 ? static_cast<int>(count) + value : value - 1;
+	return index;
+}
+
+// v, v/vt, v//vn or v/vt/vn; texture coordinates are not used by the renderers
+static bool ParseCorner(const char*& p, const char* end, size_t position_count, size_t normal_count, ObjCorner& corner)
+{
+	int value = 0;
+	if (!ParseInt(p, end, value) || value == 0)
+	{
+		return false;
+	}
+	corner.position = MakeIndex(value, position_count);
+	corner.normal = ObjIndex();
+	if (p < end && *p == '/')
+	{
+		p++;
+		int texcoord = 0;
+		ParseInt(p, end, texcoord);
+		if (p < end && *p == '/')
+		{
+			p++;
+			if (ParseInt(p, end, value) && value != 0)
+			{
+				corner.normal = MakeIndex(value, normal_count);
+			}
+		}
+	}
+	return p == end || IsSpace(*p);
+}
+
+// File names after the keyword of an mtllib line
+static std::vector<std::string> ParseNames(const char* p, const char* line_end)
+{
+	std::vector<std::string> names;
+	for (p = SkipSpaces(p, line_end); p < line_end; p = SkipSpaces(p, line_end))
+	{
+		const char* name_end = SkipToken(p, line_end);
+		names.push_back(std::string(p, name_end));
+		p = name_end;
+	}
+	return names;
+}
+
+void ObjChunk::Parse()
+{
+	std::vector<ObjCorner> face;
+	for (const char* line = begin; line < end;)
+	{
+		const char* line_end = static_cast<const char*>(std::memchr(line, '\n', end - line));
+		if (line_end == nullptr)
+		{
+			line_end = end;
+		}
+		const char* p = SkipSpaces(line, line_end);
+		const char* keyword_end = SkipToken(p, line_end);
+
+		if (IsKeyword(p, keyword_end, "v") || IsKeyword(p, keyword_end, "vn"))
+		{
+			std::vector<float3>& target = keyword_end - p == 1 ? positions : normals;
+			float3 value;
+			value.x = ParseFloat(keyword_end, line_end);
+			value.y = ParseFloat(keyword_end, line_end);
+			value.z = ParseFloat(keyword_end, line_end);
+			target.push_back(value);
+		}
+		else if (IsKeyword(p, keyword_end, "f"))
+		{
+			face.clear();
+			bool valid = true;
+			for (p = SkipSpaces(keyword_end, line_end); p < line_end && valid; p = SkipSpaces(p, line_end))
+			{
+				ObjCorner corner;
+				valid = ParseCorner(p, line_end, positions.size(), normals.size(), corner);
+				face.push_back(corner);
+			}
+			if (!valid || face.size() < 3)
+			{
+				skipped_faces++;
+			}
+			else
+			{
+				for (size_t i = 2; i < face.size(); i++)
+				{
+					corners.push_back(face[0]);
+					corners.push_back(face[i - 1]);
+					corners.push_back(face[i]);
+				}
+			}
+		}
+		else if (IsKeyword(p, keyword_end, "usemtl"))
+		{
+			const char* name = SkipSpaces(keyword_end, line_end);
+			material_names.push_back({ static_cast<unsigned int>(corners.size() / 3), std::string(name, SkipToken(name, line_end)) });
+		}
+		else if (IsKeyword(p, keyword_end, "g") || IsKeyword(p, keyword_end, "o"))
+		{
+			groups.push_back(static_cast<unsigned int>(corners.size() / 3));
+		}
+		else if (IsKeyword(p, keyword_end, "mtllib"))
+		{
+			material_libraries.push_back(ParseNames(keyword_end, line_end));
+		}
+		line = line_end + 1;
+	}
+}
+
+// Like tinyobj, the first file of an mtllib line that can be opened is used
+static std::string FindMaterialLibrary(const std::string& directory, const std::vector<std::string>& names)
+{
+	for (auto& name : names)
+	{
+		if (std::ifstream(directory + name))
+		{
+			return directory + name;
+		}
+	}
+	return std::string();
+}
+
+static void LoadMaterialLibrary(const std::string& directory, const std::vector<std::string>& names, std::map<std::string, int>& material_map, std::vector<tinyobj::material_t>& materials, std::string& warning)
+{
+	std::string path = FindMaterialLibrary(directory, names);
+	std::ifstream stream(path);
+	if (path.empty() || !stream)
+	{
+		warning += "Material library not found: " + (names.empty() ? std::string() : names[0]) + "\n";
+		return;
+	}
+	std::string mtl_warning;
+	std::string mtl_error;
+	tinyobj::LoadMtl(&material_map, &materials, &stream, &mtl_warning, &mtl_error);
+	warning += mtl_warning + mtl_error;
+}
+
+static std::string ObjDirectory(const std::string& filename)
+{
+	size_t delimiter = filename.find_last_of("/\\");
+	return delimiter == std::string::npos ? std::string() : filename.substr(0, delimiter + 1);
+}
+
+std::vector<std::string> ObjMaterialLibraries(const std::string& filename)
+{
+	std::vector<std::string> libraries;
+	MappedFile file(filename);
+	if (!file.IsOpen())
+	{
+		return libraries;
+	}
+	const std::string directory = ObjDirectory(filename);
+	const char* end = file.Data() + file.Size();
+	for (const char* line = file.Data(); line < end;)
+	{
+		const char* line_end = static_cast<const char*>(std::memchr(line, '\n', end - line));
+		if (line_end == nullptr)
+		{
+			line_end = end;
+		}
+		const char* p = SkipSpaces(line, line_end);
+		const char* keyword_end = SkipToken(p, line_end);
+		if (IsKeyword(p, keyword_end, "mtllib"))
+		{
+			std::string path = FindMaterialLibrary(directory, ParseNames(keyword_end, line_end));
+			if (!path.empty())
+			{
+				libraries.push_back(path);
+			}
+		}
+		line = line_end + 1;
+	}
+	return libraries;
+}
+
+static int ResolveIndex(const ObjIndex& index, unsigned int first)
+{
+	return index.relative ? static_cast<int>(first) + index.index : index.index;
+}
+
+static void BuildTriangles(ObjChunk& chunk, const std::vector<float3>& positions, const std::vector<float3>& normals, const std::vector<tinyobj::material_t>& materials, std::vector<MaterialTriangle>& triangles)
+{
+	const tinyobj::material_t default_material;
+	auto make_vertex = [&](const ObjCorner& corner) {
+		int position = ResolveIndex(corner.position, chunk.first_position);
+		int normal = ResolveIndex(corner.normal, chunk.first_normal);
+		if (position < 0 || position >= static_cast<int>(positions.size()))
+		{
+			chunk.invalid_index = true;
+			return Vertex(float3{ 0.f, 0.f, 0.f });
+		}
+		// The first normal of the file counts as missing, as it always did in the
+		// per-stage loaders; the reference images were rendered that way
+		if (normal > 0 && normal < static_cast<int>(normals.size()))
+		{
+			return Vertex(positions[position], normals[normal]);
+		}
+		return Vertex(positions[position]);
+	};
+
+	int material = chunk.initial_material;
+	size_t next_material = 0;
+	const unsigned int triangle_count = static_cast<unsigned int>(chunk.corners.size() / 3);
+	for (unsigned int t = 0; t < triangle_count; t++)
+	{
+		while (next_material < chunk.materials.size() && chunk.materials[next_material].first <= t)
+		{
+			material = chunk.materials[next_material++].second;
+		}
+		MaterialTriangle triangle(make_vertex(chunk.corners[3 * t]), make_vertex(chunk.corners[3 * t + 1]), make_vertex(chunk.corners[3 * t + 2]));
+
+		const tinyobj::material_t& face_material = material >= 0 ? materials[material] : default_material;
+		triangle.SetEmisive(float3{ face_material.emission });
+		triangle.SetAmbient(float3{ face_material.ambient });
+		triangle.SetDiffuse(float3{ face_material.diffuse });
+		triangle.SetSpecular(float3{ face_material.specular }, face_material.shininess);
+		triangle.SetReflectiveness(face_material.illum == 5);
+		triangle.SetReflectivenessAndTransparency(face_material.illum == 7);
+		triangle.SetIor(face_material.ior);
+
+		triangles[chunk.first_triangle + t] = triangle;
+	}
+}
+
+bool LoadObj(const std::string& filename, ObjModel& model, std::string& warning, std::string& error)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	model = ObjModel();
+
+	MappedFile file(filename);
+	if (!file.IsOpen())
+	{
+		error = "Cannot open " + filename;
+		return false;
+	}
+
+	// Chunks end after a line break, so no line is split between two of them
+	const char* data = file.Data();
+	const char* data_end = data + file.Size();
+	size_t chunk_count = std::min<size_t>(std::max<size_t>(file.Size() / obj_min_chunk_size, 1), 4 * omp_get_max_threads());
+	std::vector<ObjChunk> chunks(chunk_count);
+	const char* chunk_begin = data;
+	for (size_t c = 0; c < chunk_count; c++)
+	{
+		const char* chunk_end = data_end;
+		if (c + 1 < chunk_count)
+		{
+			chunk_end = std::max(data + file.Size() * (c + 1) / chunk_count, chunk_begin);
+			const char* line_end = static_cast<const char*>(std::memchr(chunk_end, '\n', data_end - chunk_end));
+			chunk_end = line_end != nullptr ? line_end + 1 : data_end;
+		}
+		chunks[c].begin = chunk_begin;
+		chunks[c].end = chunk_end;
+		chunk_begin = chunk_end;
+	}
+
+#pragma omp parallel for schedule(dynamic)
+	for (int c = 0; c < static_cast<int>(chunks.size()); c++)
+	{
+		chunks[c].Parse();
+	}
+
+	// Vertex offsets, materials and mesh boundaries depend on everything before a chunk
+	const std::string directory = ObjDirectory(filename);
+	std::map<std::string, int> material_map;
+	std::vector<tinyobj::material_t> materials;
+	std::vector<unsigned int> mesh_boundaries;
+	unsigned int position_count = 0;
+	unsigned int normal_count = 0;
+	unsigned int triangle_count = 0;
+	unsigned int skipped_faces = 0;
+	int material = -1;
+	for (ObjChunk& chunk : chunks)
+	{
+		for (auto& names : chunk.material_libraries)
+		{
+			LoadMaterialLibrary(directory, names, material_map, materials, warning);
+		}
+		chunk.first_position = position_count;
+		chunk.first_normal = normal_count;
+		chunk.first_triangle = triangle_count;
+		chunk.initial_material = material;
+		for (auto& material_name : chunk.material_names)
+		{
+			auto found = material_map.find(material_name.second);
+			if (found == material_map.end())
+			{
+				warning += "Material not found: " + material_name.second + "\n";
+			}
+			material = found != material_map.end() ? found->second : -1;
+			chunk.materials.push_back({ material_name.first, material });
+		}
+		for (unsigned int group : chunk.groups)
+		{
+			mesh_boundaries.push_back(triangle_count + group);
+		}
+		position_count += static_cast<unsigned int>(chunk.positions.size());
+		normal_count += static_cast<unsigned int>(chunk.normals.size());
+		triangle_count += static_cast<unsigned int>(chunk.corners.size() / 3);
+		skipped_faces += chunk.skipped_faces;
+	}
+	if (skipped_faces > 0)
+	{
+		warning += "Skipped " + std::to_string(skipped_faces) + " malformed faces\n";
+	}
+
+	// Groups without faces make no mesh
+	model.mesh_offsets.push_back(0);
+	mesh_boundaries.push_back(triangle_count);
+	for (unsigned int boundary : mesh_boundaries)
+	{
+		if (boundary > model.mesh_offsets.back())
+		{
+			model.mesh_offsets.push_back(boundary);
+		}
+	}
+
+	std::vector<float3> positions(position_count);
+	std::vector<float3> normals(normal_count);
+	model.triangles.resize(triangle_count);
+#pragma omp parallel for schedule(dynamic)
+	for (int c = 0; c < static_cast<int>(chunks.size()); c++)
+	{
+		std::copy(chunks[c].positions.begin(), chunks[c].positions.end(), positions.begin() + chunks[c].first_position);
+		std::copy(chunks[c].normals.begin(), chunks[c].normals.end(), normals.begin() + chunks[c].first_normal);
+	}
+#pragma omp parallel for schedule(dynamic)
+	for (int c = 0; c < static_cast<int>(chunks.size()); c++)
+	{
+		BuildTriangles(chunks[c], positions, normals, materials, model.triangles);
+	}
+	for (const ObjChunk& chunk : chunks)
+	{
+		if (chunk.invalid_index)
+		{
+			error = "Vertex index out of range in " + filename;
+			model = ObjModel();
+			return false;
+		}
+	}
+
+	model.report.file_size = file.Size();
+	model.report.triangle_count = triangle_count;
+	model.report.mesh_count = model.MeshCount();
+	model.report.material_count = static_cast<unsigned int>(materials.size());
+	model.report.chunk_count = static_cast<unsigned int>(chunks.size());
+	model.report.load_time_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	return true;
+}
+
+std::ostream& operator<<(std::ostream& stream, const ObjLoadReport& report)
+{
+	stream << "OBJ: " << report.triangle_count << " triangles, "
+		<< report.mesh_count << " meshes, "
+		<< report.material_count << " materials" << std::endl;
+	stream << "Parsed " << report.file_size / 1e6 << " MB in " << report.chunk_count << " chunks, load time: "
+		<< report.load_time_ms << " ms, " << report.MegabytesPerSecond() << " MB/s";
+	return stream;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "lighting.h"
+
+#include <string>
+#include <vector>
+
+class ObjLoadReport
+{
+public:
+	size_t file_size = 0;
+	unsigned int triangle_count = 0;
+	unsigned int mesh_count = 0;
+	unsigned int material_count = 0;
+	// Parts of the file parsed in parallel
+	unsigned int chunk_count = 0;
+	double load_time_ms = 0.0;
+
+	double MegabytesPerSecond() const { return load_time_ms > 0.0 ? file_size / (load_time_ms * 1e3) : 0.0; };
+};
+
+std::ostream& operator<<(std::ostream& stream, const ObjLoadReport& report);
+
+// Triangles of an OBJ file in file order. Every group or object with faces is a
+// mesh, mesh m holds the triangles [mesh_offsets[m], mesh_offsets[m + 1]).
+class ObjModel
+{
+public:
+	std::vector<MaterialTriangle> triangles;
+	std::vector<unsigned int> mesh_offsets;
+	ObjLoadReport report;
+
+	unsigned int MeshCount() const { return mesh_offsets.empty() ? 0 : static_cast<unsigned int>(mesh_offsets.size() - 1); };
+};
+
+// Parses the file in line-aligned chunks on all threads and writes the triangles
+// straight into model. Polygons are split into fans; materials are read from the
+// mtllib files next to the OBJ, faces without one get the default tinyobj material.
+bool LoadObj(const std::string& filename, ObjModel& model, std::string& warning, std::string& error);
+// Paths of the mtllib files LoadObj reads the materials of the OBJ from, in file order
+std::vector<std::string> ObjMaterialLibraries(const std::string& filename);
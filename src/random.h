@@ -0,0 +1,49 @@
+#pragma once
+
+#include "linalg.h"
+using namespace linalg::aliases;
+
+// Philox 2x32 with 10 rounds (Salmon et al. 2011). The output is a pure function of
+// the counter and the key, with only 32x32->64 bit multiplies and xors and no
+// branches, so loops over pixels vectorize.
+inline uint2 Philox2x32(uint2 counter, unsigned int key)
+{
+	for (int round = 0; round < 10; round++)
+	{
+		unsigned long long product = 0xD256D193ull * counter.x;
+		unsigned int high = static_cast<unsigned int>(product >> 32);
+		unsigned int low = static_cast<unsigned int>(product);
+		counter = uint2{ high ^ key ^ counter.y, low };
+		key += 0x9E3779B9u;
+	}
+	return counter;
+}
+
+// 24 random bits onto [0, 1), never 1
+inline float UnitFloat(unsigned int bits)
+{
+	return (bits >> 8) * (1.f / 16777216.f);
+}
+
+// Random numbers keyed by pixel, sample and bounce. It holds no state shared between
+// threads, so an image comes out bit for bit the same for any thread count or tile
+// order, and a single pixel can be replayed on its own. Each bounce has 2^16 draws.
+class CounterRng
+{
+public:
+	CounterRng(unsigned int pixel, unsigned int sample, unsigned int bounce) :
+		key(pixel), sample(sample), draw(bounce << 16) {};
+
+	unsigned int NextUInt() { return Philox2x32(uint2{ sample, draw++ }, key).x; };
+	float NextFloat() { return UnitFloat(NextUInt()); };
+	float2 NextFloat2()
+	{
+		uint2 bits = Philox2x32(uint2{ sample, draw++ }, key);
+		return float2{ UnitFloat(bits.x), UnitFloat(bits.y) };
+	};
+
+private:
+	unsigned int key;
+	unsigned int sample;
+	unsigned int draw;
+};
@@ -29,16 +29,18 @@ void RayGenerationApp::Clear()
 
 void RayGenerationApp::DrawScene()
 {
-	for (short x = 0; x < width; x++)
+	scheduler.Run(width, height, [&](const Tile& tile)
 	{
-#pragma omp parallel for
-		for (short y = 0; y < height; y++)
+		for (short y = tile.y0; y < tile.y1; y++)
 		{
-			Ray ray = camera.GetCameraRay(x, y);
-			Payload payload = TraceRay(ray, raytracing_depth);
-			SetPixel(x, y, payload.color);
+			for (short x = tile.x0; x < tile.x1; x++)
+			{
+				Ray ray = camera.GetCameraRay(x, y);
+				Payload payload = TraceRay(ray, raytracing_depth);
+				SetPixel(x, y, payload.color);
+			}
 		}
-	}
+	});
 }
 
 int RayGenerationApp::Save(std::string filename) const
@@ -104,15 +106,36 @@ void Camera::SetRenderTargetSize(short width, short height)
 }
 
 Ray Camera::GetCameraRay(short x, short y) const
+{
+	return GetCameraRay(x, y, float3{ 0.5f, 0.5f, 0.0f });
+}
+
+Ray Camera::GetCameraRay(short x, short y, float3 jitter) const
 {
 	float aspectRatio = width / static_cast<float>(height);
-	float u = aspectRatio * (2.0f * (x + 0.5f) / static_cast<float>(width) - 1.0f);
-	float v = 2.0f * (y + 0.5f) / static_cast<float>(height) - 1.0f;
+	float u = aspectRatio * (2.0f * (x + jitter.x) / static_cast<float>(width) - 1.0f);
+	float v = 2.0f * (y + jitter.y) / static_cast<float>(height) - 1.0f;
 	float3 direction = this->direction + u * this->right - v * this->up;
 	return Ray(this->position, direction);
 }
 
-Ray Camera::GetCameraRay(short x, short y, float3 jitter) const
+bool Camera::Project(const float3& point, float2& pixel) const
+{
+	float3 offset = point - position;
+	float depth = dot(offset, direction);
+	if (depth <= 0.f)
+	{
+		return false;
+	}
+	float aspectRatio = width / static_cast<float>(height);
+	float u = dot(offset, right) / depth;
+	float v = -dot(offset, up) / depth;
+	pixel = float2{ (u / aspectRatio + 1.f) * 0.5f * width, (v + 1.f) * 0.5f * height };
+	return true;
+}
+
+bool Camera::operator==(const Camera& other) const
 {
-	return GetCameraRay(x, y);
+	return position == other.position && direction == other.direction && up == other.up && right == other.right &&
+		width == other.width && height == other.height;
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "linalg.h"
+#include "tile_scheduler.h"
 using namespace linalg::aliases;
 using namespace linalg::ostream_overloads;
 
@@ -21,6 +22,10 @@ public:
 	float3 direction;
 };
 
+// Scale of the exit distance in ray-box slab tests, 1 + 2 gamma(3) as in Ize 2013,
+// so that rounding never culls a box whose face the ray only touches
+const float slab_exit_scale = 1.0000004f;
+
 class Payload
 {
 public:
@@ -41,8 +46,15 @@ public:
 	void SetUp(float3 approx_up);
 	void SetRenderTargetSize(short width, short height);
 
+	// Ray through the pixel center
 	Ray GetCameraRay(short x, short y) const;
+	// Ray through the point (x + jitter.x, y + jitter.y) of the pixel, jitter in [0, 1)
 	Ray GetCameraRay(short x, short y, float3 jitter) const;
+	// Inverse of GetCameraRay: continuous pixel coordinates of a point, where pixel x
+	// spans [x, x + 1). False for points behind the camera.
+	bool Project(const float3& point, float2& pixel) const;
+	const float3& GetPosition() const { return position; };
+	bool operator==(const Camera& other) const;
 
 private:
 	float3 position;
@@ -68,6 +80,10 @@ public:
 	int Save(std::string filename) const;
 	// Public method to compare the final image with a reference
 	std::vector<byte3> GetFrameBuffer() const { return frame_buffer; }
+	// Per-tile timing of the last DrawScene, shows where the frame time goes
+	virtual TileReport GetTileReport() const { return scheduler.GetReport(); }
+	// Edge of the square tiles the frame is split into, picked up by the next DrawScene
+	void SetTileSize(short size) { scheduler.SetTileSize(size); }
 	const int CHANNEL_NUM = 3;
 protected:
 	void SetPixel(const unsigned short x, const unsigned short y, const float3 color);
@@ -82,4 +98,5 @@ protected:
 
 	std::vector<byte3> frame_buffer;
 	Camera camera;
+	TileScheduler scheduler;
 };
\ No newline at end of file
@@ -0,0 +1,101 @@
+#include "ray_packet.h"
+
+#include <limits>
+
+RayPacket::RayPacket(const std::vector<Ray>& rays)
+{
+	unsigned int size = static_cast<unsigned int>(std::min<size_t>(rays.size(), max_size));
+	all_lanes = size == max_size ? ~0ull : (1ull << size) - 1;
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		inv_min[axis] = std::numeric_limits<float>::infinity();
+		inv_max[axis] = -std::numeric_limits<float>::infinity();
+		negative_direction[axis] = size > 0 && 1.f / rays[0].direction[axis] < 0;
+	}
+
+	for (unsigned int lane = 0; lane < max_size; lane++)
+	{
+		for (int axis = 0; axis < 3; axis++)
+		{
+			if (lane >= size)
+			{
+				// Padding lanes are masked out, they only keep the SIMD loads defined
+				origin[axis][lane] = 0.f;
+				inv_direction[axis][lane] = 0.f;
+				continue;
+			}
+			float inv = 1.f / rays[lane].direction[axis];
+			origin[axis][lane] = rays[lane].position[axis];
+			inv_direction[axis][lane] = inv;
+			inv_min[axis] = std::min(inv_min[axis], inv);
+			inv_max[axis] = std::max(inv_max[axis], inv);
+			coherent &= rays[lane].position[axis] == rays[0].position[axis];
+			coherent &= (inv < 0) == negative_direction[axis];
+		}
+	}
+}
+
+bool RayPacket::FrustumTest(const float3& aabb_min, const float3& aabb_max, const float max_t) const
+{
+	float t_near = 0.f;
+	float t_far = max_t;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float near_plane = negative_direction[axis] ? aabb_max[axis] : aabb_min[axis];
+		float far_plane = negative_direction[axis] ? aabb_min[axis] : aabb_max[axis];
+		float near_offset = near_plane - origin[axis][0];
+		float far_offset = far_plane - origin[axis][0];
+		// Products are monotonic in the inverse direction, so the interval ends bound every ray
+		float near_a = near_offset * inv_min[axis];
+		float near_b = near_offset * inv_max[axis];
+		float far_a = far_offset * inv_min[axis];
+		float far_b = far_offset * inv_max[axis];
+		float entry = std::min(near_a, near_b);
+		float exit = std::max(far_a, far_b);
+		// NaN from a ray lying in a slab plane keeps the previous bound
+		if (entry > t_near)
+		{
+			t_near = entry;
+		}
+		if (exit < t_far)
+		{
+			t_far = exit;
+		}
+	}
+	return t_near <= t_far;
+}
+
+unsigned long long RayPacket::AABBTest(const float3& aabb_min, const float3& aabb_max, unsigned long long mask, const float* max_t) const
+{
+	__m128 near_bound[3];
+	__m128 far_bound[3];
+	for (int axis = 0; axis < 3; axis++)
+	{
+		near_bound[axis] = _mm_set1_ps(negative_direction[axis] ? aabb_max[axis] : aabb_min[axis]);
+		far_bound[axis] = _mm_set1_ps(negative_direction[axis] ? aabb_min[axis] : aabb_max[axis]);
+	}
+
+	unsigned long long result = 0;
+	const __m128 exit_scale = _mm_set1_ps(slab_exit_scale);
+	for (unsigned int lane = 0; lane < max_size; lane += 4)
+	{
+		if (((mask >> lane) & 0xF) == 0)
+		{
+			continue;
+		}
+		__m128 t_near = _mm_setzero_ps();
+		__m128 t_far = _mm_load_ps(max_t + lane);
+		for (int axis = 0; axis < 3; axis++)
+		{
+			__m128 ray_origin = _mm_load_ps(origin[axis] + lane);
+			__m128 inv = _mm_load_ps(inv_direction[axis] + lane);
+			__m128 near_t = _mm_mul_ps(_mm_sub_ps(near_bound[axis], ray_origin), inv);
+			__m128 far_t = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(far_bound[axis], ray_origin), inv), exit_scale);
+			t_near = _mm_max_ps(near_t, t_near);
+			t_far = _mm_min_ps(far_t, t_far);
+		}
+		result |= static_cast<unsigned long long>(_mm_movemask_ps(_mm_cmple_ps(t_near, t_far))) << lane;
+	}
+	return result & mask;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "ray_generation.h"
+#include "simd.h"
+
+#include <vector>
+
+// Up to 64 coherent rays, e.g. the primary rays of an 8x8 tile, traced through the
+// BVH together. Origins and inverse directions are stored as structure of arrays,
+// so one node is tested against four rays at once.
+class alignas(16) RayPacket
+{
+public:
+	static const unsigned int max_size = 64;
+
+	RayPacket(const std::vector<Ray>& rays);
+
+	// Bit i is set for the rays[i] lane
+	unsigned long long AllLanes() const { return all_lanes; };
+	// A packet is coherent when all rays share the origin and the direction signs
+	bool IsCoherent() const { return coherent; };
+
+	// Interval arithmetic test of the whole packet: false only if no ray of the
+	// packet can enter the box before max_t. Requires a coherent packet.
+	bool FrustumTest(const float3& aabb_min, const float3& aabb_max, const float max_t) const;
+	// Lanes of the mask whose rays hit the box before their max_t, which is an
+	// aligned array of max_size floats. Requires a coherent packet.
+	unsigned long long AABBTest(const float3& aabb_min, const float3& aabb_max, unsigned long long mask, const float* max_t) const;
+
+	// Child to visit first on the given axis, valid for coherent packets
+	bool NegativeDirection(unsigned int axis) const { return negative_direction[axis]; };
+
+protected:
+	float origin[3][max_size];
+	float inv_direction[3][max_size];
+	// Range of inverse directions over the packet
+	float inv_min[3];
+	float inv_max[3];
+	bool negative_direction[3];
+	unsigned long long all_lanes = 0;
+	bool coherent = true;
+};
@@ -89,8 +89,7 @@ Payload Refraction::Hit(const Ray& ray, const IntersectableData& data, const Mat
 	{
 		Ray toLight(X, light->position - X);
 		float toLightDistance = length(light->position - X);
-		float t = TraceShadowRay(toLight, toLightDistance);
-		if (fabs(t - toLightDistance) > t_min)
+		if (Occluded(toLight, toLightDistance - t_min))
 		{
 			continue;
 		}
@@ -0,0 +1,175 @@
+#include "sampler.h"
+#include "random.h"
+
+#include <algorithm>
+#include <cmath>
+
+// Integer finalizer with good avalanche (lowbias32)
+static unsigned int Hash(unsigned int x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+static unsigned int Hash(unsigned int a, unsigned int b, unsigned int c = 0)
+{
+	return Hash(a ^ Hash(b ^ Hash(c)));
+}
+
+// Largest float below 1, so that a full 32-bit value never rounds up to 1
+static float ToUnitFloat(unsigned int x)
+{
+	return std::min(x * (1.f / 4294967296.f), 0.99999994f);
+}
+
+static unsigned int ReverseBits(unsigned int x)
+{
+	x = (x << 16) | (x >> 16);
+	x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+	x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+	x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+	x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+	return x;
+}
+
+static float Fraction(double x)
+{
+	return std::min(static_cast<float>(x - std::floor(x)), 0.99999994f);
+}
+
+float2 Sampler::Get2D(unsigned int pixel, unsigned int sample, unsigned int dimension) const
+{
+	return float2{ Get1D(pixel, sample, dimension), Get1D(pixel, sample, dimension + 1) };
+}
+
+StratifiedSampler::StratifiedSampler(unsigned int sample_count) :
+	sample_count(std::max(sample_count, 1u)),
+	grid(std::max(static_cast<unsigned int>(std::sqrt(static_cast<float>(sample_count))), 1u))
+{
+}
+
+float StratifiedSampler::Get1D(unsigned int pixel, unsigned int sample, unsigned int dimension) const
+{
+	// Rotating the strata per pixel and dimension keeps dimensions from pairing up
+	unsigned int stratum = (sample + Hash(pixel, dimension)) % sample_count;
+	float jitter = CounterRng(pixel, sample, dimension).NextFloat();
+	// The sum rounds up to sample_count when the jitter is close to 1
+	return std::min((stratum + jitter) / sample_count, 0.99999994f);
+}
+
+float2 StratifiedSampler::Get2D(unsigned int pixel, unsigned int sample, unsigned int dimension) const
+{
+	const unsigned int cells = grid * grid;
+	unsigned int cell = (sample + Hash(pixel, dimension)) % cells;
+	float2 jitter = CounterRng(pixel, sample, dimension).NextFloat2();
+	return float2{ std::min((cell % grid + jitter.x) / grid, 0.99999994f), std::min((cell / grid + jitter.y) / grid, 0.99999994f) };
+}
+
+// Second Sobol dimension, the first one is the bit reversal of the index
+static unsigned int Sobol1(unsigned int index)
+{
+	unsigned int result = 0;
+	unsigned int direction = 0x80000000u;
+	for (; index != 0; index >>= 1)
+	{
+		if (index & 1)
+		{
+			result ^= direction;
+		}
+		direction ^= direction >> 1;
+	}
+	return result;
+}
+
+// Owen scrambling of the bits from the top down, as a hash over the reversed bits
+static unsigned int OwenScramble(unsigned int x, unsigned int seed)
+{
+	x = ReverseBits(x);
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return ReverseBits(x);
+}
+
+float SobolSampler::Get1D(unsigned int pixel, unsigned int sample, unsigned int dimension) const
+{
+	unsigned int seed = Hash(pixel, dimension);
+	unsigned int index = OwenScramble(sample, seed);
+	return ToUnitFloat(OwenScramble(ReverseBits(index), Hash(seed)));
+}
+
+float2 SobolSampler::Get2D(unsigned int pixel, unsigned int sample, unsigned int dimension) const
+{
+	// Shuffling the index decorrelates the pairs, which are all the same (0,2) sequence
+	unsigned int seed = Hash(pixel, dimension);
+	unsigned int index = OwenScramble(sample, seed);
+	return float2{ ToUnitFloat(OwenScramble(ReverseBits(index), Hash(seed, 0))),
+		ToUnitFloat(OwenScramble(Sobol1(index), Hash(seed, 1))) };
+}
+
+// Golden ratio and plastic number, the generators of the R1 and R2 sequences
+static const double r1_alpha = 0.6180339887498949;
+static const double r2_alpha_x = 0.7548776662466927;
+static const double r2_alpha_y = 0.5698402909980532;
+
+float R2Sampler::Get1D(unsigned int pixel, unsigned int sample, unsigned int dimension) const
+{
+	return Fraction(Offset(pixel, dimension) + r1_alpha * sample);
+}
+
+float2 R2Sampler::Get2D(unsigned int pixel, unsigned int sample, unsigned int dimension) const
+{
+	return float2{ Fraction(Offset(pixel, dimension) + r2_alpha_x * sample),
+		Fraction(Offset(pixel, dimension + 1) + r2_alpha_y * sample) };
+}
+
+float R2Sampler::Offset(unsigned int pixel, unsigned int dimension) const
+{
+	return ToUnitFloat(Hash(pixel, dimension));
+}
+
+BlueNoiseSampler::BlueNoiseSampler(const std::vector<float3>& texture, unsigned int texture_width, unsigned int image_width) :
+	texture(texture),
+	texture_width(std::max(texture_width, 1u)),
+	image_width(std::max(image_width, 1u))
+{
+}
+
+float BlueNoiseSampler::Offset(unsigned int pixel, unsigned int dimension) const
+{
+	if (texture.empty())
+	{
+		return R2Sampler::Offset(pixel, dimension);
+	}
+	// Each group of three dimensions reads the texture shifted by a hashed amount,
+	// neighbouring pixels still get well spread offsets
+	unsigned int texture_height = static_cast<unsigned int>(texture.size()) / texture_width;
+	unsigned int shift = Hash(dimension / 3);
+	unsigned int x = (pixel % image_width + shift) % texture_width;
+	unsigned int y = (pixel / image_width + (shift >> 16)) % texture_height;
+	float value = texture[y * texture_width + x][dimension % 3];
+	return std::min((value + 1.f) * 0.5f, 0.99999994f);
+}
+
+std::unique_ptr<Sampler> CreateSampler(SamplerType type, unsigned int sample_count, const std::vector<float3>& blue_noise, unsigned int blue_noise_width, unsigned int image_width)
+{
+	switch (type)
+	{
+	case SamplerType::Stratified:
+		return std::make_unique<StratifiedSampler>(sample_count);
+	case SamplerType::Sobol:
+		return std::make_unique<SobolSampler>();
+	case SamplerType::R2:
+		return std::make_unique<R2Sampler>();
+	case SamplerType::BlueNoise:
+		return std::make_unique<BlueNoiseSampler>(blue_noise, blue_noise_width, image_width);
+	default:
+		return nullptr;
+	}
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "linalg.h"
+using namespace linalg::aliases;
+
+#include <memory>
+#include <vector>
+
+enum class SamplerType
+{
+	// Random texel of the blue-noise table and the pixel center, as the lab renders
+	None,
+	// Jittered strata over the frame budget, shuffled per pixel and dimension
+	Stratified,
+	// Sobol (0,2) pairs with hashed Owen scrambling (Burley 2020)
+	Sobol,
+	// Roberts' R2 sequence, rotated per pixel and dimension by a hash
+	R2,
+	// R2 rotated by a blue-noise texture, so the error left in the image is high frequency
+	BlueNoise
+};
+
+// Sample values in [0, 1) addressed by (pixel, sample, dimension) rather than drawn
+// from a stream, so any pixel can be sampled on any thread and in any order.
+// Consumers take dimension pairs, e.g. 0-1 for the pixel jitter and 2 + 2 * bounce
+// for the direction picked at a bounce.
+class Sampler
+{
+public:
+	virtual ~Sampler() {};
+
+	virtual float Get1D(unsigned int pixel, unsigned int sample, unsigned int dimension) const = 0;
+	// Dimensions dimension and dimension + 1, stratified together where the sequence allows
+	virtual float2 Get2D(unsigned int pixel, unsigned int sample, unsigned int dimension) const;
+};
+
+class StratifiedSampler : public Sampler
+{
+public:
+	// Strata are laid out for sample_count samples per pixel, later samples start another round
+	StratifiedSampler(unsigned int sample_count);
+
+	virtual float Get1D(unsigned int pixel, unsigned int sample, unsigned int dimension) const;
+	virtual float2 Get2D(unsigned int pixel, unsigned int sample, unsigned int dimension) const;
+
+protected:
+	unsigned int sample_count;
+	// Side of the square grid of 2D strata
+	unsigned int grid;
+};
+
+class SobolSampler : public Sampler
+{
+public:
+	virtual float Get1D(unsigned int pixel, unsigned int sample, unsigned int dimension) const;
+	virtual float2 Get2D(unsigned int pixel, unsigned int sample, unsigned int dimension) const;
+};
+
+class R2Sampler : public Sampler
+{
+public:
+	virtual float Get1D(unsigned int pixel, unsigned int sample, unsigned int dimension) const;
+	virtual float2 Get2D(unsigned int pixel, unsigned int sample, unsigned int dimension) const;
+
+protected:
+	// Cranley-Patterson rotation of a pixel and dimension
+	virtual float Offset(unsigned int pixel, unsigned int dimension) const;
+};
+
+class BlueNoiseSampler : public R2Sampler
+{
+public:
+	// Texels in [-1, 1] as loaded by Denoising::LoadBlueNoise, tiled over an image of
+	// image_width pixels per row
+	BlueNoiseSampler(const std::vector<float3>& texture, unsigned int texture_width, unsigned int image_width);
+
+protected:
+	virtual float Offset(unsigned int pixel, unsigned int dimension) const;
+
+	const std::vector<float3>& texture;
+	unsigned int texture_width;
+	unsigned int image_width;
+};
+
+// Nullptr for SamplerType::None
+std::unique_ptr<Sampler> CreateSampler(SamplerType type, unsigned int sample_count, const std::vector<float3>& blue_noise, unsigned int blue_noise_width, unsigned int image_width);
@@ -0,0 +1,49 @@
+#include "scene_cache.h"
+#include "obj_loader.h"
+
+unsigned long long HashFile(const std::string& filename, unsigned long long hash)
+{
+	MappedFile file(filename);
+	if (!file.IsOpen())
+	{
+		return 0;
+	}
+	for (size_t i = 0; i < file.Size(); i++)
+	{
+		hash ^= static_cast<unsigned char>(file.Data()[i]);
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+unsigned long long HashObjFile(const std::string& filename)
+{
+	unsigned long long hash = HashFile(filename);
+	if (hash == 0)
+	{
+		return 0;
+	}
+	for (const std::string& library : ObjMaterialLibraries(filename))
+	{
+		hash = HashFile(library, hash);
+	}
+	return hash;
+}
+
+bool SceneCacheHeader::IsValid(size_t file_size) const
+{
+	const SceneCacheHeader expected;
+	if (file_size < sizeof(SceneCacheHeader) || std::memcmp(magic, expected.magic, sizeof(magic)) != 0
+		|| version != expected.version || section_count != expected.section_count)
+	{
+		return false;
+	}
+	for (unsigned int section = 0; section < section_count; section++)
+	{
+		if (offsets[section] % scene_cache_alignment != 0 || offsets[section] > file_size || sizes[section] > file_size - offsets[section])
+		{
+			return false;
+		}
+	}
+	return true;
+}
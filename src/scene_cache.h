@@ -0,0 +1,102 @@
+#pragma once
+
+#include "indexed_geometry.h"
+#include "mapped_file.h"
+
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+const unsigned long long fnv_offset_basis = 14695981039346656037ull;
+
+// 64-bit FNV-1a hash of the file contents, continued from hash; 0 when the file cannot be read
+unsigned long long HashFile(const std::string& filename, unsigned long long hash = fnv_offset_basis);
+// Hash of an OBJ file followed by the material libraries it loads, so that editing a material invalidates the cache too
+unsigned long long HashObjFile(const std::string& filename);
+
+// Bumped whenever the layout of a section or of a stored class changes
+const unsigned int scene_cache_version = 4;
+
+enum class SceneCacheSection
+{
+	Vertices,
+	Triangles,
+	Materials,
+	Models,
+	BLASes,
+	MeshFirstTriangle,
+	Nodes,
+	TriangleIndices,
+	Nodes4,
+	Nodes8,
+	Blocks4,
+	Blocks8,
+	Blocks16,
+	LeafBlocks,
+	QuantizedNodes4,
+	QuantizedNodes8,
+	QuantizedLeaves,
+	Spheres,
+	SphereIndices,
+	Count
+};
+
+// Start of the cache file. Sections follow it in any order, each aligned to a cache line.
+class SceneCacheHeader
+{
+public:
+	char magic[8] = { 'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0' };
+	unsigned int version = scene_cache_version;
+	unsigned int section_count = static_cast<unsigned int>(SceneCacheSection::Count);
+	unsigned long long source_hash = 0;
+	// Build settings the stored BVH was made with
+	unsigned int build_mode = 0;
+	unsigned int leaf_size = 0;
+	unsigned int branching_factor = 0;
+	unsigned int triangle_block_width = 0;
+	unsigned int quantized_nodes = 0;
+	unsigned int analytic_spheres = 0;
+	float spatial_split_budget = 0.f;
+	unsigned int spatial_split_count = 0;
+	unsigned long long offsets[static_cast<int>(SceneCacheSection::Count)] = {};
+	unsigned long long sizes[static_cast<int>(SceneCacheSection::Count)] = {};
+
+	bool IsValid(size_t file_size) const;
+};
+
+const size_t scene_cache_alignment = 64;
+
+// Appends the array as a section of the cache being written to buffer
+template<typename T>
+void WriteSceneCacheSection(std::vector<char>& buffer, SceneCacheHeader& header, SceneCacheSection section, const std::vector<T>& data)
+{
+	static_assert(std::is_trivially_copyable<T>::value, "Cached arrays are copied as bytes");
+	size_t offset = (buffer.size() + scene_cache_alignment - 1) / scene_cache_alignment * scene_cache_alignment;
+	size_t size = data.size() * sizeof(T);
+	buffer.resize(offset + size);
+	if (size > 0)
+	{
+		std::memcpy(buffer.data() + offset, data.data(), size);
+	}
+	header.offsets[static_cast<int>(section)] = offset;
+	header.sizes[static_cast<int>(section)] = size;
+}
+
+// Copies a section of a mapped cache into the array; false if its size does not fit T
+template<typename T>
+bool ReadSceneCacheSection(const MappedFile& file, const SceneCacheHeader& header, SceneCacheSection section, std::vector<T>& data)
+{
+	static_assert(std::is_trivially_copyable<T>::value, "Cached arrays are copied as bytes");
+	size_t size = static_cast<size_t>(header.sizes[static_cast<int>(section)]);
+	if (size % sizeof(T) != 0)
+	{
+		return false;
+	}
+	data.resize(size / sizeof(T));
+	if (size > 0)
+	{
+		std::memcpy(data.data(), file.Data() + header.offsets[static_cast<int>(section)], size);
+	}
+	return true;
+}
@@ -16,15 +16,15 @@ Payload ShadowRays::TraceRay(const Ray& ray, const unsigned int max_raytrace_dep
 	}
 
 	IntersectableData closestData(t_max);
-	MaterialTriangle* closestTriangle = nullptr;
+	const MaterialTriangle* closestTriangle = nullptr;
 
 	for (auto& object : material_objects)
 	{
-		auto data = object->Intersect(ray);
+		auto data = object.Intersect(ray);
 		if (data.t > t_min && data.t < closestData.t)
 		{
 			closestData = data;
-			closestTriangle = object;
+			closestTriangle = &object;
 		}
 	}
 
@@ -54,8 +54,7 @@ Payload ShadowRays::Hit(const Ray& ray, const IntersectableData& data, const Mat
 	{
 		Ray toLight(X, light->position - X);
 		float toLightDistance = length(light->position - X);
-		float t = TraceShadowRay(toLight, toLightDistance);
-		if (fabs(t - toLightDistance) > t_min)
+		if (Occluded(toLight, toLightDistance - t_min))
 		{
 			continue;
 		}
@@ -73,19 +72,17 @@ Payload ShadowRays::Hit(const Ray& ray, const IntersectableData& data, const Mat
 	return payload;
 }
 
-float ShadowRays::TraceShadowRay(const Ray& ray, const float max_t) const
+bool ShadowRays::Occluded(const Ray& ray, const float max_t) const
 {
-	IntersectableData closestData(max_t);
-
 	for (auto& object : material_objects)
 	{
-		auto data = object->Intersect(ray);
-		if (data.t > t_min && data.t < closestData.t)
+		auto data = object.Intersect(ray);
+		if (data.t > t_min && data.t < max_t)
 		{
-			return data.t;
+			return true;
 		}
 	}
 
-	return max_t;
+	return false;
 }
 
@@ -11,5 +11,6 @@ public:
 protected:
 	virtual Payload TraceRay(const Ray& ray, const unsigned int max_raytrace_depth) const;
 	virtual Payload Hit(const Ray& ray, const IntersectableData& data, const MaterialTriangle* triangle, const unsigned int max_raytrace_depth) const;
-	virtual float TraceShadowRay(const Ray& ray, const float max_t) const;
+	// True if anything is hit in (t_min, max_t); stops at the first such hit
+	virtual bool Occluded(const Ray& ray, const float max_t) const;
 };
\ No newline at end of file
@@ -0,0 +1,87 @@
+#pragma once
+
+// SSE is always available on x64. The 8-wide AVX2 paths are compiled when the
+// target enables AVX2 (/arch:AVX2 or -mavx2) and fall back to two SSE halves otherwise.
+// Premake5.lua turns AVX2 on for the BVH and denoising projects.
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#if defined(__AVX2__)
+#define SIMD_AVX2 1
+#else
+#define SIMD_AVX2 0
+#endif
+
+// Index of the lowest set bit of a non-zero mask
+inline int LowestBit(unsigned int mask)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return static_cast<int>(index);
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+// Index of the highest set bit of a non-zero mask
+inline int HighestBit(unsigned int mask)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanReverse(&index, mask);
+	return static_cast<int>(index);
+#else
+	return 31 - __builtin_clz(mask);
+#endif
+}
+
+// Index of the lowest set bit of a non-zero 64-bit mask
+inline int LowestBit64(unsigned long long mask)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward64(&index, mask);
+	return static_cast<int>(index);
+#else
+	return __builtin_ctzll(mask);
+#endif
+}
+
+inline int BitCount(unsigned int mask)
+{
+#if defined(_MSC_VER)
+	return static_cast<int>(__popcnt(mask));
+#else
+	return __builtin_popcount(mask);
+#endif
+}
+
+inline int BitCount64(unsigned long long mask)
+{
+#if defined(_MSC_VER)
+	return static_cast<int>(__popcnt64(mask));
+#else
+	return __builtin_popcountll(mask);
+#endif
+}
+
+// e^x of four floats, relative error below 1e-5, inputs clamped to [-87, 88]
+inline __m128 Exp(__m128 x)
+{
+	x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-87.f)), _mm_set1_ps(88.f));
+	// e^x = 2^n * 2^f with n the nearest integer to x * log2(e) and f in [-0.5, 0.5]
+	__m128 t = _mm_mul_ps(x, _mm_set1_ps(1.44269504f));
+	__m128i n = _mm_cvtps_epi32(t);
+	__m128 f = _mm_sub_ps(t, _mm_cvtepi32_ps(n));
+	__m128 p = _mm_set1_ps(1.33335581e-3f);
+	p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(9.61812911e-3f));
+	p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(5.55041087e-2f));
+	p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(2.40226507e-1f));
+	p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(6.93147181e-1f));
+	p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.f));
+	__m128i exponent = _mm_slli_epi32(_mm_add_epi32(n, _mm_set1_epi32(127)), 23);
+	return _mm_mul_ps(p, _mm_castsi128_ps(exponent));
+}
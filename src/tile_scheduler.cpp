@@ -0,0 +1,234 @@
+#include "tile_scheduler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <omp.h>
+
+// Interleaves the bits of the tile coordinates, neighbouring tiles get close keys
+static unsigned int MortonKey(unsigned int x, unsigned int y)
+{
+	auto spread = [](unsigned int v)
+	{
+		v &= 0xffff;
+		v = (v | (v << 8)) & 0x00ff00ff;
+		v = (v | (v << 4)) & 0x0f0f0f0f;
+		v = (v | (v << 2)) & 0x33333333;
+		v = (v | (v << 1)) & 0x55555555;
+		return v;
+	};
+	return spread(x) | (spread(y) << 1);
+}
+
+TileScheduler::~TileScheduler()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	start_condition.notify_all();
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+}
+
+void TileScheduler::Run(short width, short height, const std::function<void(const Tile&)>& render_tile)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+
+	short tiles_x = (width + tile_size - 1) / tile_size;
+	short tiles_y = (height + tile_size - 1) / tile_size;
+	std::vector<std::pair<unsigned int, Tile>> ordered;
+	ordered.reserve(static_cast<size_t>(tiles_x) * tiles_y);
+	for (short ty = 0; ty < tiles_y; ty++)
+	{
+		for (short tx = 0; tx < tiles_x; tx++)
+		{
+			Tile tile;
+			tile.x0 = tx * tile_size;
+			tile.y0 = ty * tile_size;
+			tile.x1 = std::min<short>(tile.x0 + tile_size, width);
+			tile.y1 = std::min<short>(tile.y0 + tile_size, height);
+			ordered.push_back({ MortonKey(tx, ty), tile });
+		}
+	}
+	std::sort(ordered.begin(), ordered.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+	timings.assign(ordered.size(), TileTiming());
+	for (size_t i = 0; i < ordered.size(); i++)
+	{
+		timings[i].tile = ordered[i].second;
+	}
+
+	StartThreads(static_cast<unsigned int>(std::max(1, omp_get_max_threads())));
+	// Contiguous runs of the Morton order keep the tiles of a worker close on screen
+	unsigned int worker_count = static_cast<unsigned int>(queues.size());
+	for (unsigned int w = 0; w < worker_count; w++)
+	{
+		size_t first = ordered.size() * w / worker_count;
+		size_t last = ordered.size() * (w + 1) / worker_count;
+		queues[w]->tiles.clear();
+		for (size_t i = first; i < last; i++)
+		{
+			queues[w]->tiles.push_back(static_cast<unsigned int>(i));
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		this->render_tile = &render_tile;
+		busy_threads = static_cast<unsigned int>(threads.size());
+		generation++;
+	}
+	start_condition.notify_all();
+	RenderTiles(0);
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		done_condition.wait(lock, [this] { return busy_threads == 0; });
+		this->render_tile = nullptr;
+	}
+
+	frame_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+void TileScheduler::StartThreads(unsigned int worker_count)
+{
+	if (queues.size() == worker_count)
+	{
+		return;
+	}
+	// Worker count changed since the last run, the pool is idle at this point
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	start_condition.notify_all();
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+	threads.clear();
+	stopping = false;
+
+	queues.clear();
+	for (unsigned int w = 0; w < worker_count; w++)
+	{
+		queues.push_back(std::make_unique<WorkerQueue>());
+	}
+	for (unsigned int w = 1; w < worker_count; w++)
+	{
+		threads.emplace_back(&TileScheduler::ThreadLoop, this, w, generation);
+	}
+}
+
+void TileScheduler::ThreadLoop(unsigned int worker, unsigned long long seen_generation)
+{
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			start_condition.wait(lock, [&] { return stopping || generation != seen_generation; });
+			if (stopping)
+			{
+				return;
+			}
+			seen_generation = generation;
+		}
+		RenderTiles(worker);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--busy_threads == 0)
+			{
+				done_condition.notify_one();
+			}
+		}
+	}
+}
+
+void TileScheduler::RenderTiles(unsigned int worker)
+{
+	unsigned int tile;
+	bool stolen;
+	while (NextTile(worker, tile, stolen))
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		(*render_tile)(timings[tile].tile);
+		timings[tile].ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		timings[tile].worker = worker;
+		timings[tile].stolen = stolen;
+	}
+}
+
+bool TileScheduler::NextTile(unsigned int worker, unsigned int& tile, bool& stolen)
+{
+	{
+		WorkerQueue& own = *queues[worker];
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (!own.tiles.empty())
+		{
+			tile = own.tiles.front();
+			own.tiles.pop_front();
+			stolen = false;
+			return true;
+		}
+	}
+	// The back of a run is the work its owner would reach last
+	for (size_t i = 1; i < queues.size(); i++)
+	{
+		WorkerQueue& victim = *queues[(worker + i) % queues.size()];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (!victim.tiles.empty())
+		{
+			tile = victim.tiles.back();
+			victim.tiles.pop_back();
+			stolen = true;
+			return true;
+		}
+	}
+	return false;
+}
+
+TileReport TileScheduler::GetReport() const
+{
+	TileReport report;
+	report.tile_count = static_cast<unsigned int>(timings.size());
+	report.worker_count = static_cast<unsigned int>(std::max<size_t>(queues.size(), 1));
+	report.frame_ms = frame_ms;
+	if (timings.empty())
+	{
+		return report;
+	}
+
+	std::vector<double> busy_ms(report.worker_count, 0.0);
+	report.min_tile_ms = timings[0].ms;
+	report.slowest_tile = timings[0].tile;
+	for (const auto& timing : timings)
+	{
+		busy_ms[timing.worker] += timing.ms;
+		report.mean_tile_ms += timing.ms;
+		report.min_tile_ms = std::min(report.min_tile_ms, timing.ms);
+		if (timing.ms > report.max_tile_ms)
+		{
+			report.max_tile_ms = timing.ms;
+			report.slowest_tile = timing.tile;
+		}
+		report.stolen_count += timing.stolen ? 1 : 0;
+	}
+	double mean_busy_ms = report.mean_tile_ms / report.worker_count;
+	report.mean_tile_ms /= report.tile_count;
+	if (mean_busy_ms > 0.0)
+	{
+		report.imbalance = *std::max_element(busy_ms.begin(), busy_ms.end()) / mean_busy_ms;
+	}
+	return report;
+}
+
+std::ostream& operator<<(std::ostream& stream, const TileReport& report)
+{
+	stream << "Tiles: " << report.tile_count << " on " << report.worker_count << " workers, "
+		<< report.frame_ms << " ms, " << report.stolen_count << " stolen" << std::endl;
+	stream << "Tile time: min " << report.min_tile_ms << " ms, mean " << report.mean_tile_ms
+		<< " ms, max " << report.max_tile_ms << " ms at (" << report.slowest_tile.x0 << ", " << report.slowest_tile.y0 << ")" << std::endl;
+	stream << "Worker imbalance: " << report.imbalance << std::endl;
+	return stream;
+}
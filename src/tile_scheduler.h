@@ -0,0 +1,100 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+// Pixels [x0, x1) x [y0, y1) of the image
+class Tile
+{
+public:
+	short x0 = 0;
+	short y0 = 0;
+	short x1 = 0;
+	short y1 = 0;
+};
+
+class TileTiming
+{
+public:
+	Tile tile;
+	double ms = 0.0;
+	unsigned int worker = 0;
+	// Taken from the queue of another worker
+	bool stolen = false;
+};
+
+class TileReport
+{
+public:
+	unsigned int tile_count = 0;
+	unsigned int worker_count = 0;
+	unsigned int stolen_count = 0;
+	double min_tile_ms = 0.0;
+	double mean_tile_ms = 0.0;
+	double max_tile_ms = 0.0;
+	// Busiest worker relative to the mean busy time, 1 is a perfect balance
+	double imbalance = 1.0;
+	double frame_ms = 0.0;
+	Tile slowest_tile;
+};
+
+std::ostream& operator<<(std::ostream& stream, const TileReport& report);
+
+// Renders an image tile by tile on a pool of threads that lives as long as the
+// scheduler. Tiles are handed out in Morton order, each worker starts with a
+// contiguous run of them, and a worker that runs dry steals from the far end of
+// another worker's run. The calling thread works as worker 0.
+class TileScheduler
+{
+public:
+	TileScheduler() {};
+	~TileScheduler();
+	TileScheduler(const TileScheduler&) = delete;
+	TileScheduler& operator=(const TileScheduler&) = delete;
+
+	// Calls render_tile once for every tile and returns when all of them are done.
+	// Tiles never overlap, so render_tile may write its pixels without locking.
+	void Run(short width, short height, const std::function<void(const Tile&)>& render_tile);
+
+	void SetTileSize(short size) { tile_size = size > 0 ? size : 1; };
+	short GetTileSize() const { return tile_size; };
+	// Timings of the tiles of the last Run, in Morton order
+	const std::vector<TileTiming>& GetTimings() const { return timings; };
+	TileReport GetReport() const;
+
+	static const short default_tile_size = 16;
+
+protected:
+	class WorkerQueue
+	{
+	public:
+		std::mutex mutex;
+		std::deque<unsigned int> tiles;
+	};
+
+	void StartThreads(unsigned int worker_count);
+	void ThreadLoop(unsigned int worker, unsigned long long seen_generation);
+	void RenderTiles(unsigned int worker);
+	bool NextTile(unsigned int worker, unsigned int& tile, bool& stolen);
+
+	short tile_size = default_tile_size;
+	std::vector<TileTiming> timings;
+	double frame_ms = 0.0;
+
+	std::vector<std::thread> threads;
+	std::vector<std::unique_ptr<WorkerQueue>> queues;
+	std::mutex mutex;
+	std::condition_variable start_condition;
+	std::condition_variable done_condition;
+	// Bumped by every Run, so a woken thread knows whether there is new work
+	unsigned long long generation = 0;
+	unsigned int busy_threads = 0;
+	bool stopping = false;
+	const std::function<void(const Tile&)>* render_tile = nullptr;
+};
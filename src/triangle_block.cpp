@@ -0,0 +1,220 @@
+#include "triangle_block.h"
+
+template<int N>
+TriangleBlock<N>::TriangleBlock()
+{
+	for (int lane = 0; lane < N; lane++)
+	{
+		for (int axis = 0; axis < 3; axis++)
+		{
+			v0[axis][lane] = 0.f;
+			e1[axis][lane] = 0.f;
+			e2[axis][lane] = 0.f;
+		}
+		id[lane] = 0;
+	}
+}
+
+template<int N>
+void TriangleBlock<N>::Set(int lane, const Triangle& triangle, unsigned int triangle_id)
+{
+	Set(lane, triangle.a.position, triangle.b.position, triangle.c.position, triangle_id);
+}
+
+template<int N>
+void TriangleBlock<N>::Set(int lane, const float3& a, const float3& b, const float3& c, unsigned int triangle_id)
+{
+	float3 ba = b - a;
+	float3 ca = c - a;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		v0[axis][lane] = a[axis];
+		e1[axis][lane] = ba[axis];
+		e2[axis][lane] = ca[axis];
+	}
+	id[lane] = triangle_id;
+}
+
+BlockRay::BlockRay(const Ray& ray)
+{
+	for (int axis = 0; axis < 3; axis++)
+	{
+		origin[axis] = _mm_set1_ps(ray.position[axis]);
+		direction[axis] = _mm_set1_ps(ray.direction[axis]);
+#if SIMD_AVX2
+		origin8[axis] = _mm256_set1_ps(ray.position[axis]);
+		direction8[axis] = _mm256_set1_ps(ray.direction[axis]);
+#endif
+	}
+}
+
+// The lane kernels follow Triangle::Intersect operation by operation and use true
+// divisions, so a hit matches the scalar path bit for bit.
+static unsigned int IntersectLanes(const float* const v0[3], const float* const e1[3], const float* const e2[3],
+	const __m128* origin, const __m128* direction, const float t_min, const float t_max,
+	float* lane_t, float* lane_u, float* lane_v)
+{
+	__m128 e1x = _mm_load_ps(e1[0]), e1y = _mm_load_ps(e1[1]), e1z = _mm_load_ps(e1[2]);
+	__m128 e2x = _mm_load_ps(e2[0]), e2y = _mm_load_ps(e2[1]), e2z = _mm_load_ps(e2[2]);
+
+	// pvec = cross(direction, e2)
+	__m128 px = _mm_sub_ps(_mm_mul_ps(direction[1], e2z), _mm_mul_ps(direction[2], e2y));
+	__m128 py = _mm_sub_ps(_mm_mul_ps(direction[2], e2x), _mm_mul_ps(direction[0], e2z));
+	__m128 pz = _mm_sub_ps(_mm_mul_ps(direction[0], e2y), _mm_mul_ps(direction[1], e2x));
+	__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+	__m128 valid = _mm_or_ps(_mm_cmple_ps(det, _mm_set1_ps(-1e-8f)), _mm_cmpge_ps(det, _mm_set1_ps(1e-8f)));
+
+	__m128 tx = _mm_sub_ps(origin[0], _mm_load_ps(v0[0]));
+	__m128 ty = _mm_sub_ps(origin[1], _mm_load_ps(v0[1]));
+	__m128 tz = _mm_sub_ps(origin[2], _mm_load_ps(v0[2]));
+	__m128 u = _mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), det);
+	valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(u, _mm_setzero_ps()), _mm_cmple_ps(u, _mm_set1_ps(1.f))));
+
+	// qvec = cross(tvec, e1)
+	__m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+	__m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+	__m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+	__m128 v = _mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(direction[0], qx), _mm_mul_ps(direction[1], qy)), _mm_mul_ps(direction[2], qz)), det);
+	valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(v, _mm_setzero_ps()), _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.f))));
+
+	__m128 t = _mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), det);
+	valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(t, _mm_set1_ps(t_min)), _mm_cmplt_ps(t, _mm_set1_ps(t_max))));
+
+	_mm_store_ps(lane_t, t);
+	_mm_store_ps(lane_u, u);
+	_mm_store_ps(lane_v, v);
+	return static_cast<unsigned int>(_mm_movemask_ps(valid));
+}
+
+#if SIMD_AVX2
+static unsigned int IntersectLanes(const float* const v0[3], const float* const e1[3], const float* const e2[3],
+	const __m256* origin, const __m256* direction, const float t_min, const float t_max,
+	float* lane_t, float* lane_u, float* lane_v)
+{
+	__m256 e1x = _mm256_load_ps(e1[0]), e1y = _mm256_load_ps(e1[1]), e1z = _mm256_load_ps(e1[2]);
+	__m256 e2x = _mm256_load_ps(e2[0]), e2y = _mm256_load_ps(e2[1]), e2z = _mm256_load_ps(e2[2]);
+
+	__m256 px = _mm256_sub_ps(_mm256_mul_ps(direction[1], e2z), _mm256_mul_ps(direction[2], e2y));
+	__m256 py = _mm256_sub_ps(_mm256_mul_ps(direction[2], e2x), _mm256_mul_ps(direction[0], e2z));
+	__m256 pz = _mm256_sub_ps(_mm256_mul_ps(direction[0], e2y), _mm256_mul_ps(direction[1], e2x));
+	__m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+	__m256 valid = _mm256_or_ps(_mm256_cmp_ps(det, _mm256_set1_ps(-1e-8f), _CMP_LE_OQ), _mm256_cmp_ps(det, _mm256_set1_ps(1e-8f), _CMP_GE_OQ));
+
+	__m256 tx = _mm256_sub_ps(origin[0], _mm256_load_ps(v0[0]));
+	__m256 ty = _mm256_sub_ps(origin[1], _mm256_load_ps(v0[1]));
+	__m256 tz = _mm256_sub_ps(origin[2], _mm256_load_ps(v0[2]));
+	__m256 u = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tz, pz)), det);
+	valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(u, _mm256_setzero_ps(), _CMP_GE_OQ), _mm256_cmp_ps(u, _mm256_set1_ps(1.f), _CMP_LE_OQ)));
+
+	__m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y));
+	__m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+	__m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+	__m256 v = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(direction[0], qx), _mm256_mul_ps(direction[1], qy)), _mm256_mul_ps(direction[2], qz)), det);
+	valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(v, _mm256_setzero_ps(), _CMP_GE_OQ), _mm256_cmp_ps(_mm256_add_ps(u, v), _mm256_set1_ps(1.f), _CMP_LE_OQ)));
+
+	__m256 t = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), det);
+	valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t, _mm256_set1_ps(t_min), _CMP_GT_OQ), _mm256_cmp_ps(t, _mm256_set1_ps(t_max), _CMP_LT_OQ)));
+
+	_mm256_store_ps(lane_t, t);
+	_mm256_store_ps(lane_u, u);
+	_mm256_store_ps(lane_v, v);
+	return static_cast<unsigned int>(_mm256_movemask_ps(valid));
+}
+#endif
+
+template<int N>
+int IntersectTriangleBlock(const TriangleBlock<N>& block, const BlockRay& ray, const float t_min, const float t_max, IntersectableData& data)
+{
+	alignas(32) float lane_t[N];
+	alignas(32) float lane_u[N];
+	alignas(32) float lane_v[N];
+	unsigned int mask = 0;
+
+#if SIMD_AVX2
+	const int step = N >= 8 ? 8 : 4;
+#else
+	const int step = 4;
+#endif
+	for (int offset = 0; offset < N; offset += step)
+	{
+		const float* v0[3] = { block.v0[0] + offset, block.v0[1] + offset, block.v0[2] + offset };
+		const float* e1[3] = { block.e1[0] + offset, block.e1[1] + offset, block.e1[2] + offset };
+		const float* e2[3] = { block.e2[0] + offset, block.e2[1] + offset, block.e2[2] + offset };
+#if SIMD_AVX2
+		if (step == 8)
+		{
+			mask |= IntersectLanes(v0, e1, e2, ray.origin8, ray.direction8, t_min, t_max, lane_t + offset, lane_u + offset, lane_v + offset) << offset;
+			continue;
+		}
+#endif
+		mask |= IntersectLanes(v0, e1, e2, ray.origin, ray.direction, t_min, t_max, lane_t + offset, lane_u + offset, lane_v + offset) << offset;
+	}
+
+	// The lowest lane wins a tie, as the first triangle does in the scalar loop
+	int nearest = -1;
+	float nearest_t = t_max;
+	while (mask)
+	{
+		int lane = LowestBit(mask);
+		mask &= mask - 1;
+		if (lane_t[lane] < nearest_t)
+		{
+			nearest = lane;
+			nearest_t = lane_t[lane];
+		}
+	}
+
+	if (nearest >= 0)
+	{
+		float u = lane_u[nearest];
+		float v = lane_v[nearest];
+		data = IntersectableData(lane_t[nearest], float3{ 1.f - u - v, u, v });
+	}
+	return nearest;
+}
+
+template<int N>
+bool OccludedTriangleBlock(const TriangleBlock<N>& block, const BlockRay& ray, const float t_min, const float t_max)
+{
+	alignas(32) float lane_t[8];
+	alignas(32) float lane_u[8];
+	alignas(32) float lane_v[8];
+
+#if SIMD_AVX2
+	const int step = N >= 8 ? 8 : 4;
+#else
+	const int step = 4;
+#endif
+	for (int offset = 0; offset < N; offset += step)
+	{
+		const float* v0[3] = { block.v0[0] + offset, block.v0[1] + offset, block.v0[2] + offset };
+		const float* e1[3] = { block.e1[0] + offset, block.e1[1] + offset, block.e1[2] + offset };
+		const float* e2[3] = { block.e2[0] + offset, block.e2[1] + offset, block.e2[2] + offset };
+		unsigned int mask = 0;
+#if SIMD_AVX2
+		if (step == 8)
+		{
+			mask = IntersectLanes(v0, e1, e2, ray.origin8, ray.direction8, t_min, t_max, lane_t, lane_u, lane_v);
+		}
+		else
+#endif
+		{
+			mask = IntersectLanes(v0, e1, e2, ray.origin, ray.direction, t_min, t_max, lane_t, lane_u, lane_v);
+		}
+		if (mask)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+template class TriangleBlock<4>;
+template class TriangleBlock<8>;
+template class TriangleBlock<16>;
+template int IntersectTriangleBlock<4>(const TriangleBlock<4>&, const BlockRay&, const float, const float, IntersectableData&);
+template int IntersectTriangleBlock<8>(const TriangleBlock<8>&, const BlockRay&, const float, const float, IntersectableData&);
+template int IntersectTriangleBlock<16>(const TriangleBlock<16>&, const BlockRay&, const float, const float, IntersectableData&);
+template bool OccludedTriangleBlock<4>(const TriangleBlock<4>&, const BlockRay&, const float, const float);
+template bool OccludedTriangleBlock<8>(const TriangleBlock<8>&, const BlockRay&, const float, const float);
+template bool OccludedTriangleBlock<16>(const TriangleBlock<16>&, const BlockRay&, const float, const float);
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "lighting.h"
+#include "simd.h"
+
+// N triangles stored as structure of arrays for the SIMD Moller-Trumbore kernel.
+// Unused lanes have zero edges, so their determinant is zero and they never hit.
+template<int N>
+class alignas(64) TriangleBlock
+{
+public:
+	TriangleBlock();
+
+	void Set(int lane, const Triangle& triangle, unsigned int triangle_id);
+	void Set(int lane, const float3& a, const float3& b, const float3& c, unsigned int triangle_id);
+
+	// x, y, z of the first vertex and of the two edges leaving it
+	float v0[3][N];
+	float e1[3][N];
+	float e2[3][N];
+	unsigned int id[N];
+};
+
+// Ray splatted across SIMD lanes
+class BlockRay
+{
+public:
+	BlockRay(const Ray& ray);
+
+	__m128 origin[3];
+	__m128 direction[3];
+#if SIMD_AVX2
+	__m256 origin8[3];
+	__m256 direction8[3];
+#endif
+};
+
+// Intersects the ray with all triangles of the block at once. Returns the lane of
+// the nearest hit in (t_min, t_max) and its t and barycentrics, or -1 on a miss.
+template<int N>
+int IntersectTriangleBlock(const TriangleBlock<N>& block, const BlockRay& ray, const float t_min, const float t_max, IntersectableData& data);
+
+// True if any triangle of the block is hit in (t_min, t_max)
+template<int N>
+bool OccludedTriangleBlock(const TriangleBlock<N>& block, const BlockRay& ray, const float t_min, const float t_max);
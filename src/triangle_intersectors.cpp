@@ -0,0 +1,102 @@
+#include "triangle_intersectors.h"
+
+#include <algorithm>
+#include <cmath>
+
+AffineTriangle::AffineTriangle(const float3& a, const float3& b, const float3& c)
+{
+	// Rows of the inverse of the matrix with columns e1, e2 and n
+	float3 e1 = b - a;
+	float3 e2 = c - a;
+	float3 n = cross(e1, e2);
+	float det = dot(n, n);
+	if (det == 0.f || !std::isfinite(det))
+	{
+		rows[0][3] = -1.f;
+		return;
+	}
+	float3 row[3] = { cross(e2, n) / det, cross(n, e1) / det, n / det };
+	for (int i = 0; i < 3; i++)
+	{
+		rows[i][0] = row[i].x;
+		rows[i][1] = row[i].y;
+		rows[i][2] = row[i].z;
+		rows[i][3] = -dot(row[i], a);
+	}
+}
+
+IntersectableData AffineTriangle::Intersect(const Ray& ray) const
+{
+	const float3& o = ray.position;
+	const float3& d = ray.direction;
+	float origin_z = rows[2][0] * o.x + rows[2][1] * o.y + rows[2][2] * o.z + rows[2][3];
+	float direction_z = rows[2][0] * d.x + rows[2][1] * d.y + rows[2][2] * d.z;
+	// Parallel rays and degenerate triangles give a t that fails the caller's range check
+	float t = -origin_z / direction_z;
+
+	float3 p = o + d * t;
+	float u = rows[0][0] * p.x + rows[0][1] * p.y + rows[0][2] * p.z + rows[0][3];
+	if (u < 0 || u > 1)
+	{
+		return IntersectableData(-1.f);
+	}
+	float v = rows[1][0] * p.x + rows[1][1] * p.y + rows[1][2] * p.z + rows[1][3];
+	if (v < 0 || u + v > 1)
+	{
+		return IntersectableData(-1.f);
+	}
+	return IntersectableData(t, float3{ 1.f - u - v, u, v });
+}
+
+WatertightRay::WatertightRay(const Ray& ray) : origin(ray.position)
+{
+	const float3& d = ray.direction;
+	float3 magnitude{ std::abs(d.x), std::abs(d.y), std::abs(d.z) };
+	kz = magnitude.x > magnitude.y ? (magnitude.x > magnitude.z ? 0 : 2) : (magnitude.y > magnitude.z ? 1 : 2);
+	kx = (kz + 1) % 3;
+	ky = (kx + 1) % 3;
+	// Keeps the winding of the triangles after the permutation
+	if (d[kz] < 0.f)
+	{
+		std::swap(kx, ky);
+	}
+	shear_x = d[kx] / d[kz];
+	shear_y = d[ky] / d[kz];
+	shear_z = 1.f / d[kz];
+}
+
+IntersectableData WatertightRay::Intersect(const float3& a, const float3& b, const float3& c) const
+{
+	const float3 A = a - origin;
+	const float3 B = b - origin;
+	const float3 C = c - origin;
+	const float ax = A[kx] - shear_x * A[kz];
+	const float ay = A[ky] - shear_y * A[kz];
+	const float bx = B[kx] - shear_x * B[kz];
+	const float by = B[ky] - shear_y * B[kz];
+	const float cx = C[kx] - shear_x * C[kz];
+	const float cy = C[ky] - shear_y * C[kz];
+
+	float u = cx * by - cy * bx;
+	float v = ax * cy - ay * cx;
+	float w = bx * ay - by * ax;
+	// On an edge the float products can round either way, double settles the sign
+	if (u == 0.f || v == 0.f || w == 0.f)
+	{
+		u = static_cast<float>(static_cast<double>(cx) * by - static_cast<double>(cy) * bx);
+		v = static_cast<float>(static_cast<double>(ax) * cy - static_cast<double>(ay) * cx);
+		w = static_cast<float>(static_cast<double>(bx) * ay - static_cast<double>(by) * ax);
+	}
+	if ((u < 0.f || v < 0.f || w < 0.f) && (u > 0.f || v > 0.f || w > 0.f))
+	{
+		return IntersectableData(-1.f);
+	}
+	float det = u + v + w;
+	if (det == 0.f)
+	{
+		return IntersectableData(-1.f);
+	}
+
+	float t = (u * shear_z * A[kz] + v * shear_z * B[kz] + w * shear_z * C[kz]) / det;
+	return IntersectableData(t, float3{ u / det, v / det, w / det });
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "mt_algorithm.h"
+
+// Ray-triangle test used by the scalar leaf intersection of the BVH
+enum class TriangleIntersector
+{
+	// Edges and determinant computed per test, rejects determinants below 1e-8
+	MollerTrumbore,
+	// Precomputed transform onto the unit triangle, 48 bytes per leaf entry
+	Affine,
+	// Shear-based test with a per-ray setup that never misses at shared edges
+	Watertight
+};
+
+// Affine transform that maps the triangle onto the unit triangle (0,0,0), (1,0,0),
+// (0,1,0) and its normal onto z (Woop). A test is three dot products and a division,
+// without cross products. Degenerate triangles get a transform that never hits.
+class AffineTriangle
+{
+public:
+	AffineTriangle() {};
+	AffineTriangle(const float3& a, const float3& b, const float3& c);
+
+	IntersectableData Intersect(const Ray& ray) const;
+
+	// x, y, z and translation of the rows giving u, v and the signed distance
+	float rows[3][4] = {};
+};
+
+// Per-ray setup of the watertight test (Woop, Benthin and Wald 2013): the ray is
+// turned into +z by a permutation and a shear, the triangle is then tested in 2D
+// with edge functions whose sign is consistent between neighbouring triangles.
+class WatertightRay
+{
+public:
+	WatertightRay(const Ray& ray);
+
+	IntersectableData Intersect(const float3& a, const float3& b, const float3& c) const;
+
+	float3 origin;
+	int kx = 0;
+	int ky = 1;
+	int kz = 2;
+	float shear_x = 0.f;
+	float shear_y = 0.f;
+	float shear_z = 1.f;
+};
@@ -20,4 +20,65 @@ TEST_CASE("AABB test") {
 	};
 
 	REQUIRE(validate_framebuffer("references/aabb.png", render->GetFrameBuffer()));
-}
\ No newline at end of file
+}
+
+TEST_CASE("OBJ loader") {
+	const std::vector<std::string> models = {
+		"CornellBox-Empty-CO", "CornellBox-Glossy", "CornellBox-Original", "CornellBox-Sphere", "CornellBox-Water", "water" };
+	for (auto& model : models)
+	{
+		ObjModel loaded;
+		std::string warning;
+		std::string error;
+		REQUIRE(LoadObj("models/" + model + ".obj", loaded, warning, error));
+		CHECK(loaded.triangles.size() == loaded.report.triangle_count);
+		CHECK(loaded.mesh_offsets.back() == loaded.report.triangle_count);
+		std::cout << model << ": " << loaded.report << std::endl;
+
+		BENCHMARK("Load " + model)
+		{
+			return LoadObj("models/" + model + ".obj", loaded, warning, error);
+		};
+	}
+
+	// A grid large enough to be split into chunks, with groups and relative indices
+	const std::string grid_file = "models/obj-loader-test.obj";
+	const int grid_size = 400;
+	{
+		std::ofstream grid(grid_file);
+		grid << "mtllib CornellBox-Original.mtl\n";
+		for (int row = 0; row < grid_size; row++)
+		{
+			grid << "g row" << row << "\nusemtl " << (row % 2 ? "leftWall" : "rightWall") << "\n";
+			for (int column = 0; column < grid_size; column++)
+			{
+				grid << "v " << column << " " << row << " 0\nv " << column + 1 << " " << row << " 0\n"
+					<< "v " << column + 1 << " " << row + 1 << " 0\nv " << column << " " << row + 1 << " 0\n"
+					<< "f -4 -3 -2 -1\n";
+			}
+		}
+	}
+	ObjModel grid;
+	std::string warning;
+	std::string error;
+	REQUIRE(LoadObj(grid_file, grid, warning, error));
+	CHECK(warning.empty());
+	CHECK(grid.report.triangle_count == 2 * grid_size * grid_size);
+	CHECK(grid.report.mesh_count == grid_size);
+	std::cout << "Grid: " << grid.report << std::endl;
+	for (int row = 0; row < grid_size; row++)
+	{
+		// The quad of the last column of the row, split into a fan
+		const MaterialTriangle& triangle = grid.triangles[grid.mesh_offsets[row + 1] - 1];
+		CHECK(triangle.a.position == float3(grid_size - 1.f, static_cast<float>(row), 0.f));
+		CHECK(triangle.c.position == float3(grid_size - 1.f, row + 1.f, 0.f));
+		CHECK(triangle.diffuse_color == grid.triangles[grid.mesh_offsets[row]].diffuse_color);
+		CHECK(triangle.diffuse_color != grid.triangles[grid.mesh_offsets[(row + 1) % grid_size]].diffuse_color);
+	}
+
+	BENCHMARK("Load grid")
+	{
+		return LoadObj(grid_file, grid, warning, error);
+	};
+	std::remove(grid_file.c_str());
+}
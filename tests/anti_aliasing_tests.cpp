@@ -20,4 +20,38 @@ TEST_CASE("Anti-aliasings test") {
     };
 
     REQUIRE(validate_framebuffer("references/anti_aliasing.png", render->GetFrameBuffer()));
-}
\ No newline at end of file
+}
+
+TEST_CASE("Edge-adaptive anti-aliasing") {
+    AntiAliasing* render = new AntiAliasing(1920, 1080);
+    REQUIRE(render->LoadGeometry("models/CornellBox-Mirror.obj") == 0);
+    render->SetCamera(float3{ -0.5f, 0.99f, 1.5f }, float3{ 0, 0.99f, -1 }, float3{ 0, 1, 0 });
+    render->AddLight(new Light(float3{ 0, 1.98f, -0.06f }, float3{ 0.78f, 0.78f, 0.78f }));
+    render->Clear();
+
+    BENCHMARK("Fixed 2x2")
+    {
+        render->DrawScene();
+    };
+    std::vector<byte3> fixed = render->GetFrameBuffer();
+
+    render->SetEdgeAdaptive(4);
+    BENCHMARK("Edge-adaptive")
+    {
+        render->DrawScene();
+    };
+    std::vector<byte3> adaptive = render->GetFrameBuffer();
+    const EdgeAdaptiveReport& report = render->GetEdgeAdaptiveReport();
+    std::cout << report;
+
+    // Flat areas get the center sample instead of the average of the grid
+    size_t different = 0;
+    for (size_t i = 0; i < fixed.size(); i++)
+    {
+        int3 difference = abs(int3(fixed[i]) - int3(adaptive[i]));
+        different += std::max(difference.x, std::max(difference.y, difference.z)) > 8 ? 1 : 0;
+    }
+    CHECK(different < fixed.size() / 100);
+    CHECK(report.refined_pixels < report.pixel_count / 4);
+    CHECK(report.rays < report.fixed_rays / 2);
+}
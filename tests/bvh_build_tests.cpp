@@ -0,0 +1,458 @@
+#define CATCH_CONFIG_MAIN
+#define CATCH_CONFIG_ENABLE_BENCHMARKING
+#include "catch.hpp"
+
+#include "test_utils.h"
+
+#include "bvh.h"
+#include "obj_loader.h"
+
+#include <fstream>
+#include <omp.h>
+
+TEST_CASE("BVH build time and quality") {
+    const std::vector<std::string> models = {
+        "CornellBox-Empty-CO", "CornellBox-Empty-RG", "CornellBox-Empty-Squashed", "CornellBox-Empty-White",
+        "CornellBox-Glossy-Floor", "CornellBox-Glossy", "CornellBox-Mirror", "CornellBox-Original",
+        "CornellBox-Sphere", "CornellBox-Water", "water" };
+
+    for (auto& model : models)
+    {
+        BVH* render = new BVH(1920, 1080);
+        int result = render->LoadGeometry("models/" + model + ".obj");
+        REQUIRE(result == 0);
+
+        for (BVHBuildMode mode : { BVHBuildMode::SAH, BVHBuildMode::LBVH, BVHBuildMode::SBVH })
+        {
+            const char* mode_names[] = { " binned SAH", " LBVH", " SBVH" };
+            const std::string name = model + mode_names[static_cast<int>(mode)];
+            render->SetBuildMode(mode);
+
+            BENCHMARK(name)
+            {
+                render->BuildBVH();
+            };
+
+            render->BuildBVH();
+            const BVHBuildReport& report = render->GetBuildReport();
+            CHECK(report.leaf_count > 0);
+            CHECK(report.leaf_count * 2 - 1 == report.node_count);
+            std::cout << name << ": " << report.triangle_count << " triangles, "
+                << report.reference_count << " references, "
+                << report.build_time_ms << " ms, SAH cost " << report.sah_cost
+                << ", overlap " << report.overlap << std::endl;
+        }
+        delete render;
+    }
+}
+
+TEST_CASE("Indexed geometry memory") {
+    const std::vector<std::string> models = {
+        "CornellBox-Empty-CO", "CornellBox-Empty-RG", "CornellBox-Empty-Squashed", "CornellBox-Empty-White",
+        "CornellBox-Glossy-Floor", "CornellBox-Glossy", "CornellBox-Mirror", "CornellBox-Original",
+        "CornellBox-Sphere", "CornellBox-Water", "water" };
+
+    for (auto& model : models)
+    {
+        BVH* render = new BVH(1920, 1080);
+        int result = render->LoadGeometry("models/" + model + ".obj");
+        REQUIRE(result == 0);
+
+        const GeometryMemoryReport report = render->GetMemoryReport();
+        CHECK(report.triangle_count > 0);
+        CHECK(report.vertex_count <= 3 * report.triangle_count);
+        CHECK(report.IndexedBytesPerTriangle() < report.MaterialTriangleBytesPerTriangle());
+        std::cout << model << ": " << report << std::endl;
+        delete render;
+    }
+}
+
+TEST_CASE("LBVH test") {
+    BVH* render = new BVH(1920, 1080);
+    int result = render->LoadGeometry("models/CornellBox-Sphere.obj");
+    REQUIRE(result == 0);
+    render->SetCamera(float3{ 0.0f, 0.795f, 1.6f }, float3{ 0, 0.795f, -1 }, float3{ 0, 1, 0 });
+    render->AddLight(new Light(float3{ 0, 1.58f, -0.03f }, float3{ 0.78f, 0.78f, 0.78f }));
+    render->SetBuildMode(BVHBuildMode::LBVH);
+    render->BuildBVH();
+    render->Clear();
+    render->DrawScene();
+
+    REQUIRE(validate_framebuffer("references/bvh.png", render->GetFrameBuffer()));
+    delete render;
+}
+
+TEST_CASE("SBVH test") {
+    BVH* render = new BVH(1920, 1080);
+    int result = render->LoadGeometry("models/CornellBox-Sphere.obj");
+    REQUIRE(result == 0);
+    render->SetCamera(float3{ 0.0f, 0.795f, 1.6f }, float3{ 0, 0.795f, -1 }, float3{ 0, 1, 0 });
+    render->AddLight(new Light(float3{ 0, 1.58f, -0.03f }, float3{ 0.78f, 0.78f, 0.78f }));
+    render->SetBuildMode(BVHBuildMode::SBVH);
+    render->BuildBVH();
+    render->Clear();
+    render->DrawScene();
+
+    REQUIRE(validate_framebuffer("references/bvh.png", render->GetFrameBuffer()));
+    delete render;
+}
+
+TEST_CASE("Parallel BVH build") {
+    // The top levels are split side by side, which must not change a single node
+    const int max_threads = omp_get_max_threads();
+    for (BVHBuildMode mode : { BVHBuildMode::SAH, BVHBuildMode::LBVH })
+    {
+        BVHBuildReport reports[2];
+        std::vector<byte3> frames[2];
+        for (int run = 0; run < 2; run++)
+        {
+            omp_set_num_threads(run == 0 ? 1 : 4);
+            BVH* render = new BVH(320, 180);
+            REQUIRE(render->LoadGeometry("models/CornellBox-Water.obj") == 0);
+            render->SetCamera(float3{ 0.0f, 0.795f, 1.6f }, float3{ 0, 0.795f, -1 }, float3{ 0, 1, 0 });
+            render->AddLight(new Light(float3{ 0, 1.58f, -0.03f }, float3{ 0.78f, 0.78f, 0.78f }));
+            render->SetBuildMode(mode);
+            render->SetLeafSize(1);
+            render->BuildBVH();
+            render->Clear();
+            render->DrawScene();
+            reports[run] = render->GetBuildReport();
+            frames[run] = render->GetFrameBuffer();
+            delete render;
+        }
+        CHECK(reports[0].node_count == reports[1].node_count);
+        CHECK(reports[0].max_depth == reports[1].max_depth);
+        CHECK(reports[0].sah_cost == reports[1].sah_cost);
+        CHECK(frames[0] == frames[1]);
+    }
+    omp_set_num_threads(max_threads);
+}
+
+TEST_CASE("SBVH duplication budget") {
+    for (const std::string model : { "CornellBox-Water", "water" })
+    {
+        BVH* render = new BVH(1920, 1080);
+        int result = render->LoadGeometry("models/" + model + ".obj");
+        REQUIRE(result == 0);
+        render->SetCamera(float3{ 0.0f, 0.795f, 1.6f }, float3{ 0, 0.795f, -1 }, float3{ 0, 1, 0 });
+
+        render->SetBuildMode(BVHBuildMode::SAH);
+        render->BuildBVH();
+        const float object_split_cost = render->GetBuildReport().sah_cost;
+
+        render->SetBuildMode(BVHBuildMode::SBVH);
+        for (float budget : { 0.f, 0.1f, 0.3f, 1.f })
+        {
+            render->SetSpatialSplitBudget(budget);
+            render->BuildBVH();
+            const BVHBuildReport& report = render->GetBuildReport();
+            CHECK(report.reference_count <= report.triangle_count * (1.f + budget));
+            if (budget == 0.f)
+            {
+                // Without duplication the spatial split builder makes the object split tree
+                CHECK(report.spatial_split_count == 0);
+                CHECK(report.sah_cost == object_split_cost);
+            }
+
+            BENCHMARK(model + " SBVH budget " + std::to_string(budget))
+            {
+                return render->MeasurePrimaryRays();
+            };
+
+            BVHTraversalStats stats = render->MeasurePrimaryRays();
+            std::cout << model << " SBVH budget " << budget << ": "
+                << report.reference_count - report.triangle_count << " duplicates, "
+                << report.spatial_split_count << " spatial splits, SAH cost " << report.sah_cost
+                << ", overlap " << report.overlap << ", "
+                << stats.StepsPerRay() << " nodes/ray, "
+                << stats.RaysPerSecond() / 1e6 << " Mrays/s" << std::endl;
+        }
+        delete render;
+    }
+}
+
+TEST_CASE("BVH refit") {
+    BVH* render = new BVH(1920, 1080);
+    int result = render->LoadGeometry("models/CornellBox-Sphere.obj");
+    REQUIRE(result == 0);
+    render->SetCamera(float3{ 0.0f, 0.795f, 1.6f }, float3{ 0, 0.795f, -1 }, float3{ 0, 1, 0 });
+    render->AddLight(new Light(float3{ 0, 1.58f, -0.03f }, float3{ 0.78f, 0.78f, 0.78f }));
+    render->BuildBVH();
+
+    // The spheres are the meshes with the most triangles, animate the first one
+    unsigned int sphere = 0;
+    for (unsigned int mesh = 1; mesh < render->GetMeshCount(); mesh++)
+    {
+        if (render->GetMeshTriangleCount(mesh) > render->GetMeshTriangleCount(sphere))
+        {
+            sphere = mesh;
+        }
+    }
+    const std::vector<float3> rest_positions = render->GetMeshPositions(sphere);
+    auto frame_positions = [&](int frame) {
+        float3 offset{ 0.6f * std::sin(frame * 0.3f), 0.4f * std::abs(std::sin(frame * 0.5f)), 0.f };
+        std::vector<float3> positions(rest_positions.size());
+        for (size_t i = 0; i < positions.size(); i++)
+        {
+            positions[i] = rest_positions[i] + offset;
+        }
+        return positions;
+    };
+
+    // The same animation once with updates, which degrade the tree over the
+    // frames, and once with a full rebuild per frame
+    const int frame_count = 30;
+    double update_time_ms = 0.0;
+    unsigned int rebuilds = 0;
+    for (int frame = 0; frame < frame_count; frame++)
+    {
+        render->UpdateMesh(sphere, frame_positions(frame));
+        render->UpdateBVH();
+        const BVHUpdateReport& update = render->GetUpdateReport();
+        CHECK(update.refit_blas_count == 1);
+        update_time_ms += update.update_time_ms;
+        rebuilds += update.rebuilt_blas_count;
+        std::cout << "Frame " << frame << ": update " << update.update_time_ms << " ms, SAH growth "
+            << update.max_sah_growth << (update.rebuilt_blas_count > 0 ? ", rebuilt" : "") << std::endl;
+    }
+    double rebuild_time_ms = 0.0;
+    for (int frame = 0; frame < frame_count; frame++)
+    {
+        render->UpdateMesh(sphere, frame_positions(frame));
+        render->BuildBVH();
+        rebuild_time_ms += render->GetBuildReport().build_time_ms;
+    }
+    std::cout << "Average per frame: update " << update_time_ms / frame_count << " ms with "
+        << rebuilds << " rebuilds, full rebuild " << rebuild_time_ms / frame_count << " ms" << std::endl;
+
+    BENCHMARK("Sphere refit")
+    {
+        render->UpdateMesh(sphere, frame_positions(7));
+        render->UpdateBVH();
+    };
+    BENCHMARK("Sphere rebuild")
+    {
+        render->UpdateMesh(sphere, frame_positions(7));
+        render->BuildBVH();
+    };
+
+    // A refitted tree finds the same hits as a fresh one
+    render->UpdateMesh(sphere, frame_positions(0));
+    render->BuildBVH();
+    render->UpdateMesh(sphere, frame_positions(11));
+    render->UpdateBVH();
+    render->Clear();
+    render->DrawScene();
+    std::vector<byte3> refitted = render->GetFrameBuffer();
+    render->BuildBVH();
+    render->Clear();
+    render->DrawScene();
+    CHECK(refitted == render->GetFrameBuffer());
+
+    // Forcing rebuilds on any degradation still gives the same image
+    render->SetRebuildThreshold(1.f);
+    render->UpdateMesh(sphere, frame_positions(3));
+    render->UpdateBVH();
+    render->Clear();
+    render->DrawScene();
+    refitted = render->GetFrameBuffer();
+    render->BuildBVH();
+    render->Clear();
+    render->DrawScene();
+    CHECK(refitted == render->GetFrameBuffer());
+    delete render;
+}
+
+TEST_CASE("BVH refit of one BLAS among several") {
+    // Three models side by side, the middle one moves. Its blocks and wide nodes are
+    // made again in place, the ones of the models around it must still be found.
+    for (unsigned int branching_factor : { 2u, 4u, 8u })
+    {
+        for (bool quantized : { false, true })
+        {
+            for (unsigned int block_width : { 0u, 4u, 16u })
+            {
+                BVH* render = new BVH(320, 180);
+                for (int model = 0; model < 3; model++)
+                {
+                    REQUIRE(render->LoadGeometry("models/CornellBox-Sphere.obj") == 0);
+                    render->AddInstance(model, linalg::translation_matrix(float3{ 2.2f * (model - 1), 0.f, 0.f }));
+                }
+                render->SetCamera(float3{ 0.0f, 0.795f, 4.5f }, float3{ 0, 0.795f, -1 }, float3{ 0, 1, 0 });
+                render->AddLight(new Light(float3{ 0, 1.58f, -0.03f }, float3{ 0.78f, 0.78f, 0.78f }));
+                render->SetBranchingFactor(branching_factor);
+                render->SetQuantizedNodes(quantized);
+                render->SetTriangleBlockWidth(block_width);
+                render->SetTriangleIntersector(TriangleIntersector::Affine);
+                render->BuildBVH();
+
+                const unsigned int model_meshes = render->GetMeshCount() / 3;
+                unsigned int sphere = model_meshes;
+                for (unsigned int mesh = model_meshes; mesh < 2 * model_meshes; mesh++)
+                {
+                    if (render->GetMeshTriangleCount(mesh) > render->GetMeshTriangleCount(sphere))
+                    {
+                        sphere = mesh;
+                    }
+                }
+                std::vector<float3> positions = render->GetMeshPositions(sphere);
+                for (float3& position : positions)
+                {
+                    position += float3{ 0.4f, 0.3f, 0.f };
+                }
+
+                // Once refitted, once rebuilt, which changes the node and block counts
+                for (float threshold : { 100.f, 1.f })
+                {
+                    render->SetRebuildThreshold(threshold);
+                    render->UpdateMesh(sphere, positions);
+                    render->UpdateBVH();
+                    const BVHUpdateReport& update = render->GetUpdateReport();
+                    CHECK(update.refit_blas_count == 1);
+                    CHECK(update.rebuilt_blas_count == (threshold > 1.f ? 0u : 1u));
+                    CHECK(!update.full_rebuild);
+                    render->Clear();
+                    render->DrawScene();
+                    std::vector<byte3> updated = render->GetFrameBuffer();
+                    render->BuildBVH();
+                    render->Clear();
+                    render->DrawScene();
+                    CHECK(updated == render->GetFrameBuffer());
+                    for (float3& position : positions)
+                    {
+                        position += float3{ -0.6f, 0.f, 0.1f };
+                    }
+                }
+                delete render;
+            }
+        }
+    }
+}
+
+TEST_CASE("BVH scene cache") {
+    const std::string model = "models/CornellBox-Sphere.obj";
+    const std::string cache = "models/CornellBox-Sphere-test.bvhcache";
+
+    BVH* built = new BVH(1920, 1080);
+    int result = built->LoadGeometry(model);
+    REQUIRE(result == 0);
+    built->BuildBVH();
+    REQUIRE(built->SaveSceneCache(cache, model));
+
+    BVH* render = new BVH(1920, 1080);
+    REQUIRE(render->LoadSceneCache(cache, model));
+    const BVHBuildReport& report = render->GetBuildReport();
+    CHECK(report.cached);
+    CHECK(report.triangle_count == built->GetBuildReport().triangle_count);
+    CHECK(report.node_count == built->GetBuildReport().node_count);
+    CHECK(report.sah_cost == built->GetBuildReport().sah_cost);
+    CHECK(render->GetMeshCount() == built->GetMeshCount());
+    std::cout << "Parse and build " << built->GetBuildReport().build_time_ms << " ms, cache load "
+        << report.build_time_ms << " ms" << std::endl;
+
+    render->SetCamera(float3{ 0.0f, 0.795f, 1.6f }, float3{ 0, 0.795f, -1 }, float3{ 0, 1, 0 });
+    render->AddLight(new Light(float3{ 0, 1.58f, -0.03f }, float3{ 0.78f, 0.78f, 0.78f }));
+    render->Clear();
+    render->DrawScene();
+    REQUIRE(validate_framebuffer("references/bvh.png", render->GetFrameBuffer()));
+
+    BENCHMARK("Parse OBJ and build BVH")
+    {
+        BVH scene(1920, 1080);
+        scene.LoadGeometry(model);
+        scene.BuildBVH();
+        return scene.GetBuildReport().node_count;
+    };
+    BENCHMARK("Load scene cache")
+    {
+        BVH scene(1920, 1080);
+        scene.LoadSceneCache(cache, model);
+        return scene.GetBuildReport().node_count;
+    };
+
+    // A cache made with other build settings or from another file is not used
+    BVH* rejected = new BVH(1920, 1080);
+    rejected->SetBranchingFactor(4);
+    CHECK(!rejected->LoadSceneCache(cache, model));
+    rejected->SetBranchingFactor(2);
+    CHECK(!rejected->LoadSceneCache(cache, "models/CornellBox-Original.obj"));
+    CHECK(!rejected->LoadSceneCache("models/missing.bvhcache", model));
+    CHECK(rejected->GetMeshCount() == 0);
+    CHECK(rejected->LoadSceneCache(cache, model));
+
+    std::remove(cache.c_str());
+    delete rejected;
+    delete render;
+    delete built;
+}
+
+TEST_CASE("BVH scene cache follows the material library") {
+    const std::string model = "models/scene-cache-material.obj";
+    const std::string library = "models/scene-cache-material.mtl";
+    const std::string cache = "models/scene-cache-material.bvhcache";
+    std::ofstream(model) << "mtllib missing.mtl scene-cache-material.mtl\nusemtl red\n"
+        "v 0 0 0\nv 1 0 0\nv 0 1 0\nf 1 2 3\n";
+    std::ofstream(library) << "newmtl red\nKd 0.8 0.1 0.1\n";
+    CHECK(ObjMaterialLibraries(model) == std::vector<std::string>{ library });
+
+    BVH* built = new BVH(64, 64);
+    REQUIRE(built->LoadGeometry(model) == 0);
+    built->BuildBVH();
+    REQUIRE(built->SaveSceneCache(cache, model));
+    BVH* render = new BVH(64, 64);
+    CHECK(render->LoadSceneCache(cache, model));
+
+    // Editing only the material makes the cache stale too
+    std::ofstream(library) << "newmtl red\nKd 0.1 0.8 0.1\n";
+    BVH* rejected = new BVH(64, 64);
+    CHECK(!rejected->LoadSceneCache(cache, model));
+
+    std::remove(cache.c_str());
+    std::remove(library.c_str());
+    std::remove(model.c_str());
+    delete rejected;
+    delete render;
+    delete built;
+}
+
+TEST_CASE("BVH scene cache with damaged node") {
+    const std::string model = "models/CornellBox-Sphere.obj";
+    const std::string cache = "models/CornellBox-Sphere-damaged.bvhcache";
+
+    BVH* built = new BVH(1920, 1080);
+    int result = built->LoadGeometry(model);
+    REQUIRE(result == 0);
+    built->BuildBVH();
+
+    // A leaf offset of 0xffffffff wraps back into range when added to its count in 32 bits
+    for (bool leaf : { true, false })
+    {
+        REQUIRE(built->SaveSceneCache(cache, model));
+        std::fstream file(cache, std::ios::binary | std::ios::in | std::ios::out);
+        SceneCacheHeader header;
+        file.read(reinterpret_cast<char*>(&header), sizeof(SceneCacheHeader));
+        size_t offset = static_cast<size_t>(header.offsets[static_cast<int>(SceneCacheSection::Nodes)]);
+        size_t count = static_cast<size_t>(header.sizes[static_cast<int>(SceneCacheSection::Nodes)]) / sizeof(BVHNode);
+        std::vector<BVHNode> nodes(count);
+        file.seekg(offset);
+        file.read(reinterpret_cast<char*>(nodes.data()), count * sizeof(BVHNode));
+        size_t damaged = 0;
+        while (damaged < count && nodes[damaged].IsLeaf() != leaf)
+        {
+            damaged++;
+        }
+        REQUIRE(damaged < count);
+        nodes[damaged].offset = leaf ? 0xffffffffu : static_cast<unsigned int>(count + 1);
+        file.seekp(offset + damaged * sizeof(BVHNode));
+        file.write(reinterpret_cast<const char*>(&nodes[damaged]), sizeof(BVHNode));
+        file.close();
+
+        BVH* damaged_scene = new BVH(1920, 1080);
+        CHECK(!damaged_scene->LoadSceneCache(cache, model));
+        CHECK(damaged_scene->GetMeshCount() == 0);
+        delete damaged_scene;
+    }
+
+    std::remove(cache.c_str());
+    delete built;
+}
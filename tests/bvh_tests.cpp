@@ -12,12 +12,381 @@ TEST_CASE("BVH test") {
     REQUIRE(result == 0);
     render->SetCamera(float3{ 0.0f, 0.795f, 1.6f }, float3{ 0, 0.795f, -1 }, float3{ 0, 1, 0 });
     render->AddLight(new Light(float3{ 0, 1.58f, -0.03f }, float3{ 0.78f, 0.78f, 0.78f }));
+    render->BuildBVH();
     render->Clear();
 
+    const BVHBuildReport& report = render->GetBuildReport();
+    CHECK(report.leaf_count > 0);
+    CHECK(report.max_leaf_size <= 4);
+
     BENCHMARK("BVH scene")
     {
         render->DrawScene();
     };
 
     REQUIRE(validate_framebuffer("references/bvh.png", render->GetFrameBuffer()));
-}
\ No newline at end of file
+}
+
+TEST_CASE("BVH branching factor") {
+    const std::vector<std::string> models = {
+        "CornellBox-Empty-CO", "CornellBox-Empty-RG", "CornellBox-Empty-Squashed", "CornellBox-Empty-White",
+        "CornellBox-Glossy-Floor", "CornellBox-Glossy", "CornellBox-Mirror", "CornellBox-Original",
+        "CornellBox-Sphere", "CornellBox-Water" };
+
+    for (auto& model : models)
+    {
+        BVH* render = new BVH(1920, 1080);
+        int result = render->LoadGeometry("models/" + model + ".obj");
+        REQUIRE(result == 0);
+        render->SetCamera(float3{ 0.0f, 0.795f, 1.6f }, float3{ 0, 0.795f, -1 }, float3{ 0, 1, 0 });
+
+        for (unsigned int factor : { 2u, 4u, 8u })
+        {
+            render->SetBranchingFactor(factor);
+            render->BuildBVH();
+
+            BENCHMARK(model + " BVH" + std::to_string(factor))
+            {
+                return render->MeasurePrimaryRays();
+            };
+
+            BVHTraversalStats stats = render->MeasurePrimaryRays();
+            std::cout << model << " BVH" << factor << ": "
+                << stats.StepsPerRay() << " nodes/ray, "
+                << stats.RaysPerSecond() / 1e6 << " Mrays/s" << std::endl;
+        }
+        delete render;
+    }
+}
+
+TEST_CASE("Triangle blocks match the scalar path") {
+    BVH* render = new BVH(1920, 1080);
+    int result = render->LoadGeometry("models/CornellBox-Sphere.obj");
+    REQUIRE(result == 0);
+    render->SetCamera(float3{ 0.0f, 0.795f, 1.6f }, float3{ 0, 0.795f, -1 }, float3{ 0, 1, 0 });
+    render->AddLight(new Light(float3{ 0, 1.58f, -0.03f }, float3{ 0.78f, 0.78f, 0.78f }));
+    render->Clear();
+
+    render->SetTriangleBlockWidth(0);
+    render->BuildBVH();
+    render->DrawScene();
+    std::vector<byte3> scalar = render->GetFrameBuffer();
+
+    for (unsigned int width : { 4u, 8u, 16u })
+    {
+        render->SetTriangleBlockWidth(width);
+        render->SetLeafSize(width);
+        render->BuildBVH();
+
+        BENCHMARK("Triangle blocks of " + std::to_string(width))
+        {
+            render->DrawScene();
+        };
+
+        CHECK(render->GetFrameBuffer() == scalar);
+    }
+    delete render;
+}
+
+TEST_CASE("AVX2 wide traversal") {
+    // The BVH projects target AVX2, so 8-wide nodes and 8- and 16-wide triangle blocks
+    // are tested with single AVX2 instructions instead of two SSE halves
+    CHECK(SIMD_AVX2 == 1);
+
+    BVH* render = new BVH(1920, 1080);
+    int result = render->LoadGeometry("models/CornellBox-Sphere.obj");
+    REQUIRE(result == 0);
+    render->SetCamera(float3{ 0.0f, 0.795f, 1.6f }, float3{ 0, 0.795f, -1 }, float3{ 0, 1, 0 });
+    render->AddLight(new Light(float3{ 0, 1.58f, -0.03f }, float3{ 0.78f, 0.78f, 0.78f }));
+    render->Clear();
+
+    render->SetTriangleBlockWidth(0);
+    render->BuildBVH();
+    render->DrawScene();
+    std::vector<byte3> scalar = render->GetFrameBuffer();
+
+    render->SetBranchingFactor(8);
+    for (bool quantized : { false, true })
+    {
+        render->SetQuantizedNodes(quantized);
+        for (unsigned int width : { 0u, 8u, 16u })
+        {
+            render->SetTriangleBlockWidth(width);
+            render->BuildBVH();
+            render->DrawScene();
+            CHECK(render->GetFrameBuffer() == scalar);
+        }
+    }
+    delete render;
+}
+
+TEST_CASE("BVH shadow rays") {
+    BVH* render = new BVH(1920, 1080);
+    int result = render->LoadGeometry("models/CornellBox-Sphere.obj");
+    REQUIRE(result == 0);
+    render->SetCamera(float3{ 0.0f, 0.795f, 1.6f }, float3{ 0, 0.795f, -1 }, float3{ 0, 1, 0 });
+    const float3 light_position{ 0, 1.58f, -0.03f };
+
+    for (unsigned int factor : { 2u, 4u, 8u })
+    {
+        render->SetBranchingFactor(factor);
+        render->BuildBVH();
+
+        BENCHMARK("Shadow rays BVH" + std::to_string(factor))
+        {
+            return render->MeasureShadowRays(light_position);
+        };
+
+        BVHTraversalStats stats = render->MeasureShadowRays(light_position);
+        CHECK(stats.occluded > 0);
+        CHECK(stats.occluded < stats.rays);
+        std::cout << "Shadow rays BVH" << factor << ": "
+            << stats.RaysPerSecond() / 1e6 << " Mrays/s, "
+            << stats.occluded << " of " << stats.rays << " occluded" << std::endl;
+    }
+    delete render;
+}
+
+TEST_CASE("BVH ray packets") {
+    BVH* render = new BVH(1920, 1080);
+    int result = render->LoadGeometry("models/CornellBox-Sphere.obj");
+    REQUIRE(result == 0);
+    render->SetCamera(float3{ 0.0f, 0.795f, 1.6f }, float3{ 0, 0.795f, -1 }, float3{ 0, 1, 0 });
+    render->AddLight(new Light(float3{ 0, 1.58f, -0.03f }, float3{ 0.78f, 0.78f, 0.78f }));
+    render->BuildBVH();
+
+    // Packets are opt-in and trace the same samples as single rays
+    render->Clear();
+    render->DrawScene();
+    const std::vector<byte3> single_rays = render->GetFrameBuffer();
+
+    for (unsigned int size : { 0u, 4u, 8u })
+    {
+        render->SetPacketSize(size);
+
+        BENCHMARK("Primary rays, packets of " + std::to_string(size))
+        {
+            return render->MeasurePrimaryRays();
+        };
+
+        BVHTraversalStats stats = render->MeasurePrimaryRays();
+        std::cout << "Packets of " << size << ": "
+            << stats.StepsPerRay() << " nodes/ray, "
+            << stats.RaysPerSecond() / 1e6 << " Mrays/s" << std::endl;
+
+        render->Clear();
+        render->DrawScene();
+        CHECK(validate_framebuffer("references/bvh.png", render->GetFrameBuffer()));
+        CHECK(render->GetFrameBuffer() == single_rays);
+    }
+    delete render;
+}
+
+TEST_CASE("BVH instancing") {
+    // A translated copy seen from a translated camera renders the same image
+    const float3 offset{ 5, 0, -3 };
+    BVH* render = new BVH(1920, 1080);
+    int result = render->LoadGeometry("models/CornellBox-Sphere.obj");
+    REQUIRE(result == 0);
+    render->AddInstance(0, linalg::translation_matrix(offset));
+    render->SetCamera(float3{ 0.0f, 0.795f, 1.6f } + offset, float3{ 0, 0.795f, -1 } + offset, float3{ 0, 1, 0 });
+    render->AddLight(new Light(float3{ 0, 1.58f, -0.03f } + offset, float3{ 0.78f, 0.78f, 0.78f }));
+    render->BuildBVH();
+    render->Clear();
+    render->DrawScene();
+    CHECK(validate_framebuffer("references/bvh.png", render->GetFrameBuffer()));
+    const unsigned int model_triangles = render->GetBuildReport().triangle_count;
+
+    // A grid of copies shares the triangles of one model
+    render->ClearInstances();
+    for (int x = -5; x < 5; x++)
+    {
+        for (int z = -5; z < 5; z++)
+        {
+            render->AddInstance(0, linalg::translation_matrix(offset + float3{ x * 3.f, 0, z * 6.f }));
+        }
+    }
+    render->BuildBVH();
+    const BVHBuildReport& report = render->GetBuildReport();
+    CHECK(report.triangle_count == model_triangles);
+    CHECK(report.instance_count == 100);
+
+    BENCHMARK("100 instances")
+    {
+        return render->MeasurePrimaryRays();
+    };
+    delete render;
+}
+
+TEST_CASE("Triangle intersectors") {
+    const std::vector<std::string> models = {
+        "CornellBox-Empty-White", "CornellBox-Glossy", "CornellBox-Mirror", "CornellBox-Original",
+        "CornellBox-Sphere", "CornellBox-Water" };
+    const float3 camera_position{ 0.0f, 0.795f, 1.6f };
+    const char* names[] = { "Moller-Trumbore", "affine", "watertight" };
+
+    for (auto& model : models)
+    {
+        BVH* render = new BVH(1920, 1080);
+        int result = render->LoadGeometry("models/" + model + ".obj");
+        REQUIRE(result == 0);
+        render->SetCamera(camera_position, float3{ 0, 0.795f, -1 }, float3{ 0, 1, 0 });
+        render->SetTriangleBlockWidth(0);
+        render->SetPacketSize(0);
+
+        for (TriangleIntersector intersector : { TriangleIntersector::MollerTrumbore, TriangleIntersector::Affine, TriangleIntersector::Watertight })
+        {
+            const std::string name = model + " " + names[static_cast<int>(intersector)];
+            render->SetTriangleIntersector(intersector);
+            render->BuildBVH();
+
+            BENCHMARK(name)
+            {
+                return render->MeasurePrimaryRays();
+            };
+
+            BVHTraversalStats stats = render->MeasurePrimaryRays();
+            BVHTraversalStats leaks = render->MeasureEdgeLeaks(camera_position, 16);
+            CHECK(leaks.rays > 0);
+            if (intersector == TriangleIntersector::Watertight)
+            {
+                CHECK(leaks.leaked == 0);
+            }
+            std::cout << name << ": " << stats.RaysPerSecond() / 1e6 << " Mrays/s, "
+                << leaks.leaked << " of " << leaks.rays << " edge rays leaked" << std::endl;
+        }
+        delete render;
+    }
+}
+
+TEST_CASE("Triangle intersectors with triangle blocks") {
+    // The SoA blocks only run Moller-Trumbore, another intersector keeps the leaves scalar
+    const float3 camera_position{ 0.0f, 0.795f, 1.6f };
+    BVH* render = new BVH(1920, 1080);
+    int result = render->LoadGeometry("models/CornellBox-Original.obj");
+    REQUIRE(result == 0);
+    render->SetCamera(camera_position, float3{ 0, 0.795f, -1 }, float3{ 0, 1, 0 });
+    render->AddLight(new Light(float3{ 0, 1.58f, -0.03f }, float3{ 0.78f, 0.78f, 0.78f }));
+
+    for (TriangleIntersector intersector : { TriangleIntersector::Affine, TriangleIntersector::Watertight })
+    {
+        render->SetTriangleIntersector(intersector);
+        std::vector<byte3> frames[2];
+        unsigned long long leaked[2];
+        for (unsigned int width : { 0u, 8u })
+        {
+            render->SetTriangleBlockWidth(width);
+            render->BuildBVH();
+            render->Clear();
+            render->DrawScene();
+            frames[width == 0 ? 0 : 1] = render->GetFrameBuffer();
+            leaked[width == 0 ? 0 : 1] = render->MeasureEdgeLeaks(camera_position, 16).leaked;
+        }
+        CHECK(frames[0] == frames[1]);
+        CHECK(leaked[0] == leaked[1]);
+        if (intersector == TriangleIntersector::Watertight)
+        {
+            CHECK(leaked[1] == 0);
+        }
+    }
+    delete render;
+}
+
+TEST_CASE("Quantized BVH nodes") {
+    const std::vector<std::string> models = {
+        "CornellBox-Empty-White", "CornellBox-Glossy", "CornellBox-Mirror", "CornellBox-Original",
+        "CornellBox-Sphere", "CornellBox-Water" };
+
+    for (auto& model : models)
+    {
+        BVH* render = new BVH(1920, 1080);
+        int result = render->LoadGeometry("models/" + model + ".obj");
+        REQUIRE(result == 0);
+        render->SetCamera(float3{ 0.0f, 0.795f, 1.6f }, float3{ 0, 0.795f, -1 }, float3{ 0, 1, 0 });
+        render->AddLight(new Light(float3{ 0, 1.58f, -0.03f }, float3{ 0.78f, 0.78f, 0.78f }));
+
+        for (unsigned int factor : { 4u, 8u })
+        {
+            render->SetBranchingFactor(factor);
+            std::vector<byte3> full_precision;
+            size_t full_precision_bytes = 0;
+            for (bool quantized : { false, true })
+            {
+                const std::string name = model + " BVH" + std::to_string(factor) + (quantized ? " quantized" : "");
+                render->SetQuantizedNodes(quantized);
+                render->BuildBVH();
+
+                BENCHMARK(name)
+                {
+                    return render->MeasurePrimaryRays();
+                };
+
+                BVHTraversalStats stats = render->MeasurePrimaryRays();
+                std::cout << name << ": " << render->GetBuildReport().node_bytes / 1024.f << " KB of nodes, "
+                    << stats.RaysPerSecond() / 1e6 << " Mrays/s" << std::endl;
+
+                // Rounding the bounds outwards only adds box tests, never changes a hit
+                render->Clear();
+                render->DrawScene();
+                if (quantized)
+                {
+                    CHECK(render->GetBuildReport().node_bytes < full_precision_bytes);
+                    CHECK(render->GetFrameBuffer() == full_precision);
+                }
+                else
+                {
+                    full_precision = render->GetFrameBuffer();
+                    full_precision_bytes = render->GetBuildReport().node_bytes;
+                }
+            }
+        }
+        delete render;
+    }
+}
+
+TEST_CASE("Analytic spheres") {
+    for (unsigned int factor : { 2u, 8u })
+    {
+        std::vector<std::vector<byte3>> frames;
+        for (bool analytic : { false, true })
+        {
+            BVH* render = new BVH(1920, 1080);
+            render->SetAnalyticSpheres(analytic);
+            int result = render->LoadGeometry("models/CornellBox-Sphere.obj");
+            REQUIRE(result == 0);
+            render->SetCamera(float3{ 0.0f, 0.795f, 1.6f }, float3{ 0, 0.795f, -1 }, float3{ 0, 1, 0 });
+            render->AddLight(new Light(float3{ 0, 1.58f, -0.03f }, float3{ 0.78f, 0.78f, 0.78f }));
+            render->SetBranchingFactor(factor);
+            render->SetPacketSize(0);
+            render->BuildBVH();
+
+            // Both tessellated balls become spheres, the walls and the light stay triangles
+            const BVHBuildReport& report = render->GetBuildReport();
+            CHECK(report.sphere_count == (analytic ? 2u : 0u));
+            CHECK(report.triangle_count == (analytic ? 12u : 2188u));
+
+            const std::string name = std::string(analytic ? "Analytic" : "Tessellated") + " spheres BVH" + std::to_string(factor);
+            BENCHMARK(name)
+            {
+                return render->MeasurePrimaryRays();
+            };
+
+            BVHTraversalStats stats = render->MeasurePrimaryRays();
+            std::cout << name << ": " << report.triangle_count << " triangles, "
+                << stats.StepsPerRay() << " nodes/ray, " << stats.RaysPerSecond() / 1e6 << " Mrays/s" << std::endl;
+
+            render->Clear();
+            render->DrawScene();
+            frames.push_back(render->GetFrameBuffer());
+            delete render;
+        }
+
+        // The images only differ where facets and the smooth surface disagree
+        size_t different = 0;
+        for (size_t i = 0; i < frames[0].size(); i++)
+        {
+            different += frames[0][i] == frames[1][i] ? 0 : 1;
+        }
+        CHECK(different < frames[0].size() / 20);
+    }
+}
@@ -0,0 +1,276 @@
+#define CATCH_CONFIG_MAIN
+#define CATCH_CONFIG_ENABLE_BENCHMARKING
+#include "catch.hpp"
+
+#include "test_utils.h"
+
+#include "denoising.h"
+#include "random.h"
+
+#include <cstring>
+#include <omp.h>
+
+// Compared after x / (1 + x), so that a few fireflies do not outweigh the rest of the image
+static double rmse(const std::vector<float3>& image, const std::vector<float3>& reference)
+{
+    double sum = 0.0;
+    for (size_t i = 0; i < image.size(); i++)
+    {
+        for (int c = 0; c < 3; c++)
+        {
+            double difference = image[i][c] / (1.0 + image[i][c]) - reference[i][c] / (1.0 + reference[i][c]);
+            sum += difference * difference / 3.0;
+        }
+    }
+    return std::sqrt(sum / image.size());
+}
+
+// Exposes the report of whatever pass ran last on the scheduler
+class LastPassDenoising : public Denoising
+{
+public:
+    LastPassDenoising(short width, short height) : Denoising(width, height) {};
+    TileReport GetLastPassReport() const { return scheduler.GetReport(); }
+};
+
+TEST_CASE("A-trous filter") {
+    const short width = 320;
+    const short height = 180;
+    Denoising* render = new Denoising(width, height);
+    REQUIRE(render->LoadGeometry("models/CornellBox-Mirror.obj") == 0);
+    render->BuildBVH();
+    render->SetCamera(float3{ -0.5f, 0.99f, 1.5f }, float3{ 0, 0.99f, -1 }, float3{ 0, 1, 0 });
+    render->SetSampler(SamplerType::Sobol);
+
+    render->Clear();
+    render->DrawScene(64);
+    std::vector<float3> reference = render->GetResolvedImage();
+
+    render->Clear();
+    render->DrawScene(4);
+    std::vector<float3> noisy = render->GetResolvedImage();
+
+    render->SetSpatialFilter(5);
+    render->Clear();
+    render->DrawScene(4);
+    std::vector<float3> filtered = render->GetResolvedImage();
+    std::cout << render->GetFilterReport();
+
+    // The 64 spp frame is noisy itself, the filtered 4 spp one still comes much closer to it
+    double noisy_error = rmse(noisy, reference);
+    double filtered_error = rmse(filtered, reference);
+    std::cout << "RMSE against 64 spp: " << noisy_error << " unfiltered, " << filtered_error << " filtered" << std::endl;
+    CHECK(filtered_error < noisy_error * 0.7);
+    delete render;
+}
+
+TEST_CASE("A-trous filter keeps edges") {
+    // A floor meets a wall along a column, each side has its own albedo and normal.
+    // The width is not a multiple of 4 and neither are the tiles.
+    const short width = 83;
+    const short height = 40;
+    const short edge = 41;
+    std::vector<float3> clean(width * height);
+    std::vector<float3> color(width * height);
+    std::vector<float> variance(width * height);
+    std::vector<PixelFeatures> features(width * height);
+    unsigned int state = 1;
+    for (short y = 0; y < height; y++)
+    {
+        for (short x = 0; x < width; x++)
+        {
+            size_t pixel = static_cast<size_t>(y) * width + x;
+            PixelFeatures& feature = features[pixel];
+            feature.primitive = x < edge ? 0 : 1;
+            feature.normal = x < edge ? float3{ 0, 1, 0 } : float3{ 0, 0, 1 };
+            feature.albedo = x < edge ? float3{ 0.8f, 0.8f, 0.8f } : float3{ 0.2f, 0.2f, 0.2f };
+            feature.depth = 2.f;
+            clean[pixel] = feature.albedo * 0.5f;
+            state = state * 1664525u + 1013904223u;
+            float noise = (state >> 8) / static_cast<float>(1 << 24) - 0.5f;
+            color[pixel] = clean[pixel] * (1.f + noise);
+            // Uniform noise as wide as the value has a standard deviation of 0.29 times the value
+            float deviation = 0.29f * clean[pixel].x;
+            variance[pixel] = deviation * deviation;
+        }
+    }
+
+    AtrousFilter filter;
+    TileScheduler scheduler;
+    std::vector<float3> output;
+    filter.Apply(width, height, color, variance, features, output, scheduler);
+    scheduler.SetTileSize(10);
+    std::vector<float3> tiled;
+    filter.Apply(width, height, color, variance, features, tiled, scheduler);
+    CHECK(tiled == output);
+
+    double noisy_error = 0.0;
+    double filtered_error = 0.0;
+    for (size_t i = 0; i < clean.size(); i++)
+    {
+        noisy_error += std::abs(color[i].x - clean[i].x);
+        filtered_error += std::abs(output[i].x - clean[i].x);
+    }
+    CHECK(filtered_error < noisy_error * 0.5);
+
+    // The columns on either side of the edge keep their own brightness
+    for (short x : { static_cast<short>(edge - 1), edge })
+    {
+        float mean = 0.f;
+        for (short y = 0; y < height; y++)
+        {
+            mean += output[static_cast<size_t>(y) * width + x].x / height;
+        }
+        CHECK(std::abs(mean - clean[x].x) < 0.02f);
+    }
+}
+
+TEST_CASE("Adaptive sampling") {
+    Denoising* render = new Denoising(320, 180);
+    REQUIRE(render->LoadGeometry("models/CornellBox-Mirror.obj") == 0);
+    render->BuildBVH();
+    render->SetCamera(float3{ -0.5f, 0.99f, 1.5f }, float3{ 0, 0.99f, -1 }, float3{ 0, 1, 0 });
+    render->SetSampler(SamplerType::Sobol);
+    // Convergence follows the tiles of the scheduler, whatever their size
+    render->SetTileSize(8);
+    render->SetNoiseTarget(0.2f);
+    render->Clear();
+    render->DrawScene(32);
+    const AdaptiveSamplingReport& report = render->GetSamplingReport();
+    std::cout << report;
+
+    CHECK(report.tile_count == 40 * 23);
+    CHECK(report.converged_tiles > 0);
+    CHECK(report.samples < report.fixed_samples);
+    CHECK(report.max_retired_noise < 0.2f);
+
+    // Carrying on counts only the samples traced by this call, not the ones already accumulated
+    render->DrawScene(8);
+    CHECK(report.samples > 0);
+    CHECK(report.samples <= report.fixed_samples);
+    render->SetNoiseTarget(0.f);
+    render->Clear();
+    render->DrawScene(2);
+    render->DrawScene(2);
+    CHECK(report.samples == report.fixed_samples);
+    CHECK(report.fixed_samples == 2 * 320 * 180);
+    delete render;
+}
+
+TEST_CASE("Deterministic frames") {
+    // Every random number is keyed by pixel, sample and bounce, so the worker count and
+    // the order the tiles are taken in do not change a single bit
+    const int max_threads = omp_get_max_threads();
+    for (bool wavefront : { true, false })
+    {
+        std::vector<float3> images[2];
+        std::vector<byte3> frame_buffers[2];
+        for (int run = 0; run < 2; run++)
+        {
+            omp_set_num_threads(run == 0 ? 1 : 4);
+            Denoising* render = new Denoising(160, 90);
+            REQUIRE(render->LoadGeometry("models/CornellBox-Mirror.obj") == 0);
+            render->BuildBVH();
+            render->SetCamera(float3{ -0.5f, 0.99f, 1.5f }, float3{ 0, 0.99f, -1 }, float3{ 0, 1, 0 });
+            render->SetWavefront(wavefront);
+            render->SetSpatialFilter(3);
+            render->Clear();
+            render->DrawScene(3);
+            images[run] = render->GetResolvedImage();
+            frame_buffers[run] = render->GetFrameBuffer();
+            CHECK(render->GetTileReport().worker_count == (run == 0 ? 1u : 4u));
+            delete render;
+        }
+        CHECK(frame_buffers[0] == frame_buffers[1]);
+        CHECK(std::memcmp(images[0].data(), images[1].data(), images[0].size() * sizeof(float3)) == 0);
+    }
+    omp_set_num_threads(max_threads);
+
+    // A generator made for the same pixel, sample and bounce replays the same numbers
+    CounterRng rng(1234, 5, 2);
+    CounterRng replay(1234, 5, 2);
+    CounterRng other_bounce(1234, 5, 3);
+    unsigned int matches = 0;
+    for (int i = 0; i < 64; i++)
+    {
+        unsigned int value = rng.NextUInt();
+        CHECK(replay.NextUInt() == value);
+        matches += other_bounce.NextUInt() == value ? 1 : 0;
+    }
+    CHECK(matches == 0);
+}
+
+TEST_CASE("Tile report of the render pass") {
+    for (bool wavefront : { true, false })
+    {
+        LastPassDenoising* render = new LastPassDenoising(160, 90);
+        REQUIRE(render->LoadGeometry("models/CornellBox-Mirror.obj") == 0);
+        render->BuildBVH();
+        render->SetCamera(float3{ -0.5f, 0.99f, 1.5f }, float3{ 0, 0.99f, -1 }, float3{ 0, 1, 0 });
+        render->SetWavefront(wavefront);
+        render->Clear();
+        render->DrawScene(2);
+        TileReport report = render->GetTileReport();
+        TileReport last_pass = render->GetLastPassReport();
+        std::cout << report;
+
+        // The resolve pass runs last, over the same 10 x 6 tiles of the screen
+        CHECK(last_pass.tile_count == 10 * 6);
+        // Wavefront mode reports the primary rays, 57 chunks of 256 paths in tiles of 16 chunks
+        CHECK(report.tile_count == (wavefront ? 4 : 10 * 6));
+        // Tracing a tile takes far longer than copying its colors out
+        CHECK(report.mean_tile_ms > last_pass.mean_tile_ms);
+        delete render;
+    }
+}
+
+TEST_CASE("Samplers") {
+    std::vector<float3> blue_noise(64 * 64);
+    for (size_t i = 0; i < blue_noise.size(); i++)
+    {
+        float value = (i * 37 % blue_noise.size()) / static_cast<float>(blue_noise.size() - 1) * 2.f - 1.f;
+        blue_noise[i] = float3{ value, -value, value * 0.5f };
+    }
+    const unsigned int sample_count = 16;
+    for (SamplerType type : { SamplerType::Stratified, SamplerType::Sobol, SamplerType::R2, SamplerType::BlueNoise })
+    {
+        std::unique_ptr<Sampler> sampler = CreateSampler(type, sample_count, blue_noise, 64, 320);
+        REQUIRE(sampler != nullptr);
+        unsigned int outside = 0;
+        for (unsigned int pixel = 0; pixel < 320 * 180; pixel += 97)
+        {
+            for (unsigned int sample = 0; sample < 4 * sample_count; sample++)
+            {
+                for (unsigned int dimension = 0; dimension < 16; dimension += 2)
+                {
+                    float value = sampler->Get1D(pixel, sample, dimension);
+                    float2 pair = sampler->Get2D(pixel, sample, dimension);
+                    outside += value < 0.f || value >= 1.f ? 1 : 0;
+                    outside += pair.x < 0.f || pair.x >= 1.f || pair.y < 0.f || pair.y >= 1.f ? 1 : 0;
+                }
+            }
+        }
+        CHECK(outside == 0);
+    }
+    CHECK(CreateSampler(SamplerType::None, sample_count, blue_noise, 64, 320) == nullptr);
+
+    // Every round of grid x grid samples puts one sample into each cell of the grid
+    StratifiedSampler stratified(sample_count);
+    const unsigned int grid = 4;
+    for (unsigned int pixel : { 0u, 1u, 12345u })
+    {
+        for (unsigned int dimension : { 0u, 2u, 6u })
+        {
+            for (unsigned int round = 0; round < 2; round++)
+            {
+                std::vector<int> cells(grid * grid, 0);
+                for (unsigned int sample = round * grid * grid; sample < (round + 1) * grid * grid; sample++)
+                {
+                    float2 value = stratified.Get2D(pixel, sample, dimension);
+                    cells[static_cast<unsigned int>(value.y * grid) * grid + static_cast<unsigned int>(value.x * grid)]++;
+                }
+                CHECK(std::count(cells.begin(), cells.end(), 1) == static_cast<int>(grid * grid));
+            }
+        }
+    }
+}
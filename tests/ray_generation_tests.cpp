@@ -32,6 +32,51 @@ TEST_CASE("Camera tests") {
 
     CHECK(ray.position == float3{ 0, 0, 0 });
     CHECK(ray.direction == normalize(float3{ -0.5, -0.5, 1 }));
+
+    // A jitter of half a pixel is the pixel center
+    for (short y : { 0, 1 })
+    {
+        for (short x : { 0, 1 })
+        {
+            Ray center = camera.GetCameraRay(x, y);
+            Ray jittered = camera.GetCameraRay(x, y, float3{ 0.5f, 0.5f, 0 });
+            CHECK(jittered.position == center.position);
+            CHECK(jittered.direction == center.direction);
+        }
+    }
+}
+
+TEST_CASE("Camera projection") {
+    Camera camera;
+    camera.SetRenderTargetSize(160, 90);
+    camera.SetPosition(float3{ 1, 2, 3 });
+    camera.SetDirection(float3{ 0, 1, -1 });
+    camera.SetUp(float3{ 0, 1, 0 });
+
+    // A point along any camera ray lands back on the pixel it came from
+    for (float3 jitter : { float3{ 0.5f, 0.5f, 0 }, float3{ 0.1f, 0.9f, 0 } })
+    {
+        for (short y : { 0, 45, 89 })
+        {
+            for (short x : { 0, 80, 159 })
+            {
+                Ray ray = camera.GetCameraRay(x, y, jitter);
+                float2 pixel;
+                REQUIRE(camera.Project(ray.position + 3.f * ray.direction, pixel));
+                CHECK(std::abs(pixel.x - (x + jitter.x)) < 1e-3f);
+                CHECK(std::abs(pixel.y - (y + jitter.y)) < 1e-3f);
+            }
+        }
+    }
+
+    float2 pixel;
+    // Behind the camera
+    CHECK(!camera.Project(float3{ 1, 3, 4 }, pixel));
+
+    Camera other = camera;
+    CHECK(other == camera);
+    other.SetPosition(float3{ 1, 2, 3.5f });
+    CHECK(!(other == camera));
 }
 
 TEST_CASE("Ray generation test") {
@@ -46,4 +91,35 @@ TEST_CASE("Ray generation test") {
     };
 
     REQUIRE(validate_framebuffer("references/ray_generation.png", render->GetFrameBuffer()));
-}
\ No newline at end of file
+}
+
+TEST_CASE("Tile scheduler") {
+    TileScheduler scheduler;
+    for (short tile_size : { 1, 7, 16, 64 })
+    {
+        scheduler.SetTileSize(tile_size);
+        // Partial tiles at the right and bottom edges
+        const short width = 101;
+        const short height = 37;
+        std::vector<int> visits(width * height, 0);
+        scheduler.Run(width, height, [&](const Tile& tile)
+        {
+            for (short y = tile.y0; y < tile.y1; y++)
+            {
+                for (short x = tile.x0; x < tile.x1; x++)
+                {
+                    visits[y * width + x]++;
+                }
+            }
+        });
+
+        CHECK(std::count(visits.begin(), visits.end(), 1) == width * height);
+        unsigned int tiles = ((width + tile_size - 1) / tile_size) * ((height + tile_size - 1) / tile_size);
+        TileReport report = scheduler.GetReport();
+        CHECK(report.tile_count == tiles);
+        CHECK(scheduler.GetTimings().size() == tiles);
+        CHECK(report.min_tile_ms <= report.mean_tile_ms);
+        CHECK(report.mean_tile_ms <= report.max_tile_ms);
+        CHECK(report.imbalance >= 1.0);
+    }
+}